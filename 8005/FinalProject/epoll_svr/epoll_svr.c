@@ -39,6 +39,10 @@
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <time.h>
 
 #define SERVER_TCP_PORT 7000  // Default port
 #define BUFLEN	5000           // Buffer length
@@ -66,13 +70,34 @@ struct PrintData {
   int bytes_sent;
 } PrintData;
 
+// a client fd handed from the accept thread to a worker thread
+struct Handoff {
+  _Atomic(struct Handoff*) next;
+  int fd;
+  struct timespec queued;  // when the fd was pushed, to measure wake-up latency
+} Handoff;
+
+// lock-free multi-producer/single-consumer queue of handoffs for one worker thread
+// producers push onto head, the owning worker pops from tail, stub keeps the list non-empty
+// event_fd is registered in the worker's epoll set and signalled after every push
+struct HandoffQueue {
+  _Atomic(struct Handoff*) head;
+  char pad[64 - sizeof(struct Handoff*)];  // keep producers off the consumer's cache line
+  struct Handoff *tail;
+  struct Handoff stub;
+  int event_fd;
+  long long num_handoffs;    // handoffs received by the worker
+  long long wake_usec;       // total usec between push and pop
+  long long max_wake_usec;
+} HandoffQueue;
+
 // listening socket
 int fd;
 int num_clients[THREAD_COUNT];
 int epoll_fd[THREAD_COUNT + 1];
 struct Client connection[EPOLL_QUEUE_LEN]; // index is fd
 pthread_t thread_id[THREAD_COUNT + 1];
-int fd_pipe[THREAD_COUNT][2];
+struct HandoffQueue handoff_queue[THREAD_COUNT]; // new clients for each worker thread
 int out_pipe[2];
 
 void* acceptMethod(void*);
@@ -80,6 +105,10 @@ void* epollMethod(void*);
 static int setupConn(int*);
 static int echo(int, int);
 static int findFewestClients();
+static int initHandoffQueue(struct HandoffQueue*);
+static int pushHandoff(struct HandoffQueue*, int);
+static struct Handoff* popHandoff(struct HandoffQueue*);
+static void clearHandoffSignal(struct HandoffQueue*);
 //static long long timeval_diff(struct timeval*, struct timeval*, struct timeval*);
 FILE* initOutputFile();
 int writeConnection(FILE*, int, int, int);
@@ -160,6 +189,15 @@ int main (int argc, char **argv)
 	// Listen for connections
 	listen(fd, 128);
 
+  // initialize handoff queues before any thread can push to them
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    if (initHandoffQueue(&handoff_queue[i]) == -1)
+    {
+      exit(1);
+    }
+  }
+
   // initialize out_pipe
   if (pipe(out_pipe) < 0)
   {
@@ -270,9 +308,12 @@ void* acceptMethod(void* info_ptr)
         {
           int target_thread = findFewestClients();
 
-          // send client & server fd down thread pipe
-          printf("write to %i pipe: %i\n", target_thread, new_fd);
-          write(fd_pipe[target_thread][1], &new_fd, sizeof(int));
+          // hand client fd to the worker thread
+          printf("queue to %i: %i\n", target_thread, new_fd);
+          if (pushHandoff(&handoff_queue[target_thread], new_fd) == -1)
+          {
+            close(new_fd);
+          }
         }
         else
         {
@@ -293,23 +334,11 @@ void* epollMethod(void* info_ptr)
 
   int i, new_fd, num_fds, conn;
   struct epoll_event events[THREAD_QUEUE_LEN], event;
+  struct HandoffQueue *queue = &handoff_queue[thread_index];
+  struct Handoff *handoff;
 
   num_clients[thread_index] = 0;
 
-  // initialize fd_pipe for thread
-  if (pipe(fd_pipe[thread_index]) < 0)
-  {
-    perror("pipe call");
-    exit(1);
-  }
-
-  // set pipe read as non-blocking
-  if (fcntl(fd_pipe[thread_index][0], F_SETFL, O_NONBLOCK) < 0)
-  {
-    perror("fcntl");
-    exit(1);
-  }
-
   // initialize epoll fd
   epoll_fd[thread_index] = epoll_create(THREAD_QUEUE_LEN);
   if (epoll_fd[thread_index] == -1)
@@ -327,9 +356,20 @@ void* epollMethod(void* info_ptr)
     exit(1);
   }
 
+  // add handoff queue eventfd to epoll loop
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = queue->event_fd;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, queue->event_fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    exit(1);
+  }
+  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+
+  // block until there is work - new clients arrive through the handoff queue's eventfd
   while (TRUE)
   {
-    num_fds = epoll_wait(epoll_fd[thread_index], events, THREAD_QUEUE_LEN, 0);
+    num_fds = epoll_wait(epoll_fd[thread_index], events, THREAD_QUEUE_LEN, -1);
     if (num_fds < 0 && errno != EINTR)
     {
       perror("epoll_wait");
@@ -338,6 +378,30 @@ void* epollMethod(void* info_ptr)
 
     for (i = 0; i < num_fds; i++)
     {
+      // case 0: new clients from the accept thread
+      if (events[i].data.fd == queue->event_fd)
+      {
+        clearHandoffSignal(queue);
+        while ((handoff = popHandoff(queue)) != NULL)
+        {
+          new_fd = handoff->fd;
+          printf("queue %i read new_fd %i (%lld handoffs, avg %lld usec, max %lld usec)\n", thread_index, new_fd,
+            queue->num_handoffs, queue->wake_usec / queue->num_handoffs, queue->max_wake_usec);
+          free(handoff);
+
+          num_clients[thread_index]++;
+
+          // add new fd to epoll loop
+          event.data.fd = new_fd;
+          if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, new_fd, &event) == -1)
+          {
+            perror("epoll_ctl");
+            exit(1);
+          }
+        }
+        continue;
+      }
+
       // case 1: error condition
       if (events[i].events & (EPOLLHUP | EPOLLERR))
       {
@@ -379,22 +443,6 @@ void* epollMethod(void* info_ptr)
       // case 3: read data for fd
       echo(events[i].data.fd, thread_index);
     }
-
-    // check pipe for new connections
-    while (read(fd_pipe[thread_index][0], &new_fd, sizeof(int)) > 0)
-    {
-      printf("pipe %i read new_fd %i\n", thread_index, new_fd);
-
-      num_clients[thread_index]++;
-
-      // add new fd to epoll loop
-      event.data.fd = new_fd;
-      if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, new_fd, &event) == -1)
-      {
-        perror("epoll_ctl");
-        exit(1);
-      }
-    }
   }
   return 0;
 }
@@ -509,6 +557,116 @@ static int findFewestClients()
   return index;
 }
 
+// initialize an empty handoff queue and its eventfd
+// returns 0 if successful, -1 if the eventfd could not be created
+static int initHandoffQueue(struct HandoffQueue *queue)
+{
+  atomic_store(&queue->stub.next, NULL);
+  atomic_store(&queue->head, &queue->stub);
+  queue->tail = &queue->stub;
+  queue->num_handoffs = queue->wake_usec = queue->max_wake_usec = 0;
+
+  if ((queue->event_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+  {
+    perror("eventfd");
+    return -1;
+  }
+  return 0;
+}
+
+static void pushHandoffNode(struct HandoffQueue *queue, struct Handoff *node)
+{
+  struct Handoff *prev;
+
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// hand a client fd to the queue's worker and wake it
+// safe to call from any thread, returns 0 if successful, -1 if the fd could not be queued
+static int pushHandoff(struct HandoffQueue *queue, int fd)
+{
+  struct Handoff *node;
+  uint64_t signal = 1;
+
+  if ((node = malloc(sizeof(*node))) == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+  node->fd = fd;
+  clock_gettime(CLOCK_MONOTONIC, &node->queued);
+
+  pushHandoffNode(queue, node);
+
+  if (write(queue->event_fd, &signal, sizeof(signal)) == -1 && errno != EAGAIN)
+  {
+    perror("eventfd write");
+  }
+  return 0;
+}
+
+// pop the oldest handoff, only called by the queue's worker thread
+// returns NULL if the queue is empty, or a producer is part way through a push
+// (that producer signals event_fd again once its push completes)
+// the caller frees the returned node
+static struct Handoff* popHandoff(struct HandoffQueue *queue)
+{
+  struct Handoff *tail = queue->tail;
+  struct Handoff *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  struct timespec now;
+  long long usec;
+
+  if (tail == &queue->stub)
+  {
+    if (next == NULL)
+    {
+      return NULL;
+    }
+    queue->tail = tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+
+  if (next == NULL)
+  {
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+      return NULL;
+    }
+
+    // tail is the last node, put the stub behind it so tail can be handed out
+    pushHandoffNode(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL)
+    {
+      return NULL;
+    }
+  }
+  queue->tail = next;
+
+  // wake-up latency from push to pop
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  usec = (now.tv_sec - tail->queued.tv_sec) * 1000000LL + (now.tv_nsec - tail->queued.tv_nsec) / 1000;
+  queue->num_handoffs++;
+  queue->wake_usec += usec;
+  if (usec > queue->max_wake_usec)
+  {
+    queue->max_wake_usec = usec;
+  }
+  return tail;
+}
+
+// reset the queue's eventfd before draining it, so a push during the drain wakes the worker again
+static void clearHandoffSignal(struct HandoffQueue *queue)
+{
+  uint64_t count;
+
+  if (read(queue->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+  {
+    perror("eventfd read");
+  }
+}
 
 // calculate difference in time between end_time and start_time (return usec)
 /*static long long timeval_diff(struct timeval *difference, struct timeval *end_time, struct timeval *start_time)
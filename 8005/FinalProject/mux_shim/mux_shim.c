@@ -0,0 +1,651 @@
+/*---------------------------------------------------------------------------------------
+--	SOURCE FILE:		mux_shim.c -   Demultiplexer in front of a server for port_fwd's mux option
+--
+--	PROGRAM:		mux_shim
+--
+--	FUNCTIONS:		Berkeley Socket API
+--
+--	NOTES:
+--	The program accepts the shared backend connections of port_fwd rules with the mux option.
+-- Every stream opened on them is connected to the server as a connection of its own, so the
+-- server needs no changes.  Data is relayed both ways, framed on the shared connection and
+-- plain on the server connection, with the same framing and flow control as port_fwd_mux.c.
+---------------------------------------------------------------------------------------*/
+#define _GNU_SOURCE           // accept4
+#include <netdb.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+
+#define TRUE	1
+#define LISTEN_BACKLOG 128
+#define EPOLL_EVENTS 256
+
+// framing - must match port_fwd_mux.c
+#define MUX_FRAME_OPEN 1
+#define MUX_FRAME_DATA 2
+#define MUX_FRAME_FIN 3
+#define MUX_FRAME_CLOSE 4
+#define MUX_FRAME_WINDOW 5
+#define MUX_HEADER_LEN 8
+#define MUX_FRAME_MAX 16384
+#define MUX_STREAM_WINDOW 65536
+#define MUX_MAX_STREAMS 256
+#define MUX_OUT_HIGH_WATER 262144
+#define MUX_IN_BUFLEN (4 * (MUX_HEADER_LEN + MUX_FRAME_MAX))
+
+// every object registered with epoll is passed as data.ptr and starts with one of these tags
+#define TAG_LISTENER 1
+#define TAG_MUX_CONN 2
+#define TAG_STREAM 3
+
+// stream of a shared connection and its own connection to the server
+struct Stream {
+  int tag;                  // TAG_STREAM
+  int fd;
+  unsigned int id;
+  struct MuxConn *conn;
+  int connecting;
+  char buf[MUX_STREAM_WINDOW];  // data from port_fwd waiting to be written to the server, a ring
+  int head;
+  int len;
+  int send_window;          // bytes port_fwd still accepts from the server
+  int fin_received;         // port_fwd has no more data, the server's sending side is shut once buf is written
+  int write_shut;
+  int read_eof;             // the server closed its sending side and FIN was sent on
+  struct Stream *next_closed;
+} Stream;
+
+// shared connection from port_fwd
+struct MuxConn {
+  int tag;                  // TAG_MUX_CONN
+  int fd;
+  char in[MUX_IN_BUFLEN];   // frames received, the last of them possibly incomplete
+  int in_len;
+  char *out;                // frames waiting to be sent, starting at out_head
+  int out_head;
+  int out_len;
+  int out_cap;
+  int out_blocked;          // the socket stopped taking data, the rest is sent on EPOLLOUT
+  struct Stream *streams[MUX_MAX_STREAMS];  // index is stream id % MUX_MAX_STREAMS
+  struct MuxConn *next_closed;
+} MuxConn;
+
+int epoll_fd;
+// closed streams and connections have their fd set to -1 and are freed after the epoll_wait batch,
+// which may still hold events for them
+struct Stream *closed_streams;
+struct MuxConn *closed_conns;
+int listener_tag = TAG_LISTENER;
+struct sockaddr_in server;
+
+static void acceptConns(int);
+static void muxEvent(struct MuxConn*, uint32_t);
+static void streamEvent(struct Stream*, uint32_t);
+static int queueFrame(struct MuxConn*, unsigned int, int, const char*, int);
+static int flushConn(struct MuxConn*);
+static void closeConn(struct MuxConn*);
+static int handleFrame(struct MuxConn*, unsigned int, int, char*, int);
+static void openStream(struct MuxConn*, unsigned int);
+static void writeStream(struct Stream*);
+static void readStream(struct Stream*);
+static void closeStream(struct Stream*, int);
+static void freeClosed();
+
+int main (int argc, char **argv)
+{
+  int i, listen_fd, num_fds, arg = 1;
+  struct sockaddr_in addr;
+  struct hostent *hp;
+  struct epoll_event events[EPOLL_EVENTS], event;
+
+  if (argc != 4)
+  {
+    fprintf(stderr, "Usage: %s <listen port> <server host> <server port>\n", argv[0]);
+    exit(1);
+  }
+
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(atoi(argv[3]));
+  if ((hp = gethostbyname(argv[2])) == NULL)
+  {
+    fprintf(stderr, "Unknown server address\n");
+    exit(1);
+  }
+  memcpy(&server.sin_addr, hp->h_addr, hp->h_length);
+
+  signal(SIGPIPE, SIG_IGN);
+  if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+  {
+    perror("socket");
+    exit(1);
+  }
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1)
+  {
+    perror("setsockopt");
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(argv[1]));
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(listen_fd, LISTEN_BACKLOG) == -1)
+  {
+    perror("bind/listen");
+    exit(1);
+  }
+
+  if ((epoll_fd = epoll_create1(0)) == -1)
+  {
+    perror("epoll_create1");
+    exit(1);
+  }
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = &listener_tag;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    exit(1);
+  }
+  printf("Demultiplexing port %s to server %s:%s\n", argv[1], argv[2], argv[3]);
+
+  // a single thread serves every shared connection and stream
+  while (TRUE)
+  {
+    if ((num_fds = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1)) == -1 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    for (i = 0; i < num_fds; i++)
+    {
+      switch (*(int*) events[i].data.ptr)
+      {
+        case TAG_LISTENER:
+          acceptConns(listen_fd);
+          break;
+        case TAG_MUX_CONN:
+          muxEvent(events[i].data.ptr, events[i].events);
+          break;
+        case TAG_STREAM:
+          streamEvent(events[i].data.ptr, events[i].events);
+          break;
+      }
+    }
+    freeClosed();
+  }
+  return 0;
+}
+
+// accept every pending shared connection
+static void acceptConns(int listen_fd)
+{
+  struct MuxConn *conn;
+  struct epoll_event event;
+  int fd, nodelay = 1;
+
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) != -1)
+  {
+    if ((conn = calloc(1, sizeof(struct MuxConn))) == NULL)
+    {
+      perror("calloc");
+      close(fd);
+      continue;
+    }
+    conn->tag = TAG_MUX_CONN;
+    conn->fd = fd;
+
+    // frames are batched into each send already, Nagle would only hold small ones back
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1)
+    {
+      perror("setsockopt TCP_NODELAY");
+    }
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+      perror("epoll_ctl");
+      close(fd);
+      free(conn);
+      continue;
+    }
+    printf("Accepted mux connection fd %i\n", fd);
+  }
+}
+
+// read frames from a shared connection, and send what waits for it
+static void muxEvent(struct MuxConn *conn, uint32_t events)
+{
+  int n, len, offset;
+  uint32_t id;
+  uint16_t length;
+
+  if (conn->fd == -1)
+  {
+    return;
+  }
+  if (events & EPOLLERR)
+  {
+    closeConn(conn);
+    return;
+  }
+  if (events & EPOLLOUT)
+  {
+    conn->out_blocked = 0;
+  }
+
+  while (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+  {
+    if ((n = read(conn->fd, conn->in + conn->in_len, MUX_IN_BUFLEN - conn->in_len)) == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      closeConn(conn);
+      return;
+    }
+    else if (n == -1)
+    {
+      break;
+    }
+    conn->in_len += n;
+
+    for (offset = 0; conn->in_len - offset >= MUX_HEADER_LEN; offset += MUX_HEADER_LEN + len)
+    {
+      memcpy(&id, conn->in + offset, 4);
+      memcpy(&length, conn->in + offset + 6, 2);
+      if ((len = ntohs(length)) > MUX_FRAME_MAX)
+      {
+        fprintf(stderr, "Invalid frame on mux connection fd %i\n", conn->fd);
+        closeConn(conn);
+        return;
+      }
+      if (conn->in_len - offset < MUX_HEADER_LEN + len)
+      {
+        break;
+      }
+      if (handleFrame(conn, ntohl(id), conn->in[offset + 4], conn->in + offset + MUX_HEADER_LEN, len) == -1)
+      {
+        fprintf(stderr, "Invalid frame on mux connection fd %i\n", conn->fd);
+        closeConn(conn);
+        return;
+      }
+    }
+    conn->in_len -= offset;
+    memmove(conn->in, conn->in + offset, conn->in_len);
+  }
+
+  if (flushConn(conn) == -1)
+  {
+    closeConn(conn);
+  }
+}
+
+// handle one frame from port_fwd
+// returns 0 if successful, -1 if the frame breaks the protocol
+static int handleFrame(struct MuxConn *conn, unsigned int id, int type, char *payload, int len)
+{
+  struct Stream *stream = conn->streams[id % MUX_MAX_STREAMS];
+  uint32_t n;
+  int tail, first;
+
+  if (type == MUX_FRAME_OPEN)
+  {
+    if (stream != NULL)
+    {
+      return -1;
+    }
+    openStream(conn, id);
+    return 0;
+  }
+
+  // frames of a stream this side already closed are dropped
+  if (stream == NULL || stream->id != id)
+  {
+    return 0;
+  }
+
+  switch (type)
+  {
+    case MUX_FRAME_DATA:
+      if (len > MUX_STREAM_WINDOW - stream->len || stream->fin_received)
+      {
+        return -1;
+      }
+      tail = (stream->head + stream->len) % MUX_STREAM_WINDOW;
+      first = (tail + len > MUX_STREAM_WINDOW) ? MUX_STREAM_WINDOW - tail : len;
+      memcpy(stream->buf + tail, payload, first);
+      memcpy(stream->buf, payload + first, len - first);
+      stream->len += len;
+      writeStream(stream);
+      return 0;
+
+    case MUX_FRAME_FIN:
+      stream->fin_received = 1;
+      writeStream(stream);
+      return 0;
+
+    case MUX_FRAME_CLOSE:
+      closeStream(stream, 0);
+      return 0;
+
+    case MUX_FRAME_WINDOW:
+      if (len != 4)
+      {
+        return -1;
+      }
+      memcpy(&n, payload, 4);
+      stream->send_window += ntohl(n);
+      readStream(stream);
+      return 0;
+  }
+  return -1;
+}
+
+// connect a new stream to the server
+static void openStream(struct MuxConn *conn, unsigned int id)
+{
+  struct Stream *stream;
+  struct epoll_event event;
+
+  if ((stream = calloc(1, sizeof(struct Stream))) == NULL)
+  {
+    perror("calloc");
+    queueFrame(conn, id, MUX_FRAME_CLOSE, NULL, 0);
+    return;
+  }
+  stream->tag = TAG_STREAM;
+  stream->id = id;
+  stream->conn = conn;
+  stream->send_window = MUX_STREAM_WINDOW;
+  conn->streams[id % MUX_MAX_STREAMS] = stream;
+
+  if ((stream->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+  {
+    perror("socket");
+    closeStream(stream, 1);
+    return;
+  }
+  if (connect(stream->fd, (struct sockaddr*) &server, sizeof(server)) == -1)
+  {
+    if (errno != EINPROGRESS)
+    {
+      perror("connect");
+      closeStream(stream, 1);
+      return;
+    }
+    stream->connecting = 1;
+  }
+
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = stream;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stream->fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    closeStream(stream, 1);
+  }
+}
+
+// complete a stream's connect, and relay whichever way its server is ready
+static void streamEvent(struct Stream *stream, uint32_t events)
+{
+  struct MuxConn *conn = stream->conn;
+  int err = 0;
+  socklen_t err_len = sizeof(err);
+
+  if (stream->fd == -1)
+  {
+    return;
+  }
+  if (stream->connecting)
+  {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+      return;
+    }
+    if (getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
+    {
+      fprintf(stderr, "Can't connect stream %u to server: %s\n", stream->id, strerror(err != 0 ? err : errno));
+      closeStream(stream, 1);
+    }
+    else
+    {
+      stream->connecting = 0;
+    }
+  }
+  else if (events & EPOLLERR)
+  {
+    closeStream(stream, 1);
+  }
+
+  if (stream->fd != -1 && (events & EPOLLOUT))
+  {
+    writeStream(stream);
+  }
+  if (stream->fd != -1 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+  {
+    readStream(stream);
+  }
+  if (flushConn(conn) == -1)
+  {
+    closeConn(conn);
+  }
+}
+
+// write what port_fwd sent for the stream to its server, granting port_fwd as much more
+// the server's sending side is shut once port_fwd's FIN was passed on, and the stream is closed once both sides are done
+static void writeStream(struct Stream *stream)
+{
+  uint32_t grant;
+  int n, len, written = 0;
+
+  while (!stream->connecting && stream->len > 0)
+  {
+    len = (stream->head + stream->len > MUX_STREAM_WINDOW) ? MUX_STREAM_WINDOW - stream->head : stream->len;
+    if ((n = write(stream->fd, stream->buf + stream->head, len)) == -1)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        break;
+      }
+      closeStream(stream, 1);
+      return;
+    }
+    stream->len -= n;
+    stream->head = (stream->len == 0) ? 0 : (stream->head + n) % MUX_STREAM_WINDOW;
+    written += n;
+  }
+  if (written > 0)
+  {
+    grant = htonl(written);
+    queueFrame(stream->conn, stream->id, MUX_FRAME_WINDOW, (char*) &grant, 4);
+  }
+
+  if (!stream->connecting && stream->len == 0 && stream->fin_received && !stream->write_shut)
+  {
+    shutdown(stream->fd, SHUT_WR);
+    stream->write_shut = 1;
+  }
+  if (stream->write_shut && stream->read_eof)
+  {
+    closeStream(stream, 0);
+  }
+}
+
+// read from the stream's server as much as port_fwd accepts and the shared connection has room for
+static void readStream(struct Stream *stream)
+{
+  struct MuxConn *conn = stream->conn;
+  char buf[MUX_FRAME_MAX];
+  int n, len;
+
+  while (stream->fd != -1 && !stream->connecting && !stream->read_eof && stream->send_window > 0 && conn->out_len < MUX_OUT_HIGH_WATER)
+  {
+    len = (stream->send_window < MUX_FRAME_MAX) ? stream->send_window : MUX_FRAME_MAX;
+    if ((n = read(stream->fd, buf, len)) == -1)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        closeStream(stream, 1);
+      }
+      return;
+    }
+    if (n == 0)
+    {
+      stream->read_eof = 1;
+      queueFrame(conn, stream->id, MUX_FRAME_FIN, NULL, 0);
+      if (stream->write_shut)
+      {
+        closeStream(stream, 0);
+      }
+      return;
+    }
+    queueFrame(conn, stream->id, MUX_FRAME_DATA, buf, n);
+    stream->send_window -= n;
+  }
+}
+
+// close a stream's server connection and forget it, telling port_fwd if it is closed from this side
+static void closeStream(struct Stream *stream, int tell)
+{
+  if (tell)
+  {
+    queueFrame(stream->conn, stream->id, MUX_FRAME_CLOSE, NULL, 0);
+  }
+  stream->conn->streams[stream->id % MUX_MAX_STREAMS] = NULL;
+  if (stream->fd != -1)
+  {
+    close(stream->fd);
+    stream->fd = -1;
+  }
+  stream->next_closed = closed_streams;
+  closed_streams = stream;
+}
+
+// append a frame to a shared connection's send buffer
+// returns 0 if successful, -1 if the buffer could not grow
+static int queueFrame(struct MuxConn *conn, unsigned int id, int type, const char *payload, int len)
+{
+  char *frame, *out;
+  uint32_t net_id = htonl(id);
+  uint16_t length = htons(len);
+  int cap;
+
+  if (conn->out_head > 0 && conn->out_head + conn->out_len + MUX_HEADER_LEN + len > conn->out_cap)
+  {
+    memmove(conn->out, conn->out + conn->out_head, conn->out_len);
+    conn->out_head = 0;
+  }
+  if (conn->out_len + MUX_HEADER_LEN + len > conn->out_cap)
+  {
+    for (cap = (conn->out_cap > 0) ? conn->out_cap : MUX_IN_BUFLEN; cap < conn->out_len + MUX_HEADER_LEN + len; cap *= 2);
+    if ((out = realloc(conn->out, cap)) == NULL)
+    {
+      perror("realloc");
+      return -1;
+    }
+    conn->out = out;
+    conn->out_cap = cap;
+  }
+
+  frame = conn->out + conn->out_head + conn->out_len;
+  memcpy(frame, &net_id, 4);
+  frame[4] = type;
+  frame[5] = 0;
+  memcpy(frame + 6, &length, 2);
+  memcpy(frame + MUX_HEADER_LEN, payload, len);
+  conn->out_len += MUX_HEADER_LEN + len;
+  return 0;
+}
+
+// send as much of a shared connection's send buffer as it will take
+// once it drains below MUX_OUT_HIGH_WATER, the streams that stopped reading for it are read again
+// returns 0 if successful, -1 if the connection failed
+static int flushConn(struct MuxConn *conn)
+{
+  int i, n, was_full;
+
+  if (conn->fd == -1)
+  {
+    return 0;
+  }
+  while (TRUE)
+  {
+    was_full = conn->out_len >= MUX_OUT_HIGH_WATER;
+    while (!conn->out_blocked && conn->out_len > 0)
+    {
+      if ((n = send(conn->fd, conn->out + conn->out_head, conn->out_len, MSG_NOSIGNAL)) == -1)
+      {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+          conn->out_blocked = 1;
+          break;
+        }
+        perror("send");
+        return -1;
+      }
+      conn->out_len -= n;
+      conn->out_head = (conn->out_len == 0) ? 0 : conn->out_head + n;
+    }
+    if (!was_full || conn->out_len >= MUX_OUT_HIGH_WATER)
+    {
+      return 0;
+    }
+    for (i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+      if (conn->streams[i] != NULL)
+      {
+        readStream(conn->streams[i]);
+      }
+    }
+  }
+}
+
+// close a shared connection and all of its streams
+static void closeConn(struct MuxConn *conn)
+{
+  int i;
+
+  printf("Closed mux connection fd %i\n", conn->fd);
+  for (i = 0; i < MUX_MAX_STREAMS; i++)
+  {
+    if (conn->streams[i] != NULL)
+    {
+      closeStream(conn->streams[i], 0);
+    }
+  }
+  close(conn->fd);
+  conn->fd = -1;
+  conn->next_closed = closed_conns;
+  closed_conns = conn;
+}
+
+// free the streams and connections closed while handling the last epoll_wait batch
+static void freeClosed()
+{
+  struct Stream *stream;
+  struct MuxConn *conn;
+
+  while ((stream = closed_streams) != NULL)
+  {
+    closed_streams = stream->next_closed;
+    free(stream);
+  }
+  while ((conn = closed_conns) != NULL)
+  {
+    closed_conns = conn->next_closed;
+    free(conn->out);
+    free(conn);
+  }
+}
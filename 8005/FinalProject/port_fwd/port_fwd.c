@@ -21,6 +21,7 @@
 --	The program will accept TCP connections from client machines.
 -- The program will read data from the client socket and simply forward it to destination.
 ---------------------------------------------------------------------------------------*/
+#define _GNU_SOURCE           // splice
 #include <netdb.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -33,20 +34,31 @@
 #include <pthread.h>
 #include <sys/syscall.h>
 #include <sys/epoll.h>
-//#include <time.h>
+#include <time.h>
 #include <sys/time.h>
 #include <errno.h>
 #include <assert.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#define ENGINE_EPOLL 0  // readiness-based relay with epoll and non-blocking sockets
+#define ENGINE_URING 1  // completion-based relay with one io_uring per worker thread
+
+int engine = ENGINE_EPOLL; // the reader refuses rules the engine cannot relay
 
 #include "port_fwd_reader.c"
+#include "port_fwd_queue.c"
 
-#define BUFLEN	5000           // Buffer length
+#define RELAY_BUFLEN 65536     // Relay buffer length per direction (default pipe capacity)
+#define RELAY_HIGH_WATER 49152 // Stop reading from a fd once this many of its bytes are buffered
 #define TRUE	1
 #define THREAD_COUNT 8
-#define EPOLL_QUEUE_LEN 80000
-#define THREAD_QUEUE_LEN EPOLL_QUEUE_LEN/THREAD_COUNT
+#define WORKER_EVENTS 1024     // Max events a worker thread handles per epoll_wait
+#define LISTEN_BACKLOG 128
+#define ACCEPT_BATCH 64        // Max connections a worker accepts per listener event in sharded mode
+#define ACCEPT_EVENTS 256      // Max listener events the accept thread handles per epoll_wait
 #define FILENAME "port_fwd_connections.txt"
 
 // parameter for thread function
@@ -54,49 +66,272 @@ struct ThreadInfo {
   int thread_index;
 } ThreadInfo;
 
-struct Client {
-  struct sockaddr_in client;
-  int bytes_sent;
-  int num_requests;
-  struct timeval last_seen;
-} Client;
-
+// one end of a client-server pair
 struct EndPointFd {
+  int tag;          // TAG_END_POINT
+  int fd;
   int is_client;
-  int alt_fd;
+  struct EndPointFd *alt;    // other end of the pair, NULL once the pair is closed
+  struct ConnPair *pair;
+  struct sockaddr_in addr;   // address of the client or server
+  long long bytes_sent;
+  long long num_requests;
+  struct timespec buffered_since;  // CLOCK_MONOTONIC time the relay buffer last went from empty to holding data
+  int connecting;   // 1 while a non-blocking connect to the server is in progress on this fd
+  int pipe_fd[2];   // kernel pipe carrying data read from this fd, -1 if relaying by copy
+  char *ring;       // ring buffer carrying data read from this fd when relaying by copy
+  int buf_len;      // length of ring, or capacity of pipe_fd, while either is allocated
+  int ring_head;    // offset of the first unsent byte in ring
+  int buffered;     // bytes read from this fd but not yet sent to alt_fd
+  int read_eof;     // this fd has closed its sending side
+  int write_shut;   // the close has been passed on to this fd with SHUT_WR
+  int want_write;   // EPOLLOUT is armed on this fd
+  // epoll engine - turns and bandwidth caps for reading from this fd
+  int sched_state;  // TURN_IDLE unless waiting in a queue of the worker's RelaySched
+  struct EndPointFd *sched_prev;   // neighbours in that queue
+  struct EndPointFd *sched_next;
+  long long resume_nsec;           // CLOCK_MONOTONIC time a throttled fd may read again
+  long long throttled_nsec;        // CLOCK_MONOTONIC time it was throttled
+  struct TokenBucket client_bucket; // tokens for the rule's client_bandwidth, in this direction
+  // epoll engine - server end carried as a stream of a shared backend connection, fd is then -1
+  struct MuxConn *mux;      // connection carrying the stream, NULL unless the rule has the mux option
+  unsigned int stream_id;
+  int send_window;          // bytes of client data the stream may still send before the server grants more
+  // io_uring engine - data received on this fd waits in provided buffers, linked by buffer id
+  int send_head;    // first buffer to send to alt, -1 if none
+  int send_tail;
+  int send_offset;  // bytes of the first buffer already sent
+  int sends_in_flight;
+  int recv_armed;   // a multishot receive is in flight on this fd
+  int recv_cancelled; // the receive was cancelled to stop reading while alt is behind
+  struct EndPointFd *next_starved; // next receive waiting for free buffers
 } EndPointFd;
 
+// connection to the mirror of a pair's rule, sent a copy of the client's data, epoll engine only
+struct MirrorEnd {
+  int tag;          // TAG_MIRROR
+  int fd;           // -1 if the pair has no mirror, or it was cut off
+  int thread_index; // worker relaying the pair
+  int connecting;   // 1 while the non-blocking connect to the mirror is in progress
+  int pipe_fd[2];   // kernel pipe holding client data copied for the mirror
+  int pipe_len;     // capacity of pipe_fd
+  int buffered;     // bytes in pipe_fd not yet sent to the mirror
+  int ahead;        // bytes at the front of the client's relay pipe already copied to pipe_fd
+  int write_shut;   // the client's close has been passed on to the mirror with SHUT_WR
+  struct ConnPair *pair;
+} MirrorEnd;
+
+// client-server pair, allocated from the owning worker thread's pool and passed to epoll as data.ptr
+struct ConnPair {
+  struct EndPointFd clnt;
+  struct EndPointFd svr;
+  struct MirrorEnd mirror;
+  struct RouteTable *table;    // route table the pair was connected with, referenced until the pair is closed
+  struct PortForward *route;   // rule the pair was connected with
+  struct Backend *backend;     // pool member the server end is connected to
+  struct timespec connect_start; // CLOCK_MONOTONIC time the server connect was started
+  unsigned long last_active;     // timer wheel tick of the last relay on either end
+  int timer_slot;                // timer wheel slot holding the pair, -1 unless its rule has an idle timeout
+  struct ConnPair *timer_prev;   // neighbours in the timer wheel slot
+  struct ConnPair *timer_next;
+  int uring_ops;                 // io_uring requests in flight that refer to the pair
+  int closing;                   // io_uring engine - the pair waits for its requests to complete before it is freed
+  unsigned long placed_tick;     // timer wheel tick the pair was placed on its current worker
+  unsigned long load_window;     // load interval of the worker that window_bytes was counted in
+  unsigned long window_bytes;    // bytes relayed by the pair in that interval
+  unsigned int capture_id;       // connection id of the pair in the capture file, 0 if it is not captured
+  struct ConnSlab *slab;       // slab the pair was allocated from
+  struct ConnPair *next_free;  // next free pair in the slab
+} ConnPair;
+
 struct PrintData {
   int recv_fd;
   int send_fd;
-  int num_requests;
-  int bytes_sent;
+  long long num_requests;
+  long long bytes_sent;
 } PrintData;
 
 int epoll_fd[THREAD_COUNT + 1];
-int num_clients[THREAD_COUNT];
-struct Client connection[EPOLL_QUEUE_LEN]; // index is fd
-struct EndPointFd end_point[EPOLL_QUEUE_LEN]; // index is fd
+_Atomic int num_clients[THREAD_COUNT]; // pairs of each worker thread, only written by that worker
 pthread_t thread_id[THREAD_COUNT + 1];
-int fd_pipe[THREAD_COUNT][2];
+struct HandoffQueue handoff_queue[THREAD_COUNT]; // new client-server pairs for each worker thread
 int out_pipe[2];
+int debug_log = 0; // log every relayed message through out_pipe
+int shard_listeners = 0; // each worker accepts on its own SO_REUSEPORT listener per port
+struct RouteTable *route_table; // current route table, only replaced by the reloader
+pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER; // held while route_table is replaced or refreshed
+
+#include "port_fwd_resolver.c"
+#include "port_fwd_health.c"
+#include "port_fwd_balance.c"
+#include "port_fwd_memory.c"
+#include "port_fwd_pool.c"
+#include "port_fwd_timer.c"
+#include "port_fwd_load.c"
+#include "port_fwd_heavy.c"
+#include "port_fwd_stats.c"
+#include "port_fwd_admit.c"
+#include "port_fwd_shape.c"
+#include "port_fwd_rcu.c"
+#include "port_fwd_listener.c"
+#include "port_fwd_reload.c"
+#include "port_fwd_metrics.c"
+#include "port_fwd_upgrade.c"
+
+struct ConnPool conn_pool[THREAD_COUNT]; // client-server pairs of each worker thread
 
 void* acceptMethod(void*);
 void* epollMethod(void*);
-static int setupConn(int, int*);
-static int forward(int, int);
-static int findFewestClients();
+static int acceptClient(struct Listener*, int*, struct sockaddr_in*, int);
+static struct ConnPair* setupConn(int, struct PortForward*, int, struct sockaddr_in*);
+static void dropClient(struct PortForward*, int, int);
+static int setupPipes(struct ConnPair*);
+static void startPair(int, struct ConnPair*);
+static void finishPair(int, struct ConnPair*);
+static void addConnection(int, struct ConnPair*);
+static void migratePair(int, struct ConnPair*, int);
+static void adoptPair(int, struct ConnPair*);
+static void setWriteInterest(struct EndPointFd*, int, int);
+static void relayEvent(struct EndPointFd*, uint32_t, int);
+static int finishConnect(struct EndPointFd*, int);
+static int fillBuffer(struct EndPointFd*, long long);
+static int flushBuffer(struct EndPointFd*);
+static int forward(struct EndPointFd*, int);
+static void resetEndPoint(struct EndPointFd*);
+static void closeConnection(struct EndPointFd*, int);
 //static long long timeval_diff(struct timeval*, struct timeval*, struct timeval*);
 FILE* initOutputFile();
-int writeConnection(FILE*, int, int, int, int);
+int writeConnection(FILE*, int, int, long long, long long);
 void closeFd(int);
 
+#include "port_fwd_uring.c"
+#include "port_fwd_mux.c"
+#include "port_fwd_mirror.c"
+#include "port_fwd_capture.c"
+
 int main (int argc, char **argv)
 {
-	int	i, fd;
-	struct sockaddr_in server;
+	int	i, opt, accept_thread, upgrade_conn = -1;
+  char *endptr;
   struct ThreadInfo *info_ptr;
   struct sigaction act;
+  struct rlimit fd_limit;
+  struct Listener *listener;
+  struct epoll_event event;
+  sigset_t mask;
+  pthread_t resolver_thread, reload_thread, health_thread, stats_thread, upgrade_thread, capture_thread;
+
+  while ((opt = getopt(argc, argv, "rbe:d:s:m:c:a:l:u:w:v")) != -1)
+  {
+    switch (opt)
+    {
+      case 'r':
+        shard_listeners = 1;
+        break;
+      case 'b':
+        migrate_pairs = 1;
+        break;
+      case 'e':
+        if (strcmp(optarg, "epoll") == 0)
+        {
+          engine = ENGINE_EPOLL;
+        }
+        else if (strcmp(optarg, "uring") == 0)
+        {
+          engine = ENGINE_URING;
+        }
+        else
+        {
+          fprintf(stderr, "Invalid engine: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'd':
+        errno = 0;
+        dns_ttl = strtol(optarg, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || dns_ttl < 0)
+        {
+          fprintf(stderr, "Invalid DNS TTL: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 's':
+        errno = 0;
+        stats_interval = strtol(optarg, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || stats_interval < 0)
+        {
+          fprintf(stderr, "Invalid statistics interval: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'm':
+        errno = 0;
+        metrics_port = strtol(optarg, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || metrics_port < 1 || metrics_port > MAX_PORT)
+        {
+          fprintf(stderr, "Invalid metrics port: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'c':
+        errno = 0;
+        max_conns = strtol(optarg, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || max_conns < 0)
+        {
+          fprintf(stderr, "Invalid connection limit: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'a':
+        errno = 0;
+        accept_rate = strtol(optarg, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || accept_rate < 0)
+        {
+          fprintf(stderr, "Invalid accept rate: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'l':
+        if (parseByteRate(optarg, &mem_cap) == -1)
+        {
+          fprintf(stderr, "Invalid memory cap: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'u':
+        upgrade_path = optarg;
+        break;
+      case 'w':
+        capture_path = optarg;
+        break;
+      case 'v':
+        debug_log = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-r] [-b] [-e epoll|uring] [-d dns_ttl] [-s stats_interval] [-m metrics_port] [-c max_conns] [-a accept_rate] [-l memory_cap] [-u upgrade_socket] [-w capture_file] [-v]\n", argv[0]);
+        fprintf(stderr, "  -r  shard listeners - each worker thread accepts on its own SO_REUSEPORT socket per port\n");
+        fprintf(stderr, "  -b  rebalance - move heavy long-lived pairs from overloaded worker threads to idle ones (epoll engine)\n");
+        fprintf(stderr, "  -e  relay engine - epoll readiness or io_uring completions (default epoll)\n");
+        fprintf(stderr, "  -d  seconds between re-resolving server addresses, 0 to resolve only at startup (default %i)\n", DNS_TTL);
+        fprintf(stderr, "  -s  seconds between statistics reports, 0 to disable (default %i)\n", STATS_INTERVAL);
+        fprintf(stderr, "  -m  serve metrics for scraping on this port of localhost (default off)\n");
+        fprintf(stderr, "  -c  client-server pairs relayed at once over all ports, 0 for no limit (default 0)\n");
+        fprintf(stderr, "  -a  clients accepted per second over all ports, 0 for no limit (default 0)\n");
+        fprintf(stderr, "  -l  bytes of memory for pairs, relay buffers and pipes, with an optional k, m or g suffix, 0 for no cap (default 0)\n");
+        fprintf(stderr, "  -u  take over the listeners of the port forwarder waiting on this unix socket, then wait on it for a successor\n");
+        fprintf(stderr, "  -w  capture every relayed connection to this file, for replay with tcp_replay (epoll engine)\n");
+        fprintf(stderr, "  -v  debug - log every relayed message to %s\n", FILENAME);
+        exit(1);
+    }
+  }
+
+  initTokenBucket(&accept_bucket, accept_rate, accept_rate);
+
+  if (capture_path != NULL && engine != ENGINE_EPOLL)
+  {
+    fprintf(stderr, "Capture needs the epoll engine\n");
+    exit(1);
+  }
 
   // setup the signal handler to close the server socket when CTRL-c is received
   act.sa_handler = closeFd;
@@ -107,71 +342,112 @@ int main (int argc, char **argv)
     exit(1);
   }
 
+  // a peer closing mid-splice must not kill the process, the failed send is handled instead
+  act.sa_handler = SIG_IGN;
+  if (sigaction(SIGPIPE, &act, NULL) == -1)
+  {
+    perror("Failed to ignore SIGPIPE");
+    exit(1);
+  }
+
+  // SIGHUP reloads the port forward table, it is received by the reloader thread alone
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+  if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0)
+  {
+    perror("Failed to block SIGHUP");
+    exit(1);
+  }
+
   // read port forward table
-  if ((i = readPortFwdTable()) == -1)
+  if ((route_table = readPortFwdTable()) == NULL)
   {
     perror("port forward table");
     exit(1);
   }
 
-  // initialize connections
-  for (i = 0; i < EPOLL_QUEUE_LEN; i++)
+  // connections are only limited by the fd limit, so raise it as far as allowed
+  if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max)
   {
-    connection[i].bytes_sent = -1;
+    fd_limit.rlim_cur = fd_limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &fd_limit) == -1)
+    {
+      perror("setrlimit");
+    }
+  }
+  if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0)
+  {
+    printf("File descriptor limit %llu\n", (unsigned long long) fd_limit.rlim_cur);
   }
 
-  // setup server address
-  memset(&server, 0, sizeof(struct sockaddr_in));
-  server.sin_family = AF_INET;
-  server.sin_addr.s_addr = htonl(INADDR_ANY); // accept connections from any client
+  // the accept thread only runs when listeners are shared by epoll workers, io_uring workers accept for themselves
+  accept_thread = (engine == ENGINE_EPOLL && !shard_listeners);
 
-	// Create stream sockets for each incoming port
-  for (i = 0; i < num_port_fwd; i++)
+  // initialize epoll fds up front, so listeners can be added to them before the threads start and on reload
+  for (i = 0; i < THREAD_COUNT + accept_thread && engine == ENGINE_EPOLL; i++)
   {
-    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    if ((epoll_fd[i] = epoll_create(WORKER_EVENTS)) == -1)
     {
-      perror("Can't create a socket");
+      perror("epoll_create");
       exit(1);
     }
+  }
 
-    // reuse address socket option
-    int arg = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1)
+  // add each thread's wake eventfd to its epoll loop, io_uring workers poll theirs on their ring
+  if (initRcu(accept_thread) == -1)
+  {
+    exit(1);
+  }
+  for (i = 0; i < THREAD_COUNT + accept_thread && engine == ENGINE_EPOLL; i++)
+  {
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &rcu_thread[i];
+    if (epoll_ctl(epoll_fd[i], EPOLL_CTL_ADD, rcu_thread[i].wake_fd, &event) == -1)
     {
-      perror("Can't set socket option");
+      perror("epoll_ctl");
       exit(1);
     }
+  }
 
-    // set port for socket and bind address to the socket
-    server.sin_port = htons(port_config[i].rcv_port);
+  // take over the listening sockets of a running port forwarder, if one waits on the upgrade socket
+  if (upgrade_path != NULL)
+  {
+    upgrade_conn = requestListeners(upgrade_path);
+  }
 
-    if (bind(fd, (struct sockaddr *)&server, sizeof(server)) == -1)
+	// Create stream sockets for each incoming port - one per worker thread when sharded
+  for (i = 0; i < route_table->num_ports; i++)
+  {
+    if ((listener = openListener(route_table->ports[i].port, route_table->ports[i].route)) == NULL || updateListenerEpoll(listener, EPOLL_CTL_ADD) == -1)
     {
-      perror("Can't bind name to socket");
       exit(1);
     }
+    listener_by_port[listener->port] = listener;
+  }
+  atomic_fetch_add_explicit(&listener_generation, 1, memory_order_release);
 
-    // make socket fd non-blocking
-    if (fcntl(fd, F_SETFL, O_NONBLOCK | fcntl(fd, F_GETFL, 0)) == -1)
+  // initialize handoff queues before any thread can push to them
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    if (initHandoffQueue(&handoff_queue[i]) == -1)
     {
-      perror("fcntl");
       exit(1);
     }
-
-    // listen for connections
-    listen(fd, 128);
-
-    // associate fd with port forward table
-    port_config[i].fd = fd;
   }
 
-  // initialize out pipe
-  if (pipe(out_pipe) < 0)
+  // initialize out pipe for debug logging
+  if (debug_log && pipe(out_pipe) < 0)
   {
     perror("pipe call");
     exit(1);
   }
 
+  // open the capture file before any pair can be captured
+  if (capture_path != NULL && initCapture(capture_path) == -1)
+  {
+    exit(1);
+  }
+
   // create child threads
   for (i = 0; i < THREAD_COUNT; i++)
   {
@@ -182,19 +458,87 @@ int main (int argc, char **argv)
       exit(1);
     }
     info_ptr->thread_index = i;
-    pthread_create(&thread_id[i], NULL, epollMethod, (void*) info_ptr);
+    pthread_create(&thread_id[i], NULL, (engine == ENGINE_URING) ? uringMethod : epollMethod, (void*) info_ptr);
     printf("Created thread %lu %i\n", (unsigned long) thread_id[i], i);
   }
 
-  // create thread for accepting clients
-  if ((info_ptr = malloc(sizeof (struct ThreadInfo))) == NULL)
+  // create thread for reloading the port forward table
+  pthread_create(&reload_thread, NULL, reloadMethod, NULL);
+  printf("Created reloader thread %lu\n", (unsigned long) reload_thread);
+
+  // create thread for checking the health of servers
+  pthread_create(&health_thread, NULL, healthMethod, NULL);
+  printf("Created health checker thread %lu\n", (unsigned long) health_thread);
+
+  // create thread for refreshing cached server addresses
+  if (dns_ttl > 0)
   {
-    perror("malloc");
-    exit(1);
+    pthread_create(&resolver_thread, NULL, resolverMethod, NULL);
+    printf("Created resolver thread %lu\n", (unsigned long) resolver_thread);
+  }
+
+  // create thread for accepting clients, sharded and io_uring workers accept for themselves
+  if (accept_thread)
+  {
+    if ((info_ptr = malloc(sizeof (struct ThreadInfo))) == NULL)
+  {
+      perror("malloc");
+      exit(1);
+    }
+    info_ptr->thread_index = THREAD_COUNT;
+    pthread_create(&thread_id[THREAD_COUNT], NULL, acceptMethod, (void*) info_ptr);
+    printf("Created thread %lu %i\n", (unsigned long) thread_id[THREAD_COUNT], THREAD_COUNT);
+  }
+
+  // create thread for writing out the capture, so workers never wait on the file
+  if (capture_path != NULL)
+  {
+    pthread_create(&capture_thread, NULL, captureMethod, NULL);
+    printf("Created capture thread %lu writing %s\n", (unsigned long) capture_thread, capture_path);
+  }
+
+  // create thread for reporting statistics
+  if (stats_interval > 0)
+  {
+    pthread_create(&stats_thread, NULL, statsMethod, NULL);
+    printf("Created statistics thread %lu\n", (unsigned long) stats_thread);
+  }
+
+  // create thread for serving metrics, it only reads counters so the workers never wait on a scrape
+  if (metrics_port > 0)
+  {
+    if (initMetrics(metrics_port) == -1)
+    {
+      exit(1);
+    }
+    pthread_create(&metrics_thread, NULL, metricsMethod, NULL);
+    printf("Created metrics thread %lu on port %i\n", (unsigned long) metrics_thread, metrics_port);
+  }
+
+  // every thread accepts, so the old process can stop - then wait on the upgrade socket for this process's successor
+  if (upgrade_path != NULL)
+  {
+    closeInheritedFds();
+    if (upgrade_conn != -1)
+    {
+      completeUpgrade(upgrade_conn);
+    }
+    if (initUpgrade(upgrade_path) == -1)
+    {
+      exit(1);
+    }
+    pthread_create(&upgrade_thread, NULL, upgradeMethod, NULL);
+    printf("Created upgrade thread %lu on %s\n", (unsigned long) upgrade_thread, upgrade_path);
+  }
+
+  // without debug logging the main thread has nothing left to do until SIGINT
+  if (!debug_log)
+  {
+    while (TRUE)
+    {
+      pause();
+    }
   }
-  info_ptr->thread_index = THREAD_COUNT;
-  pthread_create(&thread_id[THREAD_COUNT], NULL, acceptMethod, (void*) info_ptr);
-  printf("Created thread %lu %i\n", (unsigned long) thread_id[THREAD_COUNT], THREAD_COUNT);
 
   FILE *file;
   if ((file = initOutputFile()) == NULL)
@@ -204,19 +548,18 @@ int main (int argc, char **argv)
   }
 
   // log outputs to file
-  struct PrintData *print_data = malloc(sizeof(*print_data));
+  struct PrintData print_data;
   while (TRUE)
   {
     // read pipe
-    if (read(out_pipe[0], print_data, sizeof(*print_data)) > 0)
+    if (read(out_pipe[0], &print_data, sizeof(print_data)) > 0)
     {
-      writeConnection(file, print_data->recv_fd, print_data->send_fd, print_data->num_requests, print_data->bytes_sent);
+      writeConnection(file, print_data.recv_fd, print_data.send_fd, print_data.num_requests, print_data.bytes_sent);
     }
   }
 
   fclose(file);
-	close(fd);
-  freePortFwdTable();
+  releaseRouteTable(route_table);
   exit(0);
 }
 
@@ -227,79 +570,81 @@ void* acceptMethod(void* info_ptr)
   // free info_ptr after it was used
   free(info_ptr);
 
-  int i, j, num_fds, conn, new_fd[2];
-  struct epoll_event events[num_port_fwd], event;
-
-  // initialize epoll fd
-  epoll_fd[thread_index] = epoll_create(num_port_fwd);
-  if (epoll_fd[thread_index] == -1)
-  {
-    perror("epoll_create");
-    exit(1);
-  }
-
-  // add all socket fds to epoll loop
-  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+  int i, num_fds, conn, clnt_fd;
+  struct epoll_event events[ACCEPT_EVENTS];
+  struct Listener *listener;
+  struct PortForward *route;
+  struct sockaddr_in client;
+  struct timespec busy_start;
 
-  for (i = 0; i < num_port_fwd; i++)
-  {
-    event.data.fd = port_config[i].fd;
-    if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, port_config[i].fd, &event) == -1)
-    {
-      perror("epoll_ctl");
-      exit(1);
-    }
-  }
+  initReserveFd(thread_index);
 
+  // listeners were added to the epoll loop by main, and are added or removed by the reloader
   while (TRUE)
   {
-    num_fds = epoll_wait(epoll_fd[thread_index], events, num_port_fwd, -1);
+    rcuQuiescent(thread_index);
+    num_fds = epoll_wait(epoll_fd[thread_index], events, ACCEPT_EVENTS, -1);
     if (num_fds < 0 && errno != EINTR)
     {
       perror("epoll_wait");
       exit(1);
     }
+    clock_gettime(CLOCK_MONOTONIC, &busy_start);
 
     for (i = 0; i < num_fds; i++)
     {
-      // case 1: error condition
+      // case 1: woken to pass a quiescent state
+      if (*(int*) events[i].data.ptr == TAG_RCU_WAKE)
+      {
+        clearRcuWake(thread_index);
+        continue;
+      }
+      listener = events[i].data.ptr;
+
+      // case 2: error condition - stop waiting on the listener, the reloader closes it
       if (events[i].events & (EPOLLHUP | EPOLLERR))
       {
         perror("accept epoll error");
-        close(events[i].data.fd);
+        epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_DEL, listener->fd, NULL);
         continue;
       }
       assert(events[i].events & EPOLLIN);
 
-      // case 2: connection request - check which port the request is coming from
-      for (j = 0; j < num_port_fwd; j++)
+      // case 3: connection request on the listener's port
+      while ((conn = acceptClient(listener, &clnt_fd, &client, thread_index)) != 1)
       {
-        if (events[i].data.fd == port_config[j].fd)
+        int target_thread;
+
+        if (conn == 2)
         {
-          while (TRUE)
-          {
-            if ((conn = setupConn(j, new_fd)) == -1)
-            {
-              exit(1);
-            }
-            else if (conn == 0)
-            {
-              int target_thread = findFewestClients();
+          continue;
+        }
 
-              // send client & server fd down thread pipe
-              printf("write to %i pipe: %i, %i\n", target_thread, new_fd[0], new_fd[1]);
-              write(fd_pipe[target_thread][1], &new_fd[0], sizeof(int));
-              write(fd_pipe[target_thread][1], &new_fd[1], sizeof(int));
-            }
-            else
-            {
-              break;
-            }
-          }
-          break;
+        route = listenerRoute(listener);
+        addStat(&worker_stats[thread_index].accepted, 1);
+        addStat(&route->stats[thread_index].accepted, 1);
+        if (admitClient(route) == -1)
+        {
+          rejectClient(thread_index, route, clnt_fd);
+          continue;
+        }
+
+        // the queued client keeps the rule's route table alive until it is connected
+        acquireRouteTable(route->table);
+
+        // hand client fd to the worker thread, which connects it to the server
+        // a worker too far behind to take it means the forwarder is overloaded, so the client is rejected
+        target_thread = placeNewPair();
+        printf("queue to %i: %i\n", target_thread, clnt_fd);
+        if (pushHandoff(&handoff_queue[target_thread], clnt_fd, &client, route) == -1)
+        {
+          rejectClient(thread_index, route, clnt_fd);
+          releaseClient(route);
+          releaseRouteTable(route->table);
         }
       }
     }
+    addBusyTime(thread_index, &busy_start);
   }
   return 0;
 }
@@ -311,319 +656,951 @@ void* epollMethod(void* info_ptr)
   // free info_ptr after it was used
   free(info_ptr);
 
-  int i, j, clnt_fd, svr_fd, num_fds, conn, fwd_flag, new_fd[2];
-  struct epoll_event events[THREAD_QUEUE_LEN], event;
-
-  num_clients[thread_index] = 0;
-
-  // initialize fd_pipe for thread
-  if (pipe(fd_pipe[thread_index]) < 0)
-  {
-    perror("pipe call");
-    exit(1);
-  }
+  int i, k, num_fds, conn, clnt_fd, target;
+  struct epoll_event events[WORKER_EVENTS], event;
+  struct HandoffQueue *queue = &handoff_queue[thread_index];
+  struct TimerWheel *wheel = &timer_wheel[thread_index];
+  struct Handoff *handoff;
+  struct Listener *listener;
+  struct PortForward *route;
+  struct EndPointFd *ep;
+  struct ConnPair *pair, *next_pair;
+  struct sockaddr_in client;
 
-  // set pipe read as non-blocking
-  if (fcntl(fd_pipe[thread_index][0], F_SETFL, O_NONBLOCK) < 0)
-  {
-    perror("fcntl");
-    exit(1);
-  }
+  atomic_store_explicit(&num_clients[thread_index], 0, memory_order_relaxed);
+  initTimerWheel(wheel);
+  initWorkerLoad(thread_index, &wheel->now);
+  initReserveFd(thread_index);
 
-  // initialize epoll fd
-  epoll_fd[thread_index] = epoll_create(THREAD_QUEUE_LEN);
-  if (epoll_fd[thread_index] == -1)
+  // listeners were added to the epoll loop by main, and are added or removed by the reloader
+  // add handoff queue eventfd to epoll loop
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = queue;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, queue->event_fd, &event) == -1)
   {
-    perror("epoll_create");
+    perror("epoll_ctl");
     exit(1);
   }
 
-  // add all socket fds to epoll loop
-  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
-
-  for (i = 0; i < num_port_fwd; i++)
-  {
-    event.data.fd = port_config[i].fd;
-    if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, port_config[i].fd, &event) == -1)
-    {
-      perror("epoll_ctl");
-      exit(1);
-    }
-  }
-
+  // block until there is work - new pairs arrive through the handoff queue's eventfd
+  // while any pair has an idle timeout, also wake every tick to expire them,
+  // while the worker's load estimate is above zero, wake to let it decay,
+  // and while ends wait for a relay turn or their bandwidth caps, poll or wake to serve them
   while (TRUE)
   {
-    num_fds = epoll_wait(epoll_fd[thread_index], events, THREAD_QUEUE_LEN, 0);
+    rcuQuiescent(thread_index);
+    num_fds = epoll_wait(epoll_fd[thread_index], events, WORKER_EVENTS, schedWait(thread_index, loadWait(thread_index, timerWait(wheel))));
     if (num_fds < 0 && errno != EINTR)
     {
       perror("epoll_wait");
       exit(1);
     }
 
+    // one clock read per iteration, for busy time, latencies and idle timeouts
+    updateTimerClock(wheel);
+
     for (i = 0; i < num_fds; i++)
     {
-      // case 1: error condition
-      if (events[i].events & (EPOLLHUP | EPOLLERR))
+      switch (*(int*) events[i].data.ptr)
       {
-        perror("epoll error");
-        close(events[i].data.fd);
-        continue;
-      }
-      assert(events[i].events & EPOLLIN);
+        // case 1: client or server fd - relay data, complete connects and handle errors
+        case TAG_END_POINT:
+          ep = events[i].data.ptr;
+          // skip events for a pair closed earlier in this batch
+          if (ep->alt != NULL)
+          {
+            relayEvent(ep, events[i].events, thread_index);
+          }
+          break;
 
-      // case 2: connection request - check which port the request is coming from
-      fwd_flag = 1;
-      for (j = 0; j < num_port_fwd; j++)
-      {
-        if (events[i].data.fd == port_config[j].fd)
-        {
-          fwd_flag = 0;
-          while (TRUE)
+        // case 2: new clients from the accept thread, or pairs migrated from another worker
+        case TAG_HANDOFF_QUEUE:
+          clearHandoffSignal(queue);
+          while ((handoff = popHandoff(queue)) != NULL)
           {
-            if ((conn = setupConn(j, new_fd)) == -1)
+            printf("queue %i read clnt_fd %i (%lld handoffs, avg %lld usec, max %lld usec)\n", thread_index, handoff->clnt_fd,
+              queue->num_handoffs, queue->wake_usec / queue->num_handoffs, queue->max_wake_usec);
+            if (handoff->pair != NULL)
             {
-              exit(1);
+              adoptPair(thread_index, handoff->pair);
             }
-            else if (conn == 0)
+            else if ((pair = setupConn(thread_index, handoff->route, handoff->clnt_fd, &handoff->client)) != NULL)
             {
-              num_clients[thread_index]++;
-
-              clnt_fd = new_fd[0];
-              svr_fd = new_fd[1];
-
-              // add new fd to epoll loop
-              event.data.fd = clnt_fd;
-              if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, clnt_fd, &event) == -1)
-              {
-                perror("epoll_ctl");
-                exit(1);
-              }
-
-              // add new fd to epoll loop
-              event.data.fd = svr_fd;
-              if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, svr_fd, &event) == -1)
-              {
-                perror("epoll_ctl");
-                exit(1);
-              }
+              addConnection(thread_index, pair);
             }
-            else
+            free(handoff);
+          }
+          break;
+
+        // case 3: woken to pass a quiescent state
+        case TAG_RCU_WAKE:
+          clearRcuWake(thread_index);
+          break;
+
+        // case 4: shared backend connection - relay frames to and from its streams
+        case TAG_MUX_CONN:
+          muxEvent(events[i].data.ptr, events[i].events, thread_index);
+          break;
+
+        // case 5: mirror of a pair - discard its replies and send it the client data copied for it
+        case TAG_MIRROR:
+          mirrorEvent(events[i].data.ptr, events[i].events);
+          break;
+
+        case TAG_LISTENER:
+          listener = events[i].data.ptr;
+
+          // case 6: error condition - stop waiting on the listener, the reloader closes it
+          if (events[i].events & (EPOLLHUP | EPOLLERR))
+          {
+            perror("epoll error");
+            epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_DEL, listener->fd, NULL);
+            break;
+          }
+
+          // case 7: connection request on the listener's port
+          // shared listeners are drained completely, sharded ones a batch at a time
+          for (k = 0; shard_listeners == 0 || k < ACCEPT_BATCH; k++)
+          {
+            if ((conn = acceptClient(listener, &clnt_fd, &client, thread_index)) == 1)
             {
               break;
             }
+            else if (conn == 2)
+            {
+              continue;
+            }
+
+            route = listenerRoute(listener);
+            addStat(&worker_stats[thread_index].accepted, 1);
+            addStat(&route->stats[thread_index].accepted, 1);
+            if (admitClient(route) == -1)
+            {
+              rejectClient(thread_index, route, clnt_fd);
+              continue;
+            }
+            acquireRouteTable(route->table);
+            if ((pair = setupConn(thread_index, route, clnt_fd, &client)) != NULL)
+            {
+              addConnection(thread_index, pair);
+            }
           }
           break;
-        }
       }
+    }
 
-      // case 3: read data for fd
-      if (fwd_flag == 1)
-      {
-        forward(events[i].data.fd, thread_index);
-      }
+    // close pairs that went without relaying for longer than their rule's idle timeout
+    for (pair = expireTimers(wheel); pair != NULL; pair = next_pair)
+    {
+      next_pair = pair->timer_next;
+      printf("Idle timeout for client fd %i\n", pair->clnt.fd);
+      addStat(&pair->route->stats[thread_index].idle_timeouts, 1);
+      closeConnection(&pair->clnt, thread_index);
     }
 
-    // check pipe for new connections
-    while (read(fd_pipe[thread_index][0], &clnt_fd, sizeof(int)) > 0)
+    // give one more turn to each end that had more to read than its last turn or its bandwidth caps allowed,
+    // in order, then poll again so that ends with new events are served between rounds
+    for (k = startRound(thread_index); k > 0 && (ep = nextTurn(thread_index)) != NULL; k--)
     {
-      // read associated svr_fd (or wait for accept thread to write it)
-      while (read(fd_pipe[thread_index][0], &svr_fd, sizeof(int)) == 0)
-      {
-      }
-      printf("pipe %i read clnt_fd %i, svr_fd %i\n", thread_index, clnt_fd, svr_fd);
+      forward(ep, thread_index);
+    }
 
-      num_clients[thread_index]++;
+    // send the frames queued on shared backend connections in this iteration, many streams to a send
+    flushMuxConns(thread_index);
 
-      // add new fd to epoll loop
-      event.data.fd = clnt_fd;
-      if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, clnt_fd, &event) == -1)
-      {
-        perror("epoll_ctl");
-        exit(1);
-      }
+    // no event of the batch is left to point into the pairs closed in this iteration
+    freeClosedPairs(&conn_pool[thread_index]);
 
-      // add new fd to epoll loop
-      event.data.fd = svr_fd;
-      if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, svr_fd, &event) == -1)
-      {
-        perror("epoll_ctl");
-        exit(1);
-      }
+    // publish the worker's load, and move its heaviest pair to an idle worker if it is overloaded
+    addWorkerEvents(thread_index, (num_fds > 0) ? num_fds : 0);
+    if (updateWorkerLoad(thread_index, &wheel->now) && (pair = migrationCandidate(thread_index, wheel->now_tick, &target)) != NULL)
+    {
+      migratePair(thread_index, pair, target);
     }
+
+    addBusyTime(thread_index, &wheel->now);
   }
   return 0;
 }
 
-// accept client connection, connect to server connection
-// init variables, modifies new_fd to point to array of int: clnt_fd, svr_fd
-// returns 0 if successful, 1 if accept would block, and -1 if an error occurred
-static int setupConn(int config_index, int *new_fd)
+// accept a client connection from listener
+// returns 0 if successful, 1 if there is no client to accept for now, and 2 if a client was refused or lost
+// running out of fds or memory under load is never fatal - clients are refused until the load drops
+static int acceptClient(struct Listener *listener, int *clnt_fd, struct sockaddr_in *client, int thread_index)
 {
-  int clnt_fd, svr_fd;
-  struct sockaddr_in client, server;
   socklen_t client_len = sizeof(struct sockaddr_in);
-  struct addrinfo hints, *res, *rp;
 
-  clnt_fd = accept(port_config[config_index].fd, (struct sockaddr*) &client, &client_len);
-  if (clnt_fd == -1)
+  *clnt_fd = accept4(listener->fd, (struct sockaddr*) client, &client_len, SOCK_NONBLOCK);
+  if (*clnt_fd == -1)
   {
-    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
     {
-      perror("accept");
-      return -1;
+      return 1;
     }
-    else
+    perror("accept");
+
+    // out of fds - reset the client with the spare fd, so the backlog keeps draining
+    if (errno == EMFILE || errno == ENFILE)
     {
-      return 1;
+      return (shedClient(thread_index, listener->fd) == 0) ? 2 : 1;
     }
+    // the client went away before it was accepted - try the next one
+    if (errno == ECONNABORTED || errno == EINTR || errno == EPROTO || errno == EPERM)
+    {
+      return 2;
+    }
+    // out of memory or an unexpected error - leave the backlog for the next wakeup
+    return 1;
   }
 
-  connection[clnt_fd].client = client;
-  connection[clnt_fd].bytes_sent = 0;
-  connection[clnt_fd].num_requests = 0;
+  printf("  Remote Address:  %s\n", inet_ntoa(client->sin_addr));
+  return 0;
+}
 
-  // make new fd non-blocking
-  if (fcntl(clnt_fd, F_SETFL, O_NONBLOCK | fcntl(clnt_fd, F_GETFL, 0)) == -1)
+// start a non-blocking connect from an accepted client to a server of route
+// the pair is allocated from the worker thread's pool and its connect completes on EPOLLOUT
+// takes over the caller's reference to route's table and its admission, which the pair keeps until it is closed
+// returns the new pair, or NULL if the client was dropped because the server could not be reached
+static struct ConnPair* setupConn(int thread_index, struct PortForward *route, int clnt_fd, struct sockaddr_in *client)
+{
+  int svr_fd = -1, connecting, mux = (route->mux > 0);
+  struct sockaddr_in server;
+  struct sockaddr *server_addr;
+  socklen_t server_len;
+  struct Backend *backend;
+  struct ConnPair *pair;
+  struct MuxConn *conn = NULL;
+
+  countClient(thread_index, HEAVY_CONNS, client->sin_addr.s_addr, 1);
+  backend = selectBackend(route, client);
+
+  // a TCP server's address is cached, the resolver thread keeps it up to date
+  if ((server_len = backendAddress(backend, &server, &server_addr)) == 0)
   {
-    perror("fcntl");
-    return -1;
+    fprintf(stderr, "Server %s is unresolved\n", backend->svr_addr);
+    addStat(&worker_stats[thread_index].connect_errors, 1);
+    addStat(&route->stats[thread_index].connect_errors, 1);
+    dropClient(route, clnt_fd, svr_fd);
+    return NULL;
   }
 
-  printf("  Remote Address:  %s\n", inet_ntoa(connection[clnt_fd].client.sin_addr));
-
-  // create server socket
-  if ((svr_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+  // create non-blocking server socket of the server's family, unless the server end is carried on a shared backend connection
+  if (!mux && (svr_fd = socket(server_addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
   {
     perror("Cannot create socket");
+    // out of fds or memory - reset the client like any other client turned away under overload
+    rejectClient(thread_index, route, clnt_fd);
+    releaseClient(route);
+    releaseRouteTable(route->table);
+    return NULL;
+  }
+
+  // start connecting to the server, EINPROGRESS means the connect completes asynchronously
+  // a unix server whose backlog is full fails with EAGAIN instead of waiting, like a refused TCP connect
+  // io_uring workers submit the connect on their ring instead
+  connecting = (engine == ENGINE_URING);
+  if (mux && (conn = findMuxConn(thread_index, &server, route->mux)) == NULL)
+  {
+    fprintf(stderr, "Can't open a stream to server %s\n", backend->svr_name);
+    addStat(&worker_stats[thread_index].connect_errors, 1);
+    addStat(&route->stats[thread_index].connect_errors, 1);
+    backendFailed(route, backend);
+    dropClient(route, clnt_fd, svr_fd);
+    return NULL;
+  }
+  if (engine == ENGINE_EPOLL && !mux && connect(svr_fd, server_addr, server_len) == -1)
+  {
+    if (errno != EINPROGRESS)
+    {
+      fprintf(stderr, "Can't connect to server %s\n", backend->svr_name);
+      perror("connect");
+      addStat(&worker_stats[thread_index].connect_errors, 1);
+      addStat(&route->stats[thread_index].connect_errors, 1);
+      backendFailed(route, backend);
+      dropClient(route, clnt_fd, svr_fd);
+      return NULL;
+    }
+    connecting = 1;
+  }
+
+  if ((pair = allocConnPair(&conn_pool[thread_index])) == NULL)
+  {
+    dropClient(route, clnt_fd, svr_fd);
+    return NULL;
+  }
+
+  printf("  Destination Address:  %s\n", backend->svr_unix ? backend->svr_name : inet_ntoa(server.sin_addr));
+
+  // count the pair against its server until closeConnection releases it
+  pair->table = route->table;
+  pair->route = route;
+  pair->backend = backend;
+  pair->connect_start = timer_wheel[thread_index].now;
+  pair->timer_slot = -1;
+  atomic_fetch_add_explicit(&backend->active_conns, 1, memory_order_relaxed);
+
+  // a connect that completed at once, as to a local server, is observed here
+  // a stream needs no connect of its own, its connection's health is tracked by muxEvent
+  if (!connecting)
+  {
+    observeLatency(&route->stats[thread_index].connect_latency, 0);
+  }
+  if (!connecting && !mux)
+  {
+    backendConnected(route, backend);
+  }
+
+  // store client-server ends for sending purposes
+  pair->clnt.fd = clnt_fd;
+  pair->clnt.is_client = 1;
+  pair->clnt.addr = *client;
+  pair->clnt.alt = &pair->svr;
+  pair->clnt.connecting = 0;
+
+  pair->svr.fd = svr_fd;
+  pair->svr.is_client = 0;
+  pair->svr.addr = server;
+  pair->svr.alt = &pair->clnt;
+  pair->svr.connecting = connecting;
+
+  // relay buffers are allocated on first read
+  pair->clnt.tag = pair->svr.tag = TAG_END_POINT;
+  pair->clnt.pair = pair->svr.pair = pair;
+  pair->clnt.bytes_sent = pair->svr.bytes_sent = 0;
+  pair->clnt.num_requests = pair->svr.num_requests = 0;
+  pair->clnt.pipe_fd[0] = pair->clnt.pipe_fd[1] = pair->svr.pipe_fd[0] = pair->svr.pipe_fd[1] = -1;
+  pair->clnt.ring = pair->svr.ring = NULL;
+  pair->clnt.buf_len = pair->svr.buf_len = RELAY_BUFLEN;
+  pair->clnt.ring_head = pair->svr.ring_head = 0;
+  pair->clnt.buffered = pair->svr.buffered = 0;
+  pair->clnt.read_eof = pair->svr.read_eof = 0;
+  pair->clnt.write_shut = pair->svr.write_shut = 0;
+  pair->clnt.want_write = pair->svr.want_write = 0;
+  pair->clnt.sched_state = pair->svr.sched_state = TURN_IDLE;
+  pair->clnt.mux = pair->svr.mux = NULL;
+  pair->mirror.fd = -1;
+  pair->capture_id = 0;
+  initTokenBucket(&pair->clnt.client_bucket, route->client_bandwidth, bandwidthBurst(route->client_bandwidth));
+  initTokenBucket(&pair->svr.client_bucket, route->client_bandwidth, bandwidthBurst(route->client_bandwidth));
+
+  // streams are framed from the relay buffers, so they always relay by copy
+  if (mux)
+  {
+    attachStream(conn, &pair->svr);
+  }
+
+  // captured pairs relay by copy, so what they read can be recorded from their relay rings
+  // streams and mirrored pairs, whose reads never reach their relay rings, are not captured
+  if (capture_fd != -1 && !mux && route->mirror == NULL)
+  {
+    captureOpen(thread_index, pair);
+  }
+
+  // io_uring workers always relay through their provided buffers
+  // a mirror is copied from the client's relay pipe, so mirrored rules relay by splice
+  if (engine == ENGINE_EPOLL && !mux && pair->capture_id == 0 && (route->relay_mode == RELAY_SPLICE || route->mirror != NULL) && setupPipes(pair) == -1)
+  {
+    printf("Falling back to copy relay for client fd %i\n", clnt_fd);
+  }
+
+  return pair;
+}
+
+// close an admitted client and its server socket when the client could not be connected, and release what it holds
+static void dropClient(struct PortForward *route, int clnt_fd, int svr_fd)
+{
+  close(clnt_fd);
+  if (svr_fd != -1)
+  {
+    close(svr_fd);
+  }
+  releaseClient(route);
+  releaseRouteTable(route->table);
+}
+
+// create a kernel pipe for each direction of a splice-relayed client-server pair
+// returns 0 if successful, -1 if the pipes could not be created
+static int setupPipes(struct ConnPair *pair)
+{
+  int len = relayBufferLen();
+
+  if ((pair->clnt.buf_len = openRelayPipe(pair->clnt.pipe_fd, len)) == -1)
+  {
+    perror("pipe2");
+    pair->clnt.buf_len = RELAY_BUFLEN;
+    return -1;
+  }
+
+  if ((pair->svr.buf_len = openRelayPipe(pair->svr.pipe_fd, len)) == -1)
+  {
+    perror("pipe2");
+    closeRelayPipe(pair->clnt.pipe_fd, pair->clnt.buf_len);
+    pair->clnt.buf_len = pair->svr.buf_len = RELAY_BUFLEN;
     return -1;
   }
+  return 0;
+}
+
+// count a pair against the worker it is placed on and start its idle timeout
+// num_clients is only written by its worker, so a relaxed load and store is enough
+static void placePair(int thread_index, struct ConnPair *pair)
+{
+  atomic_store_explicit(&num_clients[thread_index], atomic_load_explicit(&num_clients[thread_index], memory_order_relaxed) + 1, memory_order_relaxed);
+  pair->placed_tick = timer_wheel[thread_index].now_tick;
+  pair->load_window = worker_load[thread_index].window;
+  pair->window_bytes = 0;
+  addTimer(&timer_wheel[thread_index], pair);
+}
+
+// stop counting a pair against its worker, before it is closed or migrated
+static void unplacePair(int thread_index, struct ConnPair *pair)
+{
+  removeTimer(&timer_wheel[thread_index], pair);
+  dropPairLoad(thread_index, pair);
+  atomic_store_explicit(&num_clients[thread_index], atomic_load_explicit(&num_clients[thread_index], memory_order_relaxed) - 1, memory_order_relaxed);
+}
+
+// count a new client-server pair against its worker and start its idle timeout, for either engine
+static void startPair(int thread_index, struct ConnPair *pair)
+{
+  addStat(&worker_stats[thread_index].connections, 1);
+  addStat(&pair->route->stats[thread_index].connections, 1);
+  placePair(thread_index, pair);
+}
+
+// release everything a closed client-server pair holds, for either engine, the caller returns it to the pool
+// both fds are already closed
+static void finishPair(int thread_index, struct ConnPair *pair)
+{
+  unplacePair(thread_index, pair);
+  atomic_fetch_sub_explicit(&pair->backend->active_conns, 1, memory_order_relaxed);
+  addStat(&worker_stats[thread_index].closed, 1);
+  addStat(&pair->route->stats[thread_index].closed, 1);
+  releaseClient(pair->route);
+  releaseRouteTable(pair->table);
+}
 
-  bzero((char *)&server, sizeof(struct sockaddr_in));
-  server.sin_family = AF_INET;
-  server.sin_port = htons(port_config[config_index].svr_port);
+// register a client-server pair with the worker's epoll loop
+// the server fd also waits for EPOLLOUT while its connect is in progress
+// if epoll cannot take the fds, as when out of memory, the pair is closed
+static void addConnection(int thread_index, struct ConnPair *pair)
+{
+  struct epoll_event event;
 
-  // replacing gethostbyname
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  getaddrinfo(port_config[config_index].svr_addr, NULL, &hints, &res);
+  startPair(thread_index, pair);
 
-  for (rp = res; rp != NULL; rp = rp->ai_next)
+  // add new fd to epoll loop
+  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+  event.data.ptr = &pair->clnt;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, pair->clnt.fd, &event) == -1)
   {
-    struct sockaddr_in* saddr = (struct sockaddr_in*) rp->ai_addr;
-    server.sin_addr = saddr->sin_addr;
- 
-    // Connecting to the server
-    if (connect (svr_fd, (struct sockaddr *)&server, sizeof(server)) == -1)
+    perror("epoll_ctl");
+    closeConnection(&pair->clnt, thread_index);
+    return;
+  }
+
+  // add new fd to epoll loop, a stream's events come through its connection
+  if (pair->svr.connecting)
+  {
+    event.events |= EPOLLOUT;
+    pair->svr.want_write = 1;
+  }
+  event.data.ptr = &pair->svr;
+  if (pair->svr.mux == NULL && epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, pair->svr.fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    closeConnection(&pair->clnt, thread_index);
+    return;
+  }
+
+  // a pair that could not get its pipes relays by copy, unmirrored
+  if (pair->route->mirror != NULL && pair->clnt.pipe_fd[0] != -1)
+  {
+    openMirror(thread_index, pair);
+  }
+}
+
+// move a connected pair to the target worker, epoll engine only
+// the pair leaves this worker's epoll set before its state is handed over, so only one worker ever relays it,
+// and the target's EPOLL_CTL_ADD reports anything that became ready in between
+static void migratePair(int thread_index, struct ConnPair *pair, int target)
+{
+  struct Handoff *node;
+  struct epoll_event event;
+
+  if ((node = malloc(sizeof(*node))) == NULL || (node->pair = malloc(sizeof(struct ConnPair))) == NULL)
+  {
+    perror("malloc");
+    free(node);
+    return;
+  }
+
+  // a pair that cannot leave the epoll set stays on this worker, with the fd already removed added back
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_DEL, pair->clnt.fd, NULL) == -1)
+  {
+    perror("epoll_ctl");
+    free(node->pair);
+    free(node);
+    return;
+  }
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_DEL, pair->svr.fd, NULL) == -1)
+  {
+    perror("epoll_ctl");
+    free(node->pair);
+    free(node);
+    event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET | (pair->clnt.want_write ? EPOLLOUT : 0);
+    event.data.ptr = &pair->clnt;
+    if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, pair->clnt.fd, &event) == -1)
     {
-      fprintf(stderr, "Can't connect to server\n");
-      perror("connect");
-      exit(1);
+      perror("epoll_ctl");
+      closeConnection(&pair->clnt, thread_index);
     }
-    break;
+    return;
   }
-  freeaddrinfo(res);
 
-  connection[svr_fd].client = server;
-  connection[svr_fd].bytes_sent = 0;
-  connection[svr_fd].num_requests = 0;
+  printf("Migrating client fd %i from worker %i to worker %i\n", pair->clnt.fd, thread_index, target);
+  unscheduleEnd(thread_index, &pair->clnt);
+  unscheduleEnd(thread_index, &pair->svr);
+  unplacePair(thread_index, pair);
+  addStat(&worker_stats[thread_index].migrations, 1);
+  *node->pair = *pair;
+  node->clnt_fd = pair->clnt.fd;
+  node->client = pair->clnt.addr;
+  node->route = pair->route;
+  freeConnPair(&conn_pool[thread_index], pair);
+  pushMigration(&handoff_queue[target], node);
+}
+
+// take over a pair migrated from another worker, moving its state into a pair from this worker's pool
+// the pair keeps its route table reference, relay buffers and server, and its idle timeout restarts
+static void adoptPair(int thread_index, struct ConnPair *state)
+{
+  struct ConnPair *pair;
+  struct ConnSlab *slab;
+  struct epoll_event event;
 
-  // make new fd non-blocking
-  if (fcntl(svr_fd, F_SETFL, O_NONBLOCK | fcntl(svr_fd, F_GETFL, 0)) == -1)
+  if ((pair = allocConnPair(&conn_pool[thread_index])) == NULL)
   {
-    perror("fcntl");
-    return -1;
+    resetEndPoint(&state->clnt);
+    close(state->clnt.fd);
+    resetEndPoint(&state->svr);
+    close(state->svr.fd);
+    atomic_fetch_sub_explicit(&state->backend->active_conns, 1, memory_order_relaxed);
+    addStat(&worker_stats[thread_index].closed, 1);
+    addStat(&state->route->stats[thread_index].closed, 1);
+    releaseClient(state->route);
+    releaseRouteTable(state->table);
+    free(state);
+    return;
+  }
+
+  slab = pair->slab;
+  *pair = *state;
+  free(state);
+  pair->slab = slab;
+  pair->clnt.alt = &pair->svr;
+  pair->svr.alt = &pair->clnt;
+  pair->clnt.pair = pair->svr.pair = pair;
+  placePair(thread_index, pair);
+
+  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET | (pair->clnt.want_write ? EPOLLOUT : 0);
+  event.data.ptr = &pair->clnt;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, pair->clnt.fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    closeConnection(&pair->clnt, thread_index);
+    return;
+  }
+
+  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET | (pair->svr.want_write ? EPOLLOUT : 0);
+  event.data.ptr = &pair->svr;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, pair->svr.fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    closeConnection(&pair->clnt, thread_index);
+    return;
   }
+}
 
-  printf("  Destination Address:  %s\n", inet_ntoa(connection[svr_fd].client.sin_addr));
+// arm or disarm EPOLLOUT on ep, only calling epoll_ctl when the interest changes
+static void setWriteInterest(struct EndPointFd *ep, int want_write, int thread_index)
+{
+  struct epoll_event event;
 
-  // store client-server fd for sending purposes
-  end_point[clnt_fd].is_client = 1;
-  end_point[clnt_fd].alt_fd = svr_fd;
+  if (ep->want_write == want_write)
+  {
+    return;
+  }
+
+  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET | (want_write ? EPOLLOUT : 0);
+  event.data.ptr = ep;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_MOD, ep->fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    return;
+  }
+  ep->want_write = want_write;
+}
 
-  end_point[svr_fd].is_client = 0;
-  end_point[svr_fd].alt_fd = clnt_fd;
+// handle an epoll event on a client or server end
+static void relayEvent(struct EndPointFd *ep, uint32_t events, int thread_index)
+{
+  // server connect in progress - completes on EPOLLOUT, fails on EPOLLERR/EPOLLHUP
+  if (ep->connecting)
+  {
+    if (finishConnect(ep, thread_index) == -1 || !(events & EPOLLIN))
+    {
+      return;
+    }
+  }
+  else if (events & EPOLLERR)
+  {
+    closeConnection(ep, thread_index);
+    return;
+  }
 
-  new_fd[0] = clnt_fd;
-  new_fd[1] = svr_fd;
+  // ep accepts data again - flush what is buffered for it
+  if ((events & EPOLLOUT) && forward(ep->alt, thread_index) == -1)
+  {
+    return;
+  }
 
-  return 0;
+  // ep has data, or its peer hung up
+  if (events & (EPOLLIN | EPOLLHUP))
+  {
+    forward(ep, thread_index);
+  }
 }
 
-static int forward(int recv_fd, int thread_index)
+// complete a non-blocking connect once the server end reports writable or an error
+// relays client data that arrived while connecting, or closes the pair if the connect failed
+// returns 0 if connected, -1 if the pair was closed
+static int finishConnect(struct EndPointFd *svr, int thread_index)
 {
-  int n, bytes_to_read;
-  char *bp, buf[BUFLEN];
-  if (gettimeofday(&connection[recv_fd].last_seen, NULL))
+  int err = 0;
+  socklen_t err_len = sizeof(err);
+
+  if (getsockopt(svr->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
   {
-    perror("last_seen gettimeofday");
-    return 1;
+    fprintf(stderr, "Can't connect to server %s: %s\n", svr->pair->backend->svr_name, strerror(err != 0 ? err : errno));
+    addStat(&worker_stats[thread_index].connect_errors, 1);
+    addStat(&svr->pair->route->stats[thread_index].connect_errors, 1);
+    backendFailed(svr->pair->route, svr->pair->backend);
+    closeConnection(svr, thread_index);
+    return -1;
   }
+  svr->connecting = 0;
+  backendConnected(svr->pair->route, svr->pair->backend);
+
+  observeLatency(&svr->pair->route->stats[thread_index].connect_latency, elapsedUsec(&svr->pair->connect_start, &timer_wheel[thread_index].now));
 
-  bp = buf;
-  bytes_to_read = BUFLEN;
+  // relay client data buffered while connecting, then keep reading the client
+  // this also drops EPOLLOUT from the server once nothing is left to send
+  return forward(svr->alt, thread_index);
+}
+
+// read at most limit bytes from ep into its relay buffer - the ring buffer, or the kernel pipe for splice relays
+// reads at most up to the buffer's length buffered, a ring buffer is allocated on the first read after it was freed
+// returns number of bytes read, 0 on end of stream, -1 on error (errno is set)
+static int fillBuffer(struct EndPointFd *ep, long long limit)
+{
+  struct iovec iov[2];
+  int tail, space;
 
-  // receive initial BUFLEN of message
-  n = recv(recv_fd, bp, bytes_to_read, 0);
-  // check if connection is closed
-  if (n == 0)
+  // a stream's data is placed in its relay buffer by its connection
+  if (ep->mux != NULL)
   {
-    connection[recv_fd].bytes_sent = -1;
-    printf("Completed connection for %s fd %i\n", (end_point[end_point[recv_fd].alt_fd].is_client) ? "client":"server", recv_fd);
-    close(recv_fd);
+    errno = EAGAIN;
+    return -1;
+  }
 
-    connection[end_point[recv_fd].alt_fd].bytes_sent = -1;
-    printf("Completed connection for %s fd %i\n", (end_point[recv_fd].is_client) ? "client":"server", end_point[recv_fd].alt_fd);
-    close(end_point[recv_fd].alt_fd);
+  if (ep->pipe_fd[1] == -1 && ep->ring == NULL && allocRelayBuffer(ep, relayBufferLen()) == -1)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
 
-    num_clients[thread_index]--;
-    return 0;
+  space = (ep->buf_len - ep->buffered < limit) ? ep->buf_len - ep->buffered : limit;
+  if (ep->pipe_fd[1] != -1)
+  {
+    return splice(ep->fd, NULL, ep->pipe_fd[1], NULL, space, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
   }
 
-  bp += n;
-  bytes_to_read -= n;
+  // free space may wrap around the end of the ring
+  tail = (ep->ring_head + ep->buffered) % ep->buf_len;
+  iov[0].iov_base = ep->ring + tail;
+  iov[0].iov_len = (tail + space > ep->buf_len) ? ep->buf_len - tail : space;
+  iov[1].iov_base = ep->ring;
+  iov[1].iov_len = space - iov[0].iov_len;
+
+  return readv(ep->fd, iov, (iov[1].iov_len > 0) ? 2 : 1);
+}
 
-  if (n < BUFLEN)
+// send as much of ep's relay buffer to the other end as it will take
+// returns number of bytes sent, or -1 if the other end failed
+static int flushBuffer(struct EndPointFd *ep)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+  int n;
+
+  if (ep->alt->mux != NULL)
+  {
+    return sendStreamData(ep);
+  }
+  else if (ep->pipe_fd[0] != -1 && ep->is_client && ep->pair->mirror.fd != -1)
   {
-    // loop until entire message received or buffer is full
-    while ((n = recv (recv_fd, bp, bytes_to_read, 0)) < bytes_to_read && n != -1)
+    n = spliceMirrored(ep);
+  }
+  else if (ep->pipe_fd[0] != -1)
+  {
+    n = splice(ep->pipe_fd[0], NULL, ep->alt->fd, NULL, ep->buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  }
+  else
+  {
+    // buffered data may wrap around the end of the ring
+    iov[0].iov_base = ep->ring + ep->ring_head;
+    iov[0].iov_len = (ep->ring_head + ep->buffered > ep->buf_len) ? ep->buf_len - ep->ring_head : ep->buffered;
+    iov[1].iov_base = ep->ring;
+    iov[1].iov_len = ep->buffered - iov[0].iov_len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+    n = sendmsg(ep->alt->fd, &msg, MSG_NOSIGNAL);
+  }
+
+  if (n == -1)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
     {
-      bp += n;
-      bytes_to_read -= n;
+      return 0;
     }
+    perror("send");
+    return -1;
   }
- 
-  connection[end_point[recv_fd].alt_fd].num_requests += 1;
-  //printf ("Sending: fd %i, request #%i - %s\n", end_point[recv_fd].alt_fd, connection[end_point[recv_fd].alt_fd].num_requests, buf);
-  send (end_point[recv_fd].alt_fd, buf, BUFLEN - bytes_to_read, 0);
-  connection[end_point[recv_fd].alt_fd].bytes_sent += BUFLEN - bytes_to_read;
 
-  struct PrintData *data = malloc(sizeof(*data));
-  data->recv_fd = recv_fd;
-  data->send_fd = end_point[recv_fd].alt_fd;
-  data->num_requests = connection[end_point[recv_fd].alt_fd].num_requests;
-  data->bytes_sent = connection[end_point[recv_fd].alt_fd].bytes_sent;
-  write(out_pipe[1], data, sizeof(*data));
-  free(data);
-  return 0;
+  ep->buffered -= n;
+  ep->ring_head = (ep->buffered == 0) ? 0 : (ep->ring_head + n) % ep->buf_len;
+
+  // the stream's data left its relay buffer, so the server may send as much more
+  if (ep->mux != NULL && n > 0)
+  {
+    grantStream(ep, n);
+  }
+  return n;
 }
 
-// iterates through each worker thread, returning thread index with the lowest number of clients
-// number of clients takes into account pipe contents
-static int findFewestClients()
+// relay data from recv to the other end until recv has no more data, the other end
+// stops accepting data and three quarters of its relay buffer are full, or recv's turn is over
+// EPOLLOUT stays armed on the other end while data is buffered for it, and reading resumes from there
+// a recv whose turn is over waits in the worker's queues for its next one
+// returns 0 if the pair is still open, -1 if it was closed
+static int forward(struct EndPointFd *recv, int thread_index)
 {
-  int i;
-  int index = 0;
-  int count = num_clients[0];
-  for (i = 1; i < THREAD_COUNT; i++)
+  int n, blocked, more = 0;
+  struct EndPointFd *send = recv->alt;
+  struct RelayStats *route_stats = &recv->pair->route->stats[thread_index];
+  struct TimerWheel *wheel = &timer_wheel[thread_index];
+  long long bytes_sent = 0, bytes_read = 0, budget = readBudget(recv, thread_index);
+
+  // the pair is active, its idle timeout restarts from this tick
+  recv->pair->last_active = wheel->now_tick;
+
+  // the server is still connecting, hold the data until the connection completes
+  blocked = send->connecting;
+
+  while (TRUE)
   {
-    if (num_clients[i] < count)
+    if (!blocked && recv->buffered > 0)
     {
-      count = num_clients[i];
-      index = i;
+      if ((n = flushBuffer(recv)) == -1)
+      {
+        closeConnection(recv, thread_index);
+        return -1;
+      }
+      bytes_sent += n;
+      blocked = recv->buffered > 0;
+
+      // the buffer drained, so everything it held has waited since it went from empty
+      if (n > 0 && !blocked)
+      {
+        observeLatency(&route_stats->relay_latency, elapsedUsec(&recv->buffered_since, &wheel->now));
+      }
+    }
+
+    // stop reading once the buffer is at its high watermark, RELAY_HIGH_WATER for a full-length buffer
+    if (recv->read_eof || recv->buffered >= recv->buf_len - recv->buf_len / 4)
+    {
+      break;
+    }
+
+    // recv may have more to read, but edge-triggered epoll will not report it again
+    if (budget <= 0)
+    {
+      more = 1;
+      break;
+    }
+
+    n = fillBuffer(recv, budget);
+    if (n == 0)
+    {
+      recv->read_eof = 1;
+      if (recv->pair->capture_id != 0 && recv->is_client)
+      {
+        captureEvent(thread_index, recv->pair, CAPTURE_FIN);
+      }
+    }
+    else if (n == -1)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        break;
+      }
+
+      // socket type does not support splice, relay this pair by copy from now on
+      if (errno == EINVAL && recv->pipe_fd[0] != -1 && recv->buffered == 0)
+      {
+        printf("Falling back to copy relay for fd %i\n", recv->fd);
+        if (recv->is_client && recv->pair->mirror.fd != -1)
+        {
+          dropMirror(&recv->pair->mirror, "copy relay");
+        }
+        closeRelayPipe(recv->pipe_fd, recv->buf_len);
+        continue;
+      }
+
+      perror("recv");
+      closeConnection(recv, thread_index);
+      return -1;
     }
+    else
+    {
+      if (recv->pair->capture_id != 0)
+      {
+        captureRead(thread_index, recv, n);
+      }
+      if (recv->buffered == 0)
+      {
+        recv->buffered_since = wheel->now;
+      }
+      recv->buffered += n;
+      budget -= n;
+      bytes_read += n;
+    }
+  }
+
+  // a drained ring buffer is given back while memory is short
+  if (recv->buffered == 0)
+  {
+    shrinkRelayBuffer(recv);
+  }
+  sampleSocketMemory(thread_index, recv->fd);
+  endTurn(recv, thread_index, bytes_read, more);
+
+  if (!send->connecting && send->mux == NULL)
+  {
+    setWriteInterest(send, recv->buffered > 0, thread_index);
+  }
+
+  if (bytes_sent > 0)
+  {
+    send->num_requests += 1;
+    send->bytes_sent += bytes_sent;
+    addStat(&worker_stats[thread_index].requests, 1);
+    addStat(recv->is_client ? &worker_stats[thread_index].bytes_in : &worker_stats[thread_index].bytes_out, bytes_sent);
+    addStat(&route_stats->requests, 1);
+    addStat(recv->is_client ? &route_stats->bytes_in : &route_stats->bytes_out, bytes_sent);
+    addPairLoad(thread_index, recv->pair, bytes_sent);
+    countClient(thread_index, HEAVY_BYTES, recv->pair->clnt.addr.sin_addr.s_addr, bytes_sent);
+
+    if (debug_log)
+    {
+      struct PrintData data;
+      data.recv_fd = recv->fd;
+      data.send_fd = send->fd;
+      data.num_requests = send->num_requests;
+      data.bytes_sent = send->bytes_sent;
+      write(out_pipe[1], &data, sizeof(data));
+    }
+  }
+
+  // recv closed its sending side and everything it sent was relayed - pass the close on
+  if (recv->read_eof && recv->buffered == 0 && !send->connecting)
+  {
+    // the other direction is finished too, so the pair is done
+    if (send->read_eof && send->buffered == 0)
+    {
+      closeConnection(recv, thread_index);
+      return -1;
+    }
+
+    if (!send->write_shut)
+    {
+      if (send->mux != NULL)
+      {
+        shutdownStream(send);
+      }
+      else
+      {
+        shutdown(send->fd, SHUT_WR);
+      }
+      send->write_shut = 1;
+
+      // the mirror is passed the close once it has sent what it holds
+      if (recv->is_client && recv->pair->mirror.fd != -1)
+      {
+        flushMirror(&recv->pair->mirror);
+      }
+    }
+  }
+  return 0;
+}
+
+// release the relay buffers and the stream of ep and mark it as no longer part of a pair
+static void resetEndPoint(struct EndPointFd *ep)
+{
+  if (ep->mux != NULL)
+  {
+    closeStream(ep);
+  }
+
+  closeRelayPipe(ep->pipe_fd, ep->buf_len);
+  freeRelayBuffer(ep);
+  ep->alt = NULL;
+  ep->connecting = 0;
+}
+
+// close both ends of a client-server pair, release their relay buffers and return the pair to the worker's pool
+// once the worker's current batch of events is handled
+static void closeConnection(struct EndPointFd *recv, int thread_index)
+{
+  struct ConnPair *pair = recv->pair;
+  struct EndPointFd *alt = recv->alt;
+
+  unscheduleEnd(thread_index, recv);
+  unscheduleEnd(thread_index, alt);
+
+  printf("Completed connection for %s fd %i\n", (alt->is_client) ? "client":"server", recv->fd);
+  resetEndPoint(recv);
+  if (recv->fd != -1)
+  {
+    close(recv->fd);
+  }
+
+  printf("Completed connection for %s fd %i\n", (recv->is_client) ? "client":"server", alt->fd);
+  resetEndPoint(alt);
+  if (alt->fd != -1)
+  {
+    close(alt->fd);
+  }
+  closeMirror(&pair->mirror);
+  if (pair->capture_id != 0)
+  {
+    captureEvent(thread_index, pair, CAPTURE_CLOSE);
   }
-  return index;
+  finishPair(thread_index, pair);
+  retireConnPair(&conn_pool[thread_index], pair);
 }
 
 // calculate difference in time between end_time and start_time (return usec)
@@ -662,7 +1639,7 @@ FILE* initOutputFile()
   return file;
 }
 
-int writeConnection(FILE *file, int recv_fd, int send_fd, int num_requests, int bytes_sent)
+int writeConnection(FILE *file, int recv_fd, int send_fd, long long num_requests, long long bytes_sent)
 {
   time_t timer;
   char time_buffer[25];
@@ -676,18 +1653,22 @@ int writeConnection(FILE *file, int recv_fd, int send_fd, int num_requests, int
   gettimeofday(&tv, 0);
 
   // write connection details
-  printf("%*s:%*i | %*i | %*i | %*i | %*i\n", 17, time_buffer, 3, (int) tv.tv_usec % 1000, 9, recv_fd, 6, send_fd, 10, num_requests, 10, bytes_sent);
-  fprintf(file, "%*s:%*i | %*i | %*i | %*i | %*i\n", 17, time_buffer, 3, (int) tv.tv_usec % 1000, 9, recv_fd, 6, send_fd, 10, num_requests, 10, bytes_sent);
+  printf("%*s:%*i | %*i | %*i | %*lld | %*lld\n", 17, time_buffer, 3, (int) tv.tv_usec % 1000, 9, recv_fd, 6, send_fd, 10, num_requests, 10, bytes_sent);
+  fprintf(file, "%*s:%*i | %*i | %*i | %*lld | %*lld\n", 17, time_buffer, 3, (int) tv.tv_usec % 1000, 9, recv_fd, 6, send_fd, 10, num_requests, 10, bytes_sent);
   return 0;
 }
 
 void closeFd(int signo)
 {
   int i;
-  for (i = 0; i < num_port_fwd; i++)
+
+  closeCapture();
+  for (i = 0; i < route_table->num_ports; i++)
   {
-    close(port_config[i].fd);
+    if (listener_by_port[route_table->ports[i].port] != NULL)
+    {
+      closeListener(listener_by_port[route_table->ports[i].port]);
+    }
   }
-  freePortFwdTable();
   exit(EXIT_SUCCESS);
 }
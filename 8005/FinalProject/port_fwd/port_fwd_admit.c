@@ -0,0 +1,217 @@
+#include <fcntl.h>
+
+// admission control - every accepted client takes a token from the global and its rule's accept rate buckets
+// and a slot under the global and its rule's connection limits, or is reset at once
+int max_conns = 0;    // client-server pairs relayed at once over all rules, 0 for no limit
+int accept_rate = 0;  // clients accepted per second over all rules, 0 for no limit
+_Atomic int total_conns;             // clients admitted and not yet closed, over all rules
+struct TokenBucket accept_bucket;    // tokens for accept_rate
+int reserve_fd[THREAD_COUNT + 1];    // spare fd of each accepting thread, given up to refuse a client when out of fds
+
+// rate 0 makes the bucket unlimited, burst is the number of tokens a full bucket holds
+void initTokenBucket(struct TokenBucket *bucket, long long rate, long long burst)
+{
+  atomic_init(&bucket->full_nsec, 0);
+  bucket->rate = rate;
+  bucket->burst_nsec = (rate == 0) ? 0 : (long long) ((double) burst * 1000000000 / rate);
+}
+
+// returns the time it takes bucket to refill n tokens, at least a nsec
+static long long tokenCost(struct TokenBucket *bucket, long long n)
+{
+  long long cost = (long long) ((double) n * 1000000000 / bucket->rate);
+
+  return (cost > 0) ? cost : 1;
+}
+
+// take n tokens from bucket at CLOCK_MONOTONIC time now_nsec, if it holds them all
+// returns 1 if the tokens were taken, 0 if the rate is exceeded
+int takeTokens(struct TokenBucket *bucket, long long now_nsec, long long n)
+{
+  long long full, next;
+
+  if (bucket->rate == 0)
+  {
+    return 1;
+  }
+
+  full = atomic_load_explicit(&bucket->full_nsec, memory_order_relaxed);
+  do
+  {
+    next = ((full > now_nsec) ? full : now_nsec) + tokenCost(bucket, n);
+    if (next - now_nsec > bucket->burst_nsec)
+    {
+      return 0;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&bucket->full_nsec, &full, next, memory_order_relaxed, memory_order_relaxed));
+  return 1;
+}
+
+// give back n tokens taken from bucket, if what they were taken for did not happen
+void returnTokens(struct TokenBucket *bucket, long long n)
+{
+  if (bucket->rate != 0)
+  {
+    atomic_fetch_sub_explicit(&bucket->full_nsec, tokenCost(bucket, n), memory_order_relaxed);
+  }
+}
+
+// take n tokens from bucket even if it holds fewer, it then stays empty until it has refilled them
+void chargeTokens(struct TokenBucket *bucket, long long now_nsec, long long n)
+{
+  long long full, next;
+
+  if (bucket->rate == 0 || n == 0)
+  {
+    return;
+  }
+
+  full = atomic_load_explicit(&bucket->full_nsec, memory_order_relaxed);
+  do
+  {
+    next = ((full > now_nsec) ? full : now_nsec) + tokenCost(bucket, n);
+  } while (!atomic_compare_exchange_weak_explicit(&bucket->full_nsec, &full, next, memory_order_relaxed, memory_order_relaxed));
+}
+
+// returns the tokens bucket holds at now_nsec, LLONG_MAX if it is unlimited
+long long availableTokens(struct TokenBucket *bucket, long long now_nsec)
+{
+  long long full, refill;
+
+  if (bucket->rate == 0)
+  {
+    return LLONG_MAX;
+  }
+  full = atomic_load_explicit(&bucket->full_nsec, memory_order_relaxed);
+  if ((refill = now_nsec + bucket->burst_nsec - ((full > now_nsec) ? full : now_nsec)) <= 0)
+  {
+    return 0;
+  }
+  return (long long) ((double) refill * bucket->rate / 1000000000);
+}
+
+// returns the nsec from now_nsec until bucket holds n tokens, 0 if it holds them already
+long long tokenWait(struct TokenBucket *bucket, long long now_nsec, long long n)
+{
+  long long full, wait;
+
+  if (bucket->rate == 0)
+  {
+    return 0;
+  }
+  full = atomic_load_explicit(&bucket->full_nsec, memory_order_relaxed);
+  wait = ((full > now_nsec) ? full : now_nsec) + tokenCost(bucket, n) - bucket->burst_nsec - now_nsec;
+  return (wait > 0) ? wait : 0;
+}
+
+// count one more connection against limit (0 for no limit)
+// returns 1 if it is within the limit, 0 if not, leaving count unchanged
+static int takeSlot(_Atomic int *count, int limit)
+{
+  if (atomic_fetch_add_explicit(count, 1, memory_order_relaxed) >= limit && limit > 0)
+  {
+    atomic_fetch_sub_explicit(count, 1, memory_order_relaxed);
+    return 0;
+  }
+  return 1;
+}
+
+// give back the connection slots of an admitted client that was closed, or of one refused after it took them
+void releaseClient(struct PortForward *route)
+{
+  atomic_fetch_sub_explicit(&route->num_conns, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&total_conns, 1, memory_order_relaxed);
+}
+
+// decide whether a client accepted on a port of route may be relayed, safe to call from any thread
+// returns 0 if it is admitted - releaseClient must be called once it is closed - or -1 if it must be rejected
+int admitClient(struct PortForward *route)
+{
+  struct timespec now;
+  long long now_nsec;
+
+  // the memory cap is reached, new pairs would only take memory from the open ones
+  if (memoryLevel() == MEM_REFUSE)
+  {
+    return -1;
+  }
+
+  // the rule's checks come before the global ones and each check gives back what the ones before it took,
+  // so a client refused by its own rule never uses up the rate or the slots of the other rules
+  if (!takeSlot(&route->num_conns, route->max_conns))
+  {
+    return -1;
+  }
+  if (!takeSlot(&total_conns, max_conns))
+  {
+    atomic_fetch_sub_explicit(&route->num_conns, 1, memory_order_relaxed);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  now_nsec = now.tv_sec * 1000000000LL + now.tv_nsec;
+  if (!takeTokens(&route->accept_bucket, now_nsec, 1))
+  {
+    releaseClient(route);
+    return -1;
+  }
+  if (!takeTokens(&accept_bucket, now_nsec, 1))
+  {
+    returnTokens(&route->accept_bucket, 1);
+    releaseClient(route);
+    return -1;
+  }
+  return 0;
+}
+
+// reset a client instead of closing it gracefully, so its fd is freed at once and it sees the refusal right away
+// route is NULL if the client was refused before its rule was known
+void rejectClient(int thread_index, struct PortForward *route, int clnt_fd)
+{
+  struct linger linger;
+
+  linger.l_onoff = 1;
+  linger.l_linger = 0;
+  if (setsockopt(clnt_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) == -1)
+  {
+    perror("setsockopt SO_LINGER");
+  }
+  close(clnt_fd);
+
+  addStat(&worker_stats[thread_index].rejected, 1);
+  if (route != NULL)
+  {
+    addStat(&route->stats[thread_index].rejected, 1);
+  }
+}
+
+// open the spare fd of an accepting thread
+void initReserveFd(int thread_index)
+{
+  if ((reserve_fd[thread_index] = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+  {
+    perror("Can't open reserve fd");
+  }
+}
+
+// refuse the oldest pending client on listen_fd while the process is out of fds, by giving up the spare fd for it
+// otherwise the client would wait in the backlog, and the listener would keep reporting it
+// returns 0 if a client was refused, -1 if not
+int shedClient(int thread_index, int listen_fd)
+{
+  int clnt_fd;
+
+  if (reserve_fd[thread_index] == -1)
+  {
+    initReserveFd(thread_index);
+    return -1;
+  }
+
+  close(reserve_fd[thread_index]);
+  if ((clnt_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) != -1)
+  {
+    rejectClient(thread_index, NULL, clnt_fd);
+  }
+  initReserveFd(thread_index);
+  return (clnt_fd == -1) ? -1 : 0;
+}
@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define HASH_POINTS_PER_BACKEND 64  // virtual nodes per server, evens out the ring
+
+// 32-bit FNV-1a hash
+static uint32_t hashBytes(const void *data, size_t len, uint32_t hash)
+{
+  const unsigned char *byte = data;
+  size_t i;
+  for (i = 0; i < len; i++)
+  {
+    hash ^= byte[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int compareHashPoints(const void *a, const void *b)
+{
+  uint32_t hash_a = ((const struct HashPoint*) a)->hash;
+  uint32_t hash_b = ((const struct HashPoint*) b)->hash;
+  return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+// place HASH_POINTS_PER_BACKEND points for each of route's servers on its hash ring
+// points are keyed on the server's addr|port, so a server keeps its share of clients while others come and go
+// returns 0 if successful, -1 if error
+int buildHashRing(struct PortForward *route)
+{
+  int i, j;
+
+  route->num_hash_points = route->num_backends * HASH_POINTS_PER_BACKEND;
+  if ((route->hash_ring = malloc(sizeof(struct HashPoint) * route->num_hash_points)) == NULL)
+  {
+    printf("HashPoint malloc error\n");
+    return -1;
+  }
+
+  for (i = 0; i < route->num_backends; i++)
+  {
+    struct Backend *backend = &route->backends[i];
+    uint32_t hash = hashBytes(backend->svr_addr, strlen(backend->svr_addr), 2166136261u);
+    hash = hashBytes(&backend->svr_port, sizeof(backend->svr_port), hash);
+
+    for (j = 0; j < HASH_POINTS_PER_BACKEND; j++)
+    {
+      struct HashPoint *point = &route->hash_ring[i * HASH_POINTS_PER_BACKEND + j];
+      point->hash = hashBytes(&j, sizeof(j), hash);
+      point->backend = i;
+    }
+  }
+  qsort(route->hash_ring, route->num_hash_points, sizeof(struct HashPoint), compareHashPoints);
+  return 0;
+}
+
+// returns the first server clockwise from the client's IP on route's hash ring that is in rotation
+// clients of a server taken out move to the next server on the ring, the others keep theirs
+static int hashBackend(struct PortForward *route, struct sockaddr_in *client, long long now_nsec)
+{
+  uint32_t hash = hashBytes(&client->sin_addr.s_addr, sizeof(client->sin_addr.s_addr), 2166136261u);
+  int low = 0, high = route->num_hash_points, i, index;
+
+  while (low < high)
+  {
+    int mid = low + (high - low) / 2;
+    if (route->hash_ring[mid].hash < hash)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  // wrap past the last point back to the first
+  for (i = 0; i < route->num_hash_points; i++)
+  {
+    index = route->hash_ring[(low + i) % route->num_hash_points].backend;
+    if (backendUsable(route, &route->backends[index], now_nsec))
+    {
+      return index;
+    }
+  }
+  return route->hash_ring[low % route->num_hash_points].backend;
+}
+
+// returns the server in rotation with the fewest active client pairs
+// the scan starts at the round-robin position so ties are spread across the pool
+static int leastConnBackend(struct PortForward *route, long long now_nsec)
+{
+  int start = atomic_fetch_add_explicit(&route->next_backend, 1, memory_order_relaxed) % route->num_backends;
+  int i, best = -1, best_conns = INT_MAX;
+
+  for (i = 0; i < route->num_backends && best_conns > 0; i++)
+  {
+    int index = (start + i) % route->num_backends;
+    int conns = atomic_load_explicit(&route->backends[index].active_conns, memory_order_relaxed);
+    if (conns < best_conns && backendUsable(route, &route->backends[index], now_nsec))
+    {
+      best = index;
+      best_conns = conns;
+    }
+  }
+  return (best != -1) ? best : start;
+}
+
+// returns the next server in rotation round-robin
+static int roundRobinBackend(struct PortForward *route, long long now_nsec)
+{
+  int i, index, start = atomic_fetch_add_explicit(&route->next_backend, 1, memory_order_relaxed) % route->num_backends;
+
+  for (i = 0; i < route->num_backends; i++)
+  {
+    index = (start + i) % route->num_backends;
+    if (backendUsable(route, &route->backends[index], now_nsec))
+    {
+      return index;
+    }
+  }
+  return start;
+}
+
+// pick the server in route's pool for a new client, using the route's balancing policy
+// servers out of rotation are passed over - if every server is out, the policy's pick is tried anyway
+struct Backend* selectBackend(struct PortForward *route, struct sockaddr_in *client)
+{
+  long long now_nsec;
+
+  if (route->num_backends == 1)
+  {
+    return &route->backends[0];
+  }
+
+  now_nsec = monotonicNsec();
+  switch (route->balance)
+  {
+    case BALANCE_LEAST_CONN:
+      return &route->backends[leastConnBackend(route, now_nsec)];
+    case BALANCE_HASH:
+      return &route->backends[hashBackend(route, client, now_nsec)];
+    default:
+      return &route->backends[roundRobinBackend(route, now_nsec)];
+  }
+}
@@ -0,0 +1,236 @@
+#define CAPTURE_RING_LEN (1 << 22)  // bytes of records each worker may have waiting for the capture writer, a power of two
+#define CAPTURE_FLUSH_MSEC 100      // how often the capture writer writes out what the workers recorded
+#define CAPTURE_CHUNK_MAX 32768     // most bytes one record carries, longer reads are split
+#define CAPTURE_HEADER_LEN 16
+#define CAPTURE_MAGIC "PFWDCAP1"
+
+// record types - must match tcp_replay.c
+#define CAPTURE_OPEN 1    // the client connected
+#define CAPTURE_CLIENT 2  // bytes read from the client, followed by the bytes
+#define CAPTURE_SERVER 3  // bytes read from the server, only counted
+#define CAPTURE_FIN 4     // the client closed its sending side
+#define CAPTURE_CLOSE 5   // the pair was closed
+
+// a capture file starts with CAPTURE_MAGIC and the wall-clock time the capture started (usec since the epoch, 64 bits),
+// followed by records in the order the workers' rings were written out, each one the CAPTURE_HEADER_LEN byte header -
+// connection id (32 bits), type (8 bits), unused (8 bits), length (16 bits), usec since the capture started (64 bits),
+// all in network order - and, for CAPTURE_CLIENT, length bytes. records of one connection are in order
+
+// records a worker made and the capture writer has not yet written out, a single-producer single-consumer ring
+// head and tail only grow, the ring offset is taken modulo CAPTURE_RING_LEN
+struct CaptureRing {
+  char *data;
+  _Atomic unsigned long head;  // bytes recorded, only written by the worker
+  _Atomic unsigned long tail;  // bytes written out, only written by the capture writer
+  _Atomic unsigned long lost;  // connections no longer captured because the ring was full, only written by the worker
+} __attribute__((aligned(64))) CaptureRing;
+
+char *capture_path = NULL;  // capture every epoll-relayed pair to this file, NULL for no capture
+int capture_fd = -1;
+struct timespec capture_start;  // CLOCK_MONOTONIC time the capture started
+_Atomic unsigned int next_capture_id;
+struct CaptureRing capture_ring[THREAD_COUNT];
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;  // held while the rings are written out
+
+static void putCapture64(unsigned char *p, unsigned long long value)
+{
+  uint32_t high = htonl(value >> 32), low = htonl(value & 0xffffffff);
+
+  memcpy(p, &high, 4);
+  memcpy(p + 4, &low, 4);
+}
+
+// create the capture file and a ring for each worker, before the worker threads start
+// returns 0 if successful, -1 if not
+int initCapture(char *path)
+{
+  struct timeval now;
+  unsigned char header[16];
+  int i;
+
+  if ((capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+  {
+    perror("capture file");
+    return -1;
+  }
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    if ((capture_ring[i].data = malloc(CAPTURE_RING_LEN)) == NULL)
+    {
+      perror("malloc");
+      return -1;
+    }
+    addMemory(MEM_FIXED, CAPTURE_RING_LEN);
+    atomic_init(&capture_ring[i].head, 0);
+    atomic_init(&capture_ring[i].tail, 0);
+    atomic_init(&capture_ring[i].lost, 0);
+  }
+
+  gettimeofday(&now, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &capture_start);
+  memcpy(header, CAPTURE_MAGIC, 8);
+  putCapture64(header + 8, now.tv_sec * 1000000ULL + now.tv_usec);
+  if (write(capture_fd, header, sizeof(header)) != sizeof(header))
+  {
+    perror("capture file");
+    return -1;
+  }
+  atomic_init(&next_capture_id, 0);
+  return 0;
+}
+
+// copy len bytes to the ring at position pos, wrapping around its end
+static void copyToRing(struct CaptureRing *ring, unsigned long pos, const char *src, int len)
+{
+  int offset = pos & (CAPTURE_RING_LEN - 1), first = (offset + len > CAPTURE_RING_LEN) ? CAPTURE_RING_LEN - offset : len;
+
+  memcpy(ring->data + offset, src, first);
+  memcpy(ring->data, src + first, len - first);
+}
+
+// record len bytes of pair of the given type, split into records of at most CAPTURE_CHUNK_MAX bytes
+// the bytes of a CAPTURE_CLIENT record are data1 followed by data2, as a read into the relay ring may wrap
+// a pair whose records do not fit in the worker's ring is not captured from then on
+static void captureRecord(int thread_index, struct ConnPair *pair, int type, const char *data1, int len1, const char *data2, int len)
+{
+  struct CaptureRing *ring = &capture_ring[thread_index];
+  unsigned char header[CAPTURE_HEADER_LEN];
+  unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed), need;
+  unsigned long long usec = elapsedUsec(&capture_start, &timer_wheel[thread_index].now);
+  uint32_t id = htonl(pair->capture_id);
+  uint16_t chunk_len;
+  int offset, chunk, part;
+
+  need = ((len + CAPTURE_CHUNK_MAX - 1) / CAPTURE_CHUNK_MAX + (len == 0)) * CAPTURE_HEADER_LEN + ((type == CAPTURE_CLIENT) ? len : 0);
+  if (head + need - atomic_load_explicit(&ring->tail, memory_order_acquire) > CAPTURE_RING_LEN)
+  {
+    pair->capture_id = 0;
+    atomic_store_explicit(&ring->lost, atomic_load_explicit(&ring->lost, memory_order_relaxed) + 1, memory_order_relaxed);
+    return;
+  }
+
+  memcpy(header, &id, 4);
+  header[4] = type;
+  header[5] = 0;
+  putCapture64(header + 8, usec);
+  offset = 0;
+  do
+  {
+    chunk = (len - offset > CAPTURE_CHUNK_MAX) ? CAPTURE_CHUNK_MAX : len - offset;
+    chunk_len = htons(chunk);
+    memcpy(header + 6, &chunk_len, 2);
+    copyToRing(ring, head, (char*) header, CAPTURE_HEADER_LEN);
+    head += CAPTURE_HEADER_LEN;
+
+    if (type == CAPTURE_CLIENT)
+    {
+      // the part of the chunk in data1, then the part in data2
+      part = (offset < len1) ? ((offset + chunk > len1) ? len1 - offset : chunk) : 0;
+      copyToRing(ring, head, data1 + offset, part);
+      copyToRing(ring, head + part, data2 + offset + part - len1, chunk - part);
+      head += chunk;
+    }
+    offset += chunk;
+  } while (offset < len);
+
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+// start capturing a new pair, if the capture is on
+void captureOpen(int thread_index, struct ConnPair *pair)
+{
+  pair->capture_id = atomic_fetch_add_explicit(&next_capture_id, 1, memory_order_relaxed) + 1;
+  captureRecord(thread_index, pair, CAPTURE_OPEN, NULL, 0, NULL, 0);
+}
+
+// record n bytes just read from ep into its relay ring
+void captureRead(int thread_index, struct EndPointFd *ep, int n)
+{
+  int tail = (ep->ring_head + ep->buffered) % ep->buf_len, first = (tail + n > ep->buf_len) ? ep->buf_len - tail : n;
+
+  if (ep->is_client)
+  {
+    captureRecord(thread_index, ep->pair, CAPTURE_CLIENT, ep->ring + tail, first, ep->ring, n);
+  }
+  else
+  {
+    captureRecord(thread_index, ep->pair, CAPTURE_SERVER, NULL, 0, NULL, n);
+  }
+}
+
+// record a client closing its sending side, or the pair closing
+void captureEvent(int thread_index, struct ConnPair *pair, int type)
+{
+  captureRecord(thread_index, pair, type, NULL, 0, NULL, 0);
+}
+
+// write out everything the workers have recorded, in one writev per ring with records waiting
+static void flushCapture()
+{
+  struct CaptureRing *ring;
+  struct iovec iov[2];
+  unsigned long head, tail;
+  int i, offset;
+  ssize_t n;
+
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    ring = &capture_ring[i];
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (head == tail)
+    {
+      continue;
+    }
+
+    offset = tail & (CAPTURE_RING_LEN - 1);
+    iov[0].iov_base = ring->data + offset;
+    iov[0].iov_len = (offset + head - tail > CAPTURE_RING_LEN) ? CAPTURE_RING_LEN - offset : head - tail;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = head - tail - iov[0].iov_len;
+    if ((n = writev(capture_fd, iov, (iov[1].iov_len > 0) ? 2 : 1)) == -1)
+    {
+      // records that can't be written are dropped, so the workers keep capturing once the file can be written again
+      perror("capture write");
+      n = head - tail;
+    }
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+  }
+}
+
+// write out what was recorded on exit, unless the capture writer is in the middle of it
+void closeCapture()
+{
+  if (capture_fd != -1 && pthread_mutex_trylock(&capture_lock) == 0)
+  {
+    flushCapture();
+    pthread_mutex_unlock(&capture_lock);
+  }
+}
+
+// capture writer - writes out the records of every worker each CAPTURE_FLUSH_MSEC, so a worker never waits on the file
+void* captureMethod(void* arg)
+{
+  unsigned long lost, last_lost = 0;
+  int i;
+
+  while (TRUE)
+  {
+    usleep(CAPTURE_FLUSH_MSEC * 1000);
+
+    pthread_mutex_lock(&capture_lock);
+    flushCapture();
+    pthread_mutex_unlock(&capture_lock);
+
+    for (i = 0, lost = 0; i < THREAD_COUNT; i++)
+    {
+      lost += atomic_load_explicit(&capture_ring[i].lost, memory_order_relaxed);
+    }
+    if (lost != last_lost)
+    {
+      printf("Capture stopped for %lu connections that outran the capture writer\n", lost - last_lost);
+      last_lost = lost;
+    }
+  }
+  return 0;
+}
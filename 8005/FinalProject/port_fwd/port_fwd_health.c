@@ -0,0 +1,361 @@
+#include <poll.h>
+
+#define HEALTH_TICK_SEC 1          // how often the health checker looks for servers due a check
+#define HEALTH_TIMEOUT_MSEC 2000   // longest a check may take, if the check interval is not shorter
+#define HEALTH_RETRY_SEC 10        // seconds a server taken out by failed connects stays out, on rules without checks
+#define HEALTH_REPLY_BUFLEN 1024   // reply bytes a check reads looking for check_expect
+
+// check states
+#define PROBE_CONNECTING 0
+#define PROBE_SENDING 1
+#define PROBE_RECEIVING 2
+
+// one health check in progress - a non-blocking connect, then an optional send and expected reply
+struct HealthProbe {
+  struct PortForward *route;
+  struct Backend *backend;
+  int fd;
+  int state;
+  int sent;
+  int received;
+  char reply[HEALTH_REPLY_BUFLEN];
+} HealthProbe;
+
+static long long monotonicNsec()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// returns 1 if backend may be given new clients at now_nsec, 0 if it is out of rotation
+// on rules without checks, a server taken out by failed connects is tried again after HEALTH_RETRY_SEC
+static int backendUsable(struct PortForward *route, struct Backend *backend, long long now_nsec)
+{
+  if (atomic_load_explicit(&backend->healthy, memory_order_relaxed))
+  {
+    return 1;
+  }
+  return route->check_interval == 0 && now_nsec >= atomic_load_explicit(&backend->retry_nsec, memory_order_relaxed);
+}
+
+// take backend out of rotation, only the first thread to do so reports it
+static void markDown(struct PortForward *route, struct Backend *backend, const char *reason)
+{
+  int healthy = 1;
+
+  atomic_store_explicit(&backend->retry_nsec, monotonicNsec() + HEALTH_RETRY_SEC * 1000000000LL, memory_order_relaxed);
+  if (atomic_compare_exchange_strong(&backend->healthy, &healthy, 0))
+  {
+    printf("Server %s for port %i is down (%s)\n", backend->svr_name, route->rcv_port, reason);
+  }
+}
+
+// put backend back in rotation, only the first thread to do so reports it
+static void markUp(struct PortForward *route, struct Backend *backend, const char *reason)
+{
+  int healthy = 0;
+
+  if (atomic_compare_exchange_strong(&backend->healthy, &healthy, 1))
+  {
+    printf("Server %s for port %i is up (%s)\n", backend->svr_name, route->rcv_port, reason);
+  }
+}
+
+// passive check - a client's connect to backend failed, safe to call from any thread
+void backendFailed(struct PortForward *route, struct Backend *backend)
+{
+  if (atomic_fetch_add_explicit(&backend->failures, 1, memory_order_relaxed) + 1 >= route->fall)
+  {
+    markDown(route, backend, "failed connects");
+  }
+}
+
+// passive check - a client connected to backend, safe to call from any thread
+void backendConnected(struct PortForward *route, struct Backend *backend)
+{
+  if (atomic_load_explicit(&backend->failures, memory_order_relaxed) != 0)
+  {
+    atomic_store_explicit(&backend->failures, 0, memory_order_relaxed);
+  }
+  if (!atomic_load_explicit(&backend->healthy, memory_order_relaxed))
+  {
+    markUp(route, backend, "client connected");
+  }
+}
+
+// count the result of an active check
+static void recordCheck(struct PortForward *route, struct Backend *backend, int passed)
+{
+  if (passed)
+  {
+    atomic_store_explicit(&backend->failures, 0, memory_order_relaxed);
+    if (++backend->successes >= route->rise)
+    {
+      markUp(route, backend, "checks passed");
+    }
+    return;
+  }
+
+  backend->successes = 0;
+  if (atomic_fetch_add_explicit(&backend->failures, 1, memory_order_relaxed) + 1 >= route->fall)
+  {
+    markDown(route, backend, "checks failed");
+  }
+}
+
+// returns the server of route named name, or NULL if it has none
+static struct Backend* findBackend(struct PortForward *route, const char *name)
+{
+  int i;
+
+  for (i = 0; i < route->num_backends; i++)
+  {
+    if (strcmp(route->backends[i].svr_name, name) == 0)
+    {
+      return &route->backends[i];
+    }
+  }
+  return NULL;
+}
+
+// keep the health of the servers of old that are also in table, so a reload does not put failed servers back
+// a server is matched in the old rule of the same port first, as rules may check the same server differently,
+// and otherwise in the first old rule that has it
+// called with table_lock held
+void inheritHealth(struct RouteTable *table, struct RouteTable *old)
+{
+  struct PortForward *route;
+  struct Backend *backend, *old_backend;
+  int i, j, k;
+
+  for (i = 0; i < table->num_routes; i++)
+  {
+    route = &table->routes[i];
+    for (j = 0; j < route->num_backends; j++)
+    {
+      backend = &route->backends[j];
+      old_backend = NULL;
+      for (k = 0; k < old->num_routes && old_backend == NULL; k++)
+      {
+        if (old->routes[k].rcv_port == route->rcv_port)
+        {
+          old_backend = findBackend(&old->routes[k], backend->svr_name);
+        }
+      }
+      for (k = 0; k < old->num_routes && old_backend == NULL; k++)
+      {
+        old_backend = findBackend(&old->routes[k], backend->svr_name);
+      }
+
+      if (old_backend != NULL)
+      {
+        atomic_store(&backend->healthy, atomic_load(&old_backend->healthy));
+        atomic_store(&backend->failures, atomic_load(&old_backend->failures));
+        atomic_store(&backend->retry_nsec, atomic_load(&old_backend->retry_nsec));
+      }
+    }
+  }
+}
+
+// start a check of backend, connecting without blocking
+// returns 0 if the check is in progress, -1 if it failed at once
+static int startProbe(struct HealthProbe *probe, struct PortForward *route, struct Backend *backend)
+{
+  struct sockaddr_in server;
+  struct sockaddr *server_addr;
+  socklen_t server_len;
+
+  probe->route = route;
+  probe->backend = backend;
+  probe->state = PROBE_CONNECTING;
+  probe->sent = probe->received = 0;
+
+  if ((server_len = backendAddress(backend, &server, &server_addr)) == 0)
+  {
+    return -1;
+  }
+  if ((probe->fd = socket(server_addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+  {
+    perror("health check socket");
+    return -1;
+  }
+  if (connect(probe->fd, server_addr, server_len) == -1 && errno != EINPROGRESS)
+  {
+    close(probe->fd);
+    return -1;
+  }
+  return 0;
+}
+
+// move a check on after a poll event
+// returns 1 once it passed, -1 once it failed, 0 while it goes on
+static int stepProbe(struct HealthProbe *probe)
+{
+  struct PortForward *route = probe->route;
+  int n, err = 0;
+  socklen_t err_len = sizeof(err);
+
+  if (probe->state == PROBE_CONNECTING)
+  {
+    if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
+    {
+      return -1;
+    }
+    probe->state = (route->check_send != NULL) ? PROBE_SENDING : PROBE_RECEIVING;
+  }
+
+  if (probe->state == PROBE_SENDING)
+  {
+    if ((n = send(probe->fd, route->check_send + probe->sent, route->check_send_len - probe->sent, MSG_NOSIGNAL)) == -1)
+    {
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if ((probe->sent += n) < route->check_send_len)
+    {
+      return 0;
+    }
+    probe->state = PROBE_RECEIVING;
+  }
+
+  if (route->check_expect == NULL)
+  {
+    return 1;
+  }
+
+  // the expected text may arrive in pieces, so the reply is searched as a whole
+  if ((n = recv(probe->fd, probe->reply + probe->received, HEALTH_REPLY_BUFLEN - probe->received, 0)) == -1)
+  {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  probe->received += n;
+  if (memmem(probe->reply, probe->received, route->check_expect, route->check_expect_len) != NULL)
+  {
+    return 1;
+  }
+  return (n == 0 || probe->received == HEALTH_REPLY_BUFLEN) ? -1 : 0;
+}
+
+// check every server of table that is due, all at once, waiting at most HEALTH_TIMEOUT_MSEC
+static void runChecks(struct RouteTable *table)
+{
+  struct HealthProbe *probes = NULL;
+  struct pollfd *fds = NULL;
+  struct PortForward *route;
+  struct Backend *backend;
+  long long now_nsec = monotonicNsec(), deadline_nsec = now_nsec + HEALTH_TIMEOUT_MSEC * 1000000LL;
+  int i, j, n, result, num_probes = 0, capacity = 0, pending;
+
+  for (i = 0; i < table->num_routes; i++)
+  {
+    route = &table->routes[i];
+    for (j = 0; j < route->num_backends && route->check_interval > 0; j++)
+    {
+      backend = &route->backends[j];
+      if (backend->next_check_nsec > now_nsec)
+      {
+        continue;
+      }
+      backend->next_check_nsec = now_nsec + route->check_interval * 1000000000LL;
+      if (route->check_interval * 1000000000LL < deadline_nsec - now_nsec)
+      {
+        deadline_nsec = now_nsec + route->check_interval * 1000000000LL;
+      }
+
+      if (growArray((void**) &probes, num_probes, &capacity, sizeof(struct HealthProbe)) == -1)
+      {
+        printf("HealthProbe realloc error\n");
+        for (i = 0; i < num_probes; i++)
+        {
+          close(probes[i].fd);
+        }
+        free(probes);
+        return;
+      }
+      if (startProbe(&probes[num_probes], route, backend) == -1)
+      {
+        recordCheck(route, backend, 0);
+        continue;
+      }
+      num_probes++;
+    }
+  }
+  if (num_probes == 0)
+  {
+    free(probes);
+    return;
+  }
+  if ((fds = malloc(sizeof(struct pollfd) * num_probes)) == NULL)
+  {
+    perror("malloc");
+    for (i = 0; i < num_probes; i++)
+    {
+      close(probes[i].fd);
+    }
+    free(probes);
+    return;
+  }
+
+  // a finished check's fd is set to -1, which poll skips
+  for (i = 0; i < num_probes; i++)
+  {
+    fds[i].fd = probes[i].fd;
+  }
+  for (pending = num_probes; pending > 0 && (now_nsec = monotonicNsec()) < deadline_nsec; )
+  {
+    for (i = 0; i < num_probes; i++)
+    {
+      fds[i].events = (probes[i].state == PROBE_RECEIVING) ? POLLIN : POLLOUT;
+    }
+    if ((n = poll(fds, num_probes, (deadline_nsec - now_nsec + 999999) / 1000000)) == -1 && errno != EINTR)
+    {
+      perror("health check poll");
+      break;
+    }
+    for (i = 0; i < num_probes && n > 0; i++)
+    {
+      if (fds[i].fd == -1 || fds[i].revents == 0 || (result = stepProbe(&probes[i])) == 0)
+      {
+        continue;
+      }
+      recordCheck(probes[i].route, probes[i].backend, result == 1);
+      close(probes[i].fd);
+      fds[i].fd = -1;
+      pending--;
+    }
+  }
+
+  // checks still going on timed out
+  for (i = 0; i < num_probes; i++)
+  {
+    if (fds[i].fd != -1)
+    {
+      recordCheck(probes[i].route, probes[i].backend, 0);
+      close(probes[i].fd);
+    }
+  }
+  free(fds);
+  free(probes);
+}
+
+// health checker - checks the servers of every rule with a check interval in the current route table
+// the table is referenced while its servers are checked, so a reload never frees it under the checker
+void* healthMethod(void* arg)
+{
+  struct RouteTable *table;
+
+  while (TRUE)
+  {
+    sleep(HEALTH_TICK_SEC);
+
+    pthread_mutex_lock(&table_lock);
+    table = route_table;
+    acquireRouteTable(table);
+    pthread_mutex_unlock(&table_lock);
+
+    runChecks(table);
+    releaseRouteTable(table);
+  }
+  return 0;
+}
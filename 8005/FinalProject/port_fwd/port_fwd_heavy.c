@@ -0,0 +1,241 @@
+#define HEAVY_WIDTH_BITS 11                  // log2 of the counters in each sketch row
+#define HEAVY_WIDTH (1 << HEAVY_WIDTH_BITS)  // an estimate is over by at most e / HEAVY_WIDTH of the measure's total, most of the time
+#define HEAVY_DEPTH 4                        // sketch rows, each with its own hash
+#define HEAVY_TOP 10                         // clients each worker keeps as candidates for each measure, and most clients reported
+#define HEAVY_DECAY_SEC 10                   // counts are halved this often, so the tracker follows recent traffic
+
+// measures tracked per client address
+#define HEAVY_BYTES 0  // bytes relayed either way for the client
+#define HEAVY_CONNS 1  // clients set up
+#define HEAVY_MEASURES 2
+
+// heavy hitters - the client addresses with the most bytes and connections, without a table of every client
+// each worker counts its clients in count-min sketches of its own, and keeps the clients with the highest
+// estimates in a small min-heap per measure. sketches add up, so a report sums the workers' sketches and
+// ranks the workers' candidates against the sum. counts decay by half every HEAVY_DECAY_SEC
+
+// client among a worker's candidates, the heap is ordered by count
+struct HeavyEntry {
+  _Atomic in_addr_t ip;     // network order, 0 for an unused entry, read by the reporter
+  unsigned long long count; // the worker's estimate when last counted, only used by the worker
+} HeavyEntry;
+
+// counts of one worker thread, only that worker writes them
+struct HeavyShard {
+  _Atomic unsigned long long sketch[HEAVY_MEASURES][HEAVY_DEPTH][HEAVY_WIDTH];
+  struct HeavyEntry top[HEAVY_MEASURES][HEAVY_TOP];  // min-heap of the worker's heaviest clients
+  int num_top[HEAVY_MEASURES];
+  _Atomic unsigned long epoch;  // decay periods since the clock's start when the counts were last halved
+} __attribute__((aligned(64))) HeavyShard;
+
+// client and its estimate in a report
+struct HeavyClient {
+  in_addr_t ip;
+  unsigned long long count;
+} HeavyClient;
+
+struct HeavyShard heavy_shard[THREAD_COUNT]; // index is thread_index
+
+// odd multipliers of each row's multiply-shift hash
+const uint64_t heavy_mult[HEAVY_DEPTH] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL};
+
+// counter of ip in sketch row
+static inline int heavyIndex(in_addr_t ip, int row)
+{
+  return ((uint64_t) ip * heavy_mult[row]) >> (64 - HEAVY_WIDTH_BITS);
+}
+
+static inline unsigned long heavyEpoch(struct timespec *now)
+{
+  return now->tv_sec / HEAVY_DECAY_SEC;
+}
+
+// halve the shard's counts once for each decay period since they were last halved
+// heap order is kept, as every count is shifted alike
+static void decayShard(struct HeavyShard *shard, unsigned long epoch)
+{
+  unsigned long shift = epoch - atomic_load_explicit(&shard->epoch, memory_order_relaxed);
+  unsigned long long value;
+  int m, row, i;
+
+  if (shift > 63)
+  {
+    shift = 63;
+  }
+  for (m = 0; m < HEAVY_MEASURES; m++)
+  {
+    for (row = 0; row < HEAVY_DEPTH; row++)
+    {
+      for (i = 0; i < HEAVY_WIDTH; i++)
+      {
+        if ((value = atomic_load_explicit(&shard->sketch[m][row][i], memory_order_relaxed)) != 0)
+        {
+          atomic_store_explicit(&shard->sketch[m][row][i], value >> shift, memory_order_relaxed);
+        }
+      }
+    }
+    for (i = 0; i < shard->num_top[m]; i++)
+    {
+      shard->top[m][i].count >>= shift;
+    }
+  }
+  atomic_store_explicit(&shard->epoch, epoch, memory_order_release);
+}
+
+static void swapHeavy(struct HeavyEntry *a, struct HeavyEntry *b)
+{
+  in_addr_t ip = atomic_load_explicit(&a->ip, memory_order_relaxed);
+  unsigned long long count = a->count;
+
+  atomic_store_explicit(&a->ip, atomic_load_explicit(&b->ip, memory_order_relaxed), memory_order_relaxed);
+  a->count = b->count;
+  atomic_store_explicit(&b->ip, ip, memory_order_relaxed);
+  b->count = count;
+}
+
+// restore the heap below entry i after its count grew
+static void siftHeavyDown(struct HeavyEntry *heap, int num, int i)
+{
+  int child;
+
+  while ((child = 2 * i + 1) < num)
+  {
+    if (child + 1 < num && heap[child + 1].count < heap[child].count)
+    {
+      child++;
+    }
+    if (heap[i].count <= heap[child].count)
+    {
+      break;
+    }
+    swapHeavy(&heap[i], &heap[child]);
+    i = child;
+  }
+}
+
+// restore the heap above a new entry i
+static void siftHeavyUp(struct HeavyEntry *heap, int i)
+{
+  while (i > 0 && heap[(i - 1) / 2].count > heap[i].count)
+  {
+    swapHeavy(&heap[i], &heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+}
+
+// count n of a measure for the client at ip, from the worker that relays it
+void countClient(int thread_index, int measure, in_addr_t ip, unsigned long long n)
+{
+  struct HeavyShard *shard = &heavy_shard[thread_index];
+  struct HeavyEntry *heap = shard->top[measure];
+  unsigned long epoch = heavyEpoch(&timer_wheel[thread_index].now);
+  unsigned long long value, estimate = ULLONG_MAX;
+  int row, i, *num = &shard->num_top[measure];
+
+  if (epoch != atomic_load_explicit(&shard->epoch, memory_order_relaxed))
+  {
+    decayShard(shard, epoch);
+  }
+
+  // the estimate is the smallest of the client's counters, the one the fewest other clients share
+  for (row = 0; row < HEAVY_DEPTH; row++)
+  {
+    i = heavyIndex(ip, row);
+    value = atomic_load_explicit(&shard->sketch[measure][row][i], memory_order_relaxed) + n;
+    atomic_store_explicit(&shard->sketch[measure][row][i], value, memory_order_relaxed);
+    if (value < estimate)
+    {
+      estimate = value;
+    }
+  }
+
+  for (i = 0; i < *num && atomic_load_explicit(&heap[i].ip, memory_order_relaxed) != ip; i++);
+  if (i < *num)
+  {
+    heap[i].count = estimate;
+    siftHeavyDown(heap, *num, i);
+  }
+  else if (*num < HEAVY_TOP)
+  {
+    atomic_store_explicit(&heap[*num].ip, ip, memory_order_relaxed);
+    heap[*num].count = estimate;
+    siftHeavyUp(heap, (*num)++);
+  }
+  else if (estimate > heap[0].count)
+  {
+    // the client outgrew the lightest candidate and takes its place
+    atomic_store_explicit(&heap[0].ip, ip, memory_order_relaxed);
+    heap[0].count = estimate;
+    siftHeavyDown(heap, *num, 0);
+  }
+}
+
+static int compareHeavy(const void *a, const void *b)
+{
+  const struct HeavyClient *x = a, *y = b;
+
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+// merge the workers' counts of a measure into the heaviest clients, heaviest first, in out (HEAVY_TOP entries)
+// counts of a worker that has not counted since a decay period ended are decayed as they are read
+// returns the number of clients in out
+int topClients(int measure, struct HeavyClient *out)
+{
+  struct HeavyClient candidates[THREAD_COUNT * HEAVY_TOP];
+  struct timespec now;
+  unsigned long epoch, shift[THREAD_COUNT];
+  unsigned long long sum, estimate;
+  in_addr_t ip;
+  int num = 0, t, i, j, row;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  epoch = heavyEpoch(&now);
+  for (t = 0; t < THREAD_COUNT; t++)
+  {
+    shift[t] = epoch - atomic_load_explicit(&heavy_shard[t].epoch, memory_order_acquire);
+    if (shift[t] > 63)
+    {
+      shift[t] = 63;
+    }
+
+    // candidates of every worker, once each
+    for (i = 0; i < HEAVY_TOP; i++)
+    {
+      if ((ip = atomic_load_explicit(&heavy_shard[t].top[measure][i].ip, memory_order_relaxed)) == 0)
+      {
+        continue;
+      }
+      for (j = 0; j < num && candidates[j].ip != ip; j++);
+      if (j == num)
+      {
+        candidates[num++].ip = ip;
+      }
+    }
+  }
+
+  for (j = 0; j < num; j++)
+  {
+    estimate = ULLONG_MAX;
+    for (row = 0; row < HEAVY_DEPTH; row++)
+    {
+      i = heavyIndex(candidates[j].ip, row);
+      for (t = 0, sum = 0; t < THREAD_COUNT; t++)
+      {
+        sum += atomic_load_explicit(&heavy_shard[t].sketch[measure][row][i], memory_order_relaxed) >> shift[t];
+      }
+      if (sum < estimate)
+      {
+        estimate = sum;
+      }
+    }
+    candidates[j].count = estimate;
+  }
+
+  qsort(candidates, num, sizeof(struct HeavyClient), compareHeavy);
+  for (j = 0; j < num && j < HEAVY_TOP && candidates[j].count > 0; j++)
+  {
+    out[j] = candidates[j];
+  }
+  return j;
+}
@@ -0,0 +1,221 @@
+// listening socket for one forwarded port
+// listeners outlive route tables - a reload that keeps a port only swaps the listener's route
+struct Listener {
+  int tag;                             // TAG_LISTENER
+  int fd;                              // -1 unless listening
+  int port;
+  _Atomic(struct PortForward*) route;  // rule forwarding the port in the current route table
+  struct Listener *shard;              // per-worker SO_REUSEPORT listeners, NULL unless listeners are sharded
+} Listener;
+
+struct Listener *listener_by_port[MAX_PORT + 1]; // index is port, NULL if the port is not forwarded
+_Atomic unsigned long listener_generation; // bumped once listener_by_port changed, io_uring workers then re-arm their accepts
+
+int takeInheritedFd(int);
+
+// create a non-blocking listening socket on port
+// reuse_port lets several sockets bind the same port, the kernel spreads new connections across them
+// returns the listening fd, or -1 if the socket could not be created
+static int createListener(int port, int reuse_port)
+{
+  int fd, arg = 1;
+  struct sockaddr_in server;
+
+  // a socket handed over by the process being upgraded is already bound and listening
+  if ((fd = takeInheritedFd(port)) != -1)
+  {
+    return fd;
+  }
+
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+  {
+    perror("Can't create a socket");
+    return -1;
+  }
+
+  // reuse address socket option
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1)
+  {
+    perror("Can't set socket option");
+    close(fd);
+    return -1;
+  }
+
+  if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &arg, sizeof(arg)) == -1)
+  {
+    perror("Can't set SO_REUSEPORT");
+    close(fd);
+    return -1;
+  }
+
+  // set port for socket and bind address to the socket
+  memset(&server, 0, sizeof(struct sockaddr_in));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_ANY); // accept connections from any client
+  server.sin_port = htons(port);
+
+  if (bind(fd, (struct sockaddr *)&server, sizeof(server)) == -1)
+  {
+    perror("Can't bind name to socket");
+    close(fd);
+    return -1;
+  }
+
+  // listen for connections
+  if (listen(fd, LISTEN_BACKLOG) == -1)
+  {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// close a listener's sockets and free it
+static void closeListener(struct Listener *listener)
+{
+  int i;
+
+  if (listener->shard != NULL)
+  {
+    for (i = 0; i < THREAD_COUNT; i++)
+    {
+      if (listener->shard[i].fd != -1)
+      {
+        close(listener->shard[i].fd);
+      }
+    }
+    free(listener->shard);
+  }
+  if (listener->fd != -1)
+  {
+    close(listener->fd);
+  }
+  free(listener);
+}
+
+// create the listener for a forwarded port - one socket per worker thread when sharded
+// returns the listener, or NULL if its sockets could not be created
+static struct Listener* openListener(int port, struct PortForward *route)
+{
+  struct Listener *listener;
+  int i;
+
+  if ((listener = malloc(sizeof(struct Listener))) == NULL)
+  {
+    perror("malloc");
+    return NULL;
+  }
+  listener->tag = TAG_LISTENER;
+  listener->fd = -1;
+  listener->port = port;
+  atomic_init(&listener->route, route);
+  listener->shard = NULL;
+
+  if (!shard_listeners)
+  {
+    if ((listener->fd = createListener(port, 0)) == -1)
+    {
+      closeListener(listener);
+      return NULL;
+    }
+    return listener;
+  }
+
+  if ((listener->shard = malloc(sizeof(struct Listener) * THREAD_COUNT)) == NULL)
+  {
+    perror("malloc");
+    closeListener(listener);
+    return NULL;
+  }
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    listener->shard[i].tag = TAG_LISTENER;
+    listener->shard[i].fd = -1;
+    listener->shard[i].port = port;
+    atomic_init(&listener->shard[i].route, route);
+    listener->shard[i].shard = NULL;
+  }
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    if ((listener->shard[i].fd = createListener(port, 1)) == -1)
+    {
+      closeListener(listener);
+      return NULL;
+    }
+  }
+  return listener;
+}
+
+// returns the listener a worker thread waits on for a forwarded port
+static struct Listener* listenerFor(struct Listener *listener, int thread_index)
+{
+  if (shard_listeners)
+  {
+    return &listener->shard[thread_index];
+  }
+  return listener;
+}
+
+// returns the rule currently forwarding a listener's port
+static struct PortForward* listenerRoute(struct Listener *listener)
+{
+  return atomic_load_explicit(&listener->route, memory_order_acquire);
+}
+
+// point a listener at the rule forwarding its port in a new route table
+static void setListenerRoute(struct Listener *listener, struct PortForward *route)
+{
+  int i;
+
+  atomic_store_explicit(&listener->route, route, memory_order_release);
+  if (listener->shard != NULL)
+  {
+    for (i = 0; i < THREAD_COUNT; i++)
+    {
+      atomic_store_explicit(&listener->shard[i].route, route, memory_order_release);
+    }
+  }
+}
+
+// add or remove a listener in the epoll set of every thread that accepts on it
+// epoll_ctl is safe to call on another thread's epoll fd, so this runs on the main or reloader thread
+// a sharded listener belongs to one worker alone, so it is level-triggered and accepted in batches
+// io_uring workers have no epoll set, they arm accepts from listener_by_port on their own rings
+// returns 0 if successful, -1 if error
+static int updateListenerEpoll(struct Listener *listener, int op)
+{
+  struct epoll_event event;
+  struct Listener *target;
+  int i;
+
+  if (engine == ENGINE_URING)
+  {
+    return 0;
+  }
+
+  event.events = EPOLLIN | EPOLLERR | EPOLLHUP | (shard_listeners ? 0 : EPOLLET);
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    target = listenerFor(listener, i);
+    event.data.ptr = target;
+    if (epoll_ctl(epoll_fd[i], op, target->fd, &event) == -1)
+    {
+      perror("epoll_ctl");
+      return -1;
+    }
+  }
+
+  // the accept thread waits on every shared listener
+  if (!shard_listeners)
+  {
+    event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+    event.data.ptr = listener;
+    if (epoll_ctl(epoll_fd[THREAD_COUNT], op, listener->fd, &event) == -1)
+    {
+      perror("epoll_ctl");
+      return -1;
+    }
+  }
+  return 0;
+}
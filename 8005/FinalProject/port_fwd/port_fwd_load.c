@@ -0,0 +1,227 @@
+#define LOAD_INTERVAL_MSEC 250     // how often each worker updates its load estimate
+#define LOAD_DECAY 0.75            // weight of the previous estimate at each update, about a second of memory
+#define LOAD_BYTES_PER_EVENT 16384 // bytes relayed that count as much load as handling one event
+#define MIGRATE_RATIO 2            // a worker is overloaded above this many times the least loaded worker's load
+#define MIGRATE_MIN_LOAD 2000      // and above this load, so lightly loaded workers never migrate
+#define MIGRATE_MIN_AGE 5          // seconds a pair stays on a worker before it may be migrated
+#define MIGRATE_INTERVAL 2         // seconds between migrations off or onto one worker, so its load shows the last one first
+
+// decayed load of one worker thread - events handled and bytes relayed per second
+// the rates are published for placement, the rest is only used by the worker itself
+struct WorkerLoad {
+  _Atomic unsigned long load;         // events/sec plus bytes/sec in LOAD_BYTES_PER_EVENT units
+  _Atomic unsigned long bytes_rate;   // bytes/sec
+  _Atomic unsigned long events_rate;  // events/sec
+  _Atomic unsigned long updates;      // bumped with every published estimate
+  _Atomic unsigned long claimed_tick; // timer wheel tick a worker last claimed this worker as a migration target
+  double bytes_avg;
+  double events_avg;
+  struct timespec since;              // start of the current interval
+  unsigned long bytes;                // relayed in the current interval
+  unsigned long events;               // handled in the current interval
+  unsigned long window;               // interval number, pairs count their bytes per interval
+  struct ConnPair *heaviest;          // pair that relayed the most bytes in the current interval
+  unsigned long heaviest_bytes;
+  struct ConnPair *candidate;         // heaviest pair of the last interval, NULL once it closed
+  double candidate_share;             // its share of the bytes relayed in that interval
+  unsigned long migrated_tick;        // timer wheel tick this worker last migrated a pair off
+} __attribute__((aligned(64))) WorkerLoad;
+
+int migrate_pairs = 0; // move heavy pairs from overloaded workers to idle ones
+struct WorkerLoad worker_load[THREAD_COUNT]; // index is thread_index
+
+// pairs placed by the accept thread on each worker since that worker last published its load
+// only used by the accept thread
+unsigned long load_placed[THREAD_COUNT];
+unsigned long load_seen[THREAD_COUNT];
+
+void initWorkerLoad(int thread_index, struct timespec *now)
+{
+  memset(&worker_load[thread_index], 0, sizeof(struct WorkerLoad));
+  worker_load[thread_index].since = *now;
+}
+
+// count the events handled in one event loop iteration
+void addWorkerEvents(int thread_index, int events)
+{
+  worker_load[thread_index].events += events;
+}
+
+// returns the epoll_wait timeout in msec - timeout, or LOAD_INTERVAL_MSEC if shorter while the worker's
+// load estimate is above zero, so an idle worker's load decays instead of staying at its last value
+int loadWait(int thread_index, int timeout)
+{
+  struct WorkerLoad *load = &worker_load[thread_index];
+
+  if (load->bytes == 0 && load->events == 0 && atomic_load_explicit(&load->load, memory_order_relaxed) == 0)
+  {
+    return timeout;
+  }
+  return (timeout == -1 || timeout > LOAD_INTERVAL_MSEC) ? LOAD_INTERVAL_MSEC : timeout;
+}
+
+// count bytes relayed by a pair, and keep track of the heaviest pair of the interval
+void addPairLoad(int thread_index, struct ConnPair *pair, unsigned long bytes)
+{
+  struct WorkerLoad *load = &worker_load[thread_index];
+
+  load->bytes += bytes;
+  if (pair->load_window != load->window)
+  {
+    pair->load_window = load->window;
+    pair->window_bytes = 0;
+  }
+  pair->window_bytes += bytes;
+  if (pair->window_bytes > load->heaviest_bytes)
+  {
+    load->heaviest = pair;
+    load->heaviest_bytes = pair->window_bytes;
+  }
+}
+
+// forget a pair that is closed or migrated
+void dropPairLoad(int thread_index, struct ConnPair *pair)
+{
+  struct WorkerLoad *load = &worker_load[thread_index];
+
+  if (load->heaviest == pair)
+  {
+    load->heaviest = NULL;
+    load->heaviest_bytes = 0;
+  }
+  if (load->candidate == pair)
+  {
+    load->candidate = NULL;
+  }
+}
+
+// fold the current interval into the worker's decayed load once it is LOAD_INTERVAL_MSEC long
+// returns 1 if a new estimate was published, 0 otherwise
+int updateWorkerLoad(int thread_index, struct timespec *now)
+{
+  struct WorkerLoad *load = &worker_load[thread_index];
+  long long msec = (now->tv_sec - load->since.tv_sec) * 1000LL + (now->tv_nsec - load->since.tv_nsec) / 1000000;
+
+  if (msec < LOAD_INTERVAL_MSEC)
+  {
+    return 0;
+  }
+
+  load->bytes_avg = load->bytes_avg * LOAD_DECAY + (1 - LOAD_DECAY) * load->bytes * 1000.0 / msec;
+  load->events_avg = load->events_avg * LOAD_DECAY + (1 - LOAD_DECAY) * load->events * 1000.0 / msec;
+  atomic_store_explicit(&load->bytes_rate, load->bytes_avg, memory_order_relaxed);
+  atomic_store_explicit(&load->events_rate, load->events_avg, memory_order_relaxed);
+  atomic_store_explicit(&load->load, load->events_avg + load->bytes_avg / LOAD_BYTES_PER_EVENT, memory_order_relaxed);
+  atomic_fetch_add_explicit(&load->updates, 1, memory_order_release);
+
+  load->candidate = load->heaviest;
+  load->candidate_share = (load->bytes > 0) ? (double) load->heaviest_bytes / load->bytes : 0;
+  load->since = *now;
+  load->bytes = load->events = 0;
+  load->window++;
+  load->heaviest = NULL;
+  load->heaviest_bytes = 0;
+  return 1;
+}
+
+// returns the worker with the lowest published load other than exclude (-1 for none), fewest clients on ties
+// workers claimed as a migration target since min_claimed_tick are skipped, as their load does not show it yet
+static int leastLoadedWorker(int exclude, unsigned long min_claimed_tick)
+{
+  unsigned long load, best_load = 0;
+  int i, clients, best_clients = 0, best = -1;
+
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    if (i == exclude || atomic_load_explicit(&worker_load[i].claimed_tick, memory_order_relaxed) > min_claimed_tick)
+    {
+      continue;
+    }
+    load = atomic_load_explicit(&worker_load[i].load, memory_order_relaxed);
+    clients = atomic_load_explicit(&num_clients[i], memory_order_relaxed);
+    if (best == -1 || load < best_load || (load == best_load && clients < best_clients))
+    {
+      best = i;
+      best_load = load;
+      best_clients = clients;
+    }
+  }
+  return best;
+}
+
+// choose the worker thread for a new client, only called by the accept thread
+// a worker's load only shows its new pairs at its next update, so until then each pair placed on it
+// counts as the average load of a pair - otherwise a burst of clients would all land on one worker
+int placeNewPair()
+{
+  unsigned long load, total_load = 0, pair_load, score, best_score = 0, updates;
+  int i, clients, total_clients = 0, best_clients = 0, best = 0;
+
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    total_load += atomic_load_explicit(&worker_load[i].load, memory_order_relaxed);
+    total_clients += atomic_load_explicit(&num_clients[i], memory_order_relaxed);
+  }
+  pair_load = (total_clients > 0 && total_load / total_clients > 0) ? total_load / total_clients : 1;
+
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    if ((updates = atomic_load_explicit(&worker_load[i].updates, memory_order_acquire)) != load_seen[i])
+    {
+      load_seen[i] = updates;
+      load_placed[i] = 0;
+    }
+    load = atomic_load_explicit(&worker_load[i].load, memory_order_relaxed);
+    clients = atomic_load_explicit(&num_clients[i], memory_order_relaxed);
+    score = load + load_placed[i] * pair_load;
+    if (i == 0 || score < best_score || (score == best_score && clients < best_clients))
+    {
+      best = i;
+      best_score = score;
+      best_clients = clients;
+    }
+  }
+  load_placed[best]++;
+  return best;
+}
+
+// pick a pair to move off an overloaded worker, called after the worker published a new estimate
+// the heaviest pair of the last interval is moved to the least loaded worker, if it has been on this worker
+// for MIGRATE_MIN_AGE seconds and moving it leaves the target less loaded than this worker
+// the pair's load is taken as its share of the worker's bytes, applied to the worker's whole load
+// a worker claims its target with a compare-and-swap, so two workers never move pairs onto the same idle worker at once
+// returns the pair and sets target, or returns NULL if nothing should move
+struct ConnPair* migrationCandidate(int thread_index, unsigned long now_tick, int *target)
+{
+  struct WorkerLoad *load = &worker_load[thread_index];
+  struct ConnPair *pair = load->candidate;
+  unsigned long mine, theirs, pair_load, claimed, interval = MIGRATE_INTERVAL * 1000 / TIMER_TICK_MSEC;
+
+  if (!migrate_pairs || pair == NULL || pair->clnt.connecting || pair->svr.connecting ||
+      pair->svr.mux != NULL || pair->mirror.fd != -1 || pair->capture_id != 0 ||
+      now_tick - pair->placed_tick < MIGRATE_MIN_AGE * 1000 / TIMER_TICK_MSEC || now_tick - load->migrated_tick < interval)
+  {
+    return NULL;
+  }
+  if ((*target = leastLoadedWorker(thread_index, now_tick - interval)) == -1)
+  {
+    return NULL;
+  }
+
+  mine = atomic_load_explicit(&load->load, memory_order_relaxed);
+  theirs = atomic_load_explicit(&worker_load[*target].load, memory_order_relaxed);
+  pair_load = mine * load->candidate_share;
+  if (mine < MIGRATE_MIN_LOAD || mine <= theirs * MIGRATE_RATIO || theirs + pair_load >= mine - pair_load)
+  {
+    return NULL;
+  }
+
+  claimed = atomic_load_explicit(&worker_load[*target].claimed_tick, memory_order_relaxed);
+  if (claimed > now_tick - interval ||
+      !atomic_compare_exchange_strong_explicit(&worker_load[*target].claimed_tick, &claimed, now_tick, memory_order_relaxed, memory_order_relaxed))
+  {
+    return NULL;
+  }
+  load->migrated_tick = now_tick;
+  return pair;
+}
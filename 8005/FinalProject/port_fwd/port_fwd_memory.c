@@ -0,0 +1,192 @@
+#include <linux/sock_diag.h>
+
+#define RELAY_SHRUNK_LEN 16384  // relay buffer and pipe length of pairs given buffers while memory is short
+#define MEM_SHRINK_PCT 80       // share of the memory cap from which relay buffers are shrunk
+#define MEM_PAUSE_PCT 90        // share of the memory cap from which ends without a relay buffer stop reading
+#define MEM_PAUSE_MSEC 50       // how long a paused end waits before it tries to read again
+#define MEM_SAMPLE_EVERY 64     // relays of a worker between samples of a socket's kernel memory, a power of two
+
+// kinds of accounted memory
+#define MEM_PAIRS 0    // pair contexts, in the slabs of the workers' pools
+#define MEM_BUFFERS 1  // relay ring buffers and mux connections with their frame queues
+#define MEM_PIPES 2    // kernel pipes of splice relays and mirrors, at their capacity
+#define MEM_FIXED 3    // capture rings and io_uring buffers, allocated once at startup, reported but not capped
+#define MEM_KINDS 4
+
+const char *memory_kind[MEM_KINDS] = {"pairs", "buffers", "pipes", "fixed"};
+
+// memory levels, each one also applies the measures of the levels below it
+#define MEM_OK 0
+#define MEM_SHRINK 1   // new relay buffers and pipes are RELAY_SHRUNK_LEN, drained relay buffers are freed
+#define MEM_PAUSE 2    // ends that would need a new relay buffer to read wait until memory is freed
+#define MEM_REFUSE 3   // new clients are reset
+
+// the memory the forwarder allocates for its pairs is counted as it is allocated and freed, so the cap is
+// enforced without asking the allocator. allocations are per slab, buffer or pipe rather than per relay,
+// so the shared counters are updated far less often than the per-worker relay counters
+
+long long mem_cap = 0;  // bytes of accounted memory allowed, 0 for no cap
+_Atomic long long mem_used[MEM_KINDS];
+
+// kernel memory of the worker's sockets, sampled every MEM_SAMPLE_EVERY relays
+struct SocketMemory {
+  unsigned int relays;               // relays since the worker started, only used by the worker
+  _Atomic unsigned long long avg;    // decayed average of rmem_alloc + wmem_queued per sampled socket
+} __attribute__((aligned(64))) SocketMemory;
+
+struct SocketMemory socket_memory[THREAD_COUNT]; // index is thread_index
+
+// count n bytes of a kind of memory as allocated, or freed if negative, safe to call from any thread
+void addMemory(int kind, long long n)
+{
+  atomic_fetch_add_explicit(&mem_used[kind], n, memory_order_relaxed);
+}
+
+// returns the memory held for pairs, the memory the cap applies to
+long long usedMemory()
+{
+  long long used = 0;
+  int i;
+
+  for (i = 0; i < MEM_FIXED; i++)
+  {
+    used += atomic_load_explicit(&mem_used[i], memory_order_relaxed);
+  }
+  return used;
+}
+
+// returns the measures memory use calls for, MEM_OK without a cap
+int memoryLevel()
+{
+  long long used;
+
+  if (mem_cap == 0)
+  {
+    return MEM_OK;
+  }
+  used = usedMemory();
+  if (used >= mem_cap)
+  {
+    return MEM_REFUSE;
+  }
+  if (used >= mem_cap / 100 * MEM_PAUSE_PCT)
+  {
+    return MEM_PAUSE;
+  }
+  return (used >= mem_cap / 100 * MEM_SHRINK_PCT) ? MEM_SHRINK : MEM_OK;
+}
+
+// returns the length of a relay buffer or pipe allocated now
+int relayBufferLen()
+{
+  return (memoryLevel() >= MEM_SHRINK) ? RELAY_SHRUNK_LEN : RELAY_BUFLEN;
+}
+
+// allocate a ring buffer of len bytes for ep, which has none
+// returns 0 if successful, -1 if out of memory
+int allocRelayBuffer(struct EndPointFd *ep, int len)
+{
+  if ((ep->ring = malloc(len)) == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+  ep->buf_len = len;
+  addMemory(MEM_BUFFERS, len);
+  return 0;
+}
+
+void freeRelayBuffer(struct EndPointFd *ep)
+{
+  if (ep->ring != NULL)
+  {
+    free(ep->ring);
+    ep->ring = NULL;
+    addMemory(MEM_BUFFERS, -ep->buf_len);
+  }
+}
+
+// free the ring buffer of an end that has nothing left to send while memory is short, it is allocated again on its next read
+void shrinkRelayBuffer(struct EndPointFd *ep)
+{
+  if (ep->ring != NULL && ep->buffered == 0 && memoryLevel() >= MEM_SHRINK)
+  {
+    freeRelayBuffer(ep);
+  }
+}
+
+// returns 1 if ep may not read now because it would need a new relay buffer while memory is short
+// ends relaying through a pipe already hold theirs, and a stream's server end is filled by its connection
+int readPaused(struct EndPointFd *ep)
+{
+  return ep->ring == NULL && ep->pipe_fd[1] == -1 && ep->mux == NULL && memoryLevel() >= MEM_PAUSE;
+}
+
+// create a non-blocking pipe for pipe_fd and ask for len bytes of capacity, a pipe keeps its default if refused
+// returns its capacity, which is counted as allocated, or -1 if it could not be created
+int openRelayPipe(int *pipe_fd, int len)
+{
+  int capacity;
+
+  if (pipe2(pipe_fd, O_NONBLOCK) == -1)
+  {
+    pipe_fd[0] = pipe_fd[1] = -1;
+    return -1;
+  }
+  fcntl(pipe_fd[1], F_SETPIPE_SZ, len);
+  if ((capacity = fcntl(pipe_fd[1], F_GETPIPE_SZ)) == -1)
+  {
+    capacity = RELAY_BUFLEN;
+  }
+  addMemory(MEM_PIPES, capacity);
+  return capacity;
+}
+
+// close a pipe made by openRelayPipe, if it is open
+void closeRelayPipe(int *pipe_fd, int capacity)
+{
+  if (pipe_fd[0] == -1)
+  {
+    return;
+  }
+  close(pipe_fd[0]);
+  close(pipe_fd[1]);
+  pipe_fd[0] = pipe_fd[1] = -1;
+  addMemory(MEM_PIPES, -capacity);
+}
+
+// sample the kernel memory of a socket the worker just relayed on, once every MEM_SAMPLE_EVERY relays
+// busy sockets are sampled most, so the average leans towards sockets holding data
+void sampleSocketMemory(int thread_index, int fd)
+{
+  struct SocketMemory *sample = &socket_memory[thread_index];
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(meminfo);
+  unsigned long long avg;
+
+  if ((++sample->relays & (MEM_SAMPLE_EVERY - 1)) != 0 || fd == -1 ||
+      getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == -1)
+  {
+    return;
+  }
+  avg = atomic_load_explicit(&sample->avg, memory_order_relaxed);
+  avg = avg - avg / 16 + (meminfo[SK_MEMINFO_RMEM_ALLOC] + meminfo[SK_MEMINFO_WMEM_QUEUED]) / 16;
+  atomic_store_explicit(&sample->avg, avg, memory_order_relaxed);
+}
+
+// returns an estimate of the kernel memory held by the sockets of num_pairs pairs
+unsigned long long socketMemory(unsigned long long num_pairs)
+{
+  unsigned long long sum = 0, avg;
+  int i, num_sampled = 0;
+
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    if ((avg = atomic_load_explicit(&socket_memory[i].avg, memory_order_relaxed)) > 0)
+    {
+      sum += avg;
+      num_sampled++;
+    }
+  }
+  return (num_sampled > 0) ? sum / num_sampled * 2 * num_pairs : 0;
+}
@@ -0,0 +1,408 @@
+#include <stddef.h>
+
+#define METRICS_REQUEST_BUFLEN 2048  // request bytes read before answering a scrape
+#define METRICS_TIMEOUT_SEC 2        // a scraper that stalls longer than this is dropped
+
+int metrics_port = 0;  // admin port on localhost serving metrics, 0 to disable
+int metrics_fd = -1;
+pthread_t metrics_thread;
+
+int takeInheritedMetricsFd(int);
+
+// create the blocking admin listener on localhost
+// returns 0 if successful, -1 if error
+int initMetrics(int port)
+{
+  int arg = 1;
+  struct sockaddr_in server;
+
+  // keep serving on the listener of the process being upgraded
+  if ((metrics_fd = takeInheritedMetricsFd(port)) != -1)
+  {
+    return 0;
+  }
+
+  if ((metrics_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+  {
+    perror("Can't create metrics socket");
+    return -1;
+  }
+
+  if (setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1)
+  {
+    perror("Can't set socket option");
+    close(metrics_fd);
+    return -1;
+  }
+
+  // metrics are only served to the local host
+  memset(&server, 0, sizeof(struct sockaddr_in));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(port);
+
+  if (bind(metrics_fd, (struct sockaddr *)&server, sizeof(server)) == -1 || listen(metrics_fd, LISTEN_BACKLOG) == -1)
+  {
+    perror("Can't listen on metrics port");
+    close(metrics_fd);
+    return -1;
+  }
+  return 0;
+}
+
+// write a cumulative Prometheus histogram from the per-bucket counts of a StatsSnapshot
+static void writeHistogram(FILE *out, const char *name, const char *ports, unsigned long long *count, unsigned long long sum_usec)
+{
+  unsigned long long cumulative = 0;
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+  {
+    cumulative += count[i];
+    fprintf(out, "%s_bucket{route=\"%s\",le=\"%g\"} %llu\n", name, ports, latency_bucket_usec[i] / 1e6, cumulative);
+  }
+  cumulative += count[LATENCY_BUCKETS - 1];
+  fprintf(out, "%s_bucket{route=\"%s\",le=\"+Inf\"} %llu\n", name, ports, cumulative);
+  fprintf(out, "%s_sum{route=\"%s\"} %.6f\n", name, ports, sum_usec / 1e6);
+  fprintf(out, "%s_count{route=\"%s\"} %llu\n", name, ports, cumulative);
+}
+
+// write a per-route counter or gauge, value_offset selects the StatsSnapshot field
+static void writeRouteMetric(FILE *out, const char *name, const char *type, const char *help, struct StatsSnapshot *snapshots,
+  char (*ports)[MAX_PORT_RANGE_CHAR + 1], int num_routes, size_t value_offset)
+{
+  int i;
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  for (i = 0; i < num_routes; i++)
+  {
+    fprintf(out, "%s{route=\"%s\"} %llu\n", name, ports[i], *(unsigned long long*) ((char*) &snapshots[i] + value_offset));
+  }
+}
+
+// write a gauge of the heaviest clients of a measure, labelled by client address
+static void writeTopClients(FILE *out, const char *name, const char *help, int measure)
+{
+  struct HeavyClient top[HEAVY_TOP];
+  struct in_addr client;
+  int i, num_top = topClients(measure, top);
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+  for (i = 0; i < num_top; i++)
+  {
+    client.s_addr = top[i].ip;
+    fprintf(out, "%s{client=\"%s\"} %llu\n", name, inet_ntoa(client), top[i].count);
+  }
+}
+
+// returns the label of an event loop thread, its index for workers
+static const char* threadName(int thread_index, char *name)
+{
+  if (thread_index == THREAD_COUNT)
+  {
+    return "accept";
+  }
+  sprintf(name, "%i", thread_index);
+  return name;
+}
+
+// write the text exposition of all metrics to out
+// route counters are summed under table_lock, which the relay workers never take
+// returns 0 if successful, -1 if error
+static int writeMetrics(FILE *out)
+{
+  struct StatsSnapshot *snapshots;
+  struct PortForward *route;
+  struct Backend *backend;
+  char (*ports)[MAX_PORT_RANGE_CHAR + 1];
+  char thread_name[12];
+  unsigned long long num_pairs;
+  int i, j, num_routes;
+
+  pthread_mutex_lock(&table_lock);
+  num_routes = route_table->num_routes;
+  snapshots = malloc(sizeof(struct StatsSnapshot) * num_routes);
+  ports = malloc(sizeof(*ports) * num_routes);
+  if (snapshots == NULL || ports == NULL)
+  {
+    pthread_mutex_unlock(&table_lock);
+    perror("malloc");
+    free(snapshots);
+    free(ports);
+    return -1;
+  }
+  for (i = 0; i < num_routes; i++)
+  {
+    sumStats(route_table->routes[i].stats, &snapshots[i]);
+    routePorts(&route_table->routes[i], ports[i], sizeof(ports[i]));
+  }
+
+  // backend gauges need the table itself, so they are written before it can be replaced
+  fprintf(out, "# HELP port_fwd_backend_active_connections Client-server pairs connected to each server.\n");
+  fprintf(out, "# TYPE port_fwd_backend_active_connections gauge\n");
+  for (i = 0; i < num_routes; i++)
+  {
+    route = &route_table->routes[i];
+    for (j = 0; j < route->num_backends; j++)
+    {
+      backend = &route->backends[j];
+      fprintf(out, "port_fwd_backend_active_connections{route=\"%s\",backend=\"%s\"} %i\n", ports[i], backend->svr_name,
+        atomic_load_explicit(&backend->active_conns, memory_order_relaxed));
+    }
+  }
+  fprintf(out, "# HELP port_fwd_backend_up Whether each server is in rotation, 0 once failed checks or connects took it out.\n");
+  fprintf(out, "# TYPE port_fwd_backend_up gauge\n");
+  for (i = 0; i < num_routes; i++)
+  {
+    route = &route_table->routes[i];
+    for (j = 0; j < route->num_backends; j++)
+    {
+      backend = &route->backends[j];
+      fprintf(out, "port_fwd_backend_up{route=\"%s\",backend=\"%s\"} %i\n", ports[i], backend->svr_name,
+        atomic_load_explicit(&backend->healthy, memory_order_relaxed));
+    }
+  }
+  pthread_mutex_unlock(&table_lock);
+
+  writeRouteMetric(out, "port_fwd_active_connections", "gauge", "Client-server pairs currently relayed.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, active));
+  writeRouteMetric(out, "port_fwd_accepted_total", "counter", "Clients accepted.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, accepted));
+  writeRouteMetric(out, "port_fwd_rejected_total", "counter", "Clients reset by admission control or for lack of fds.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, rejected));
+  writeRouteMetric(out, "port_fwd_connections_total", "counter", "Client-server pairs connected.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, connections));
+  writeRouteMetric(out, "port_fwd_idle_timeouts_total", "counter", "Client-server pairs closed by the rule's idle timeout.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, idle_timeouts));
+  writeRouteMetric(out, "port_fwd_connect_errors_total", "counter", "Server connects that failed.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, connect_errors));
+  writeRouteMetric(out, "port_fwd_requests_total", "counter", "Relays that sent data on to the other end.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, requests));
+  writeRouteMetric(out, "port_fwd_bytes_in_total", "counter", "Bytes relayed from clients to servers.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, bytes_in));
+  writeRouteMetric(out, "port_fwd_bytes_out_total", "counter", "Bytes relayed from servers to clients.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, bytes_out));
+  writeRouteMetric(out, "port_fwd_throttled_total", "counter", "Times a relay was held back by the rule's bandwidth caps.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, throttled));
+  fprintf(out, "# HELP port_fwd_throttled_seconds_total Time relays were held back by the rule's bandwidth caps.\n");
+  fprintf(out, "# TYPE port_fwd_throttled_seconds_total counter\n");
+  for (i = 0; i < num_routes; i++)
+  {
+    fprintf(out, "port_fwd_throttled_seconds_total{route=\"%s\"} %.6f\n", ports[i], snapshots[i].throttle_usec / 1e6);
+  }
+  writeRouteMetric(out, "port_fwd_mirror_bytes_total", "counter", "Bytes of client data sent on to the rule's mirror.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, mirror_bytes));
+  writeRouteMetric(out, "port_fwd_mirror_drops_total", "counter", "Mirror connections cut off for failing or falling behind.",
+    snapshots, ports, num_routes, offsetof(struct StatsSnapshot, mirror_drops));
+
+  fprintf(out, "# HELP port_fwd_connect_latency_seconds Time from starting a server connect to its completion.\n");
+  fprintf(out, "# TYPE port_fwd_connect_latency_seconds histogram\n");
+  for (i = 0; i < num_routes; i++)
+  {
+    writeHistogram(out, "port_fwd_connect_latency_seconds", ports[i], snapshots[i].connect_latency, snapshots[i].connect_latency_usec);
+  }
+  fprintf(out, "# HELP port_fwd_relay_latency_seconds Time relayed data waits in the forwarder before it is all sent.\n");
+  fprintf(out, "# TYPE port_fwd_relay_latency_seconds histogram\n");
+  for (i = 0; i < num_routes; i++)
+  {
+    writeHistogram(out, "port_fwd_relay_latency_seconds", ports[i], snapshots[i].relay_latency, snapshots[i].relay_latency_usec);
+  }
+  free(snapshots);
+  free(ports);
+
+  // per-thread event loop figures, the accept thread only runs when epoll workers share listeners
+  fprintf(out, "# HELP port_fwd_worker_clients Client-server pairs owned by each worker thread.\n");
+  fprintf(out, "# TYPE port_fwd_worker_clients gauge\n");
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    fprintf(out, "port_fwd_worker_clients{thread=\"%i\"} %i\n", i, atomic_load_explicit(&num_clients[i], memory_order_relaxed));
+  }
+  fprintf(out, "# HELP port_fwd_worker_load_bytes_per_second Decayed rate of bytes relayed by each worker thread.\n");
+  fprintf(out, "# TYPE port_fwd_worker_load_bytes_per_second gauge\n");
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    fprintf(out, "port_fwd_worker_load_bytes_per_second{thread=\"%i\"} %lu\n", i, atomic_load_explicit(&worker_load[i].bytes_rate, memory_order_relaxed));
+  }
+  fprintf(out, "# HELP port_fwd_worker_load_events_per_second Decayed rate of events handled by each worker thread.\n");
+  fprintf(out, "# TYPE port_fwd_worker_load_events_per_second gauge\n");
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    fprintf(out, "port_fwd_worker_load_events_per_second{thread=\"%i\"} %lu\n", i, atomic_load_explicit(&worker_load[i].events_rate, memory_order_relaxed));
+  }
+  fprintf(out, "# HELP port_fwd_worker_migrations_total Client-server pairs each worker thread moved to a less loaded worker.\n");
+  fprintf(out, "# TYPE port_fwd_worker_migrations_total counter\n");
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    fprintf(out, "port_fwd_worker_migrations_total{thread=\"%i\"} %llu\n", i, atomic_load_explicit(&worker_stats[i].migrations, memory_order_relaxed));
+  }
+  fprintf(out, "# HELP port_fwd_worker_busy_seconds_total Time each event loop spent handling events.\n");
+  fprintf(out, "# TYPE port_fwd_worker_busy_seconds_total counter\n");
+  for (i = 0; i < THREAD_COUNT + (engine == ENGINE_EPOLL && !shard_listeners); i++)
+  {
+    fprintf(out, "port_fwd_worker_busy_seconds_total{thread=\"%s\"} %.6f\n", threadName(i, thread_name),
+      atomic_load_explicit(&worker_stats[i].busy_nsec, memory_order_relaxed) / 1e9);
+  }
+  fprintf(out, "# HELP port_fwd_worker_wakeups_total Returns from epoll_wait of each event loop.\n");
+  fprintf(out, "# TYPE port_fwd_worker_wakeups_total counter\n");
+  for (i = 0; i < THREAD_COUNT + (engine == ENGINE_EPOLL && !shard_listeners); i++)
+  {
+    fprintf(out, "port_fwd_worker_wakeups_total{thread=\"%s\"} %llu\n", threadName(i, thread_name),
+      atomic_load_explicit(&worker_stats[i].wakeups, memory_order_relaxed));
+  }
+
+  fprintf(out, "# HELP port_fwd_worker_memory_pauses_total Times an end of each worker thread stopped reading for want of memory.\n");
+  fprintf(out, "# TYPE port_fwd_worker_memory_pauses_total counter\n");
+  for (i = 0; i < THREAD_COUNT; i++)
+  {
+    fprintf(out, "port_fwd_worker_memory_pauses_total{thread=\"%i\"} %llu\n", i, atomic_load_explicit(&worker_stats[i].mem_pauses, memory_order_relaxed));
+  }
+
+  // memory accounted as it is allocated, and the kernel memory of the pairs' sockets estimated from samples
+  fprintf(out, "# HELP port_fwd_memory_bytes Memory held for pairs, relay buffers, pipes and fixed pools.\n");
+  fprintf(out, "# TYPE port_fwd_memory_bytes gauge\n");
+  for (i = 0; i < MEM_KINDS; i++)
+  {
+    fprintf(out, "port_fwd_memory_bytes{kind=\"%s\"} %lld\n", memory_kind[i], atomic_load_explicit(&mem_used[i], memory_order_relaxed));
+  }
+  fprintf(out, "# HELP port_fwd_memory_cap_bytes Cap on the memory held, 0 for no cap.\n");
+  fprintf(out, "# TYPE port_fwd_memory_cap_bytes gauge\n");
+  fprintf(out, "port_fwd_memory_cap_bytes %lld\n", mem_cap);
+  for (i = 0, num_pairs = 0; i < THREAD_COUNT; i++)
+  {
+    num_pairs += atomic_load_explicit(&num_clients[i], memory_order_relaxed);
+  }
+  fprintf(out, "# HELP port_fwd_socket_memory_bytes Kernel memory of the pairs' sockets, an estimate from sampled sockets.\n");
+  fprintf(out, "# TYPE port_fwd_socket_memory_bytes gauge\n");
+  fprintf(out, "port_fwd_socket_memory_bytes %llu\n", socketMemory(num_pairs));
+
+  // heaviest clients, estimates that decay by half every HEAVY_DECAY_SEC
+  writeTopClients(out, "port_fwd_top_client_bytes", "Decayed bytes relayed for the heaviest clients, an estimate.", HEAVY_BYTES);
+  writeTopClients(out, "port_fwd_top_client_connections", "Decayed connections of the heaviest clients, an estimate.", HEAVY_CONNS);
+  return 0;
+}
+
+// send all of buffer to fd, returns 0 if successful, -1 if error
+static int sendAll(int fd, const char *buffer, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+  {
+    if ((n = send(fd, buffer, len, MSG_NOSIGNAL)) == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    buffer += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// answer one HTTP request on fd with the metrics, or 404 for any path but / and /metrics
+static void serveScrape(int fd)
+{
+  char request[METRICS_REQUEST_BUFLEN], header[128], path[64];
+  char *body = NULL;
+  size_t body_len = 0, len = 0;
+  ssize_t n;
+  FILE *out;
+
+  // read the request line and headers, the request body is never needed
+  while (len < sizeof(request) - 1 && (n = recv(fd, request + len, sizeof(request) - 1 - len, 0)) > 0)
+  {
+    len += n;
+    request[len] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+    {
+      break;
+    }
+  }
+  request[len] = '\0';
+
+  if (sscanf(request, "GET %63s", path) != 1 || (strcmp(path, "/") != 0 && strcmp(path, "/metrics") != 0))
+  {
+    snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\n\r\nNot Found\n");
+    sendAll(fd, header, strlen(header));
+    return;
+  }
+
+  if ((out = open_memstream(&body, &body_len)) == NULL)
+  {
+    perror("open_memstream");
+    return;
+  }
+  if (writeMetrics(out) == -1)
+  {
+    fclose(out);
+    free(body);
+    return;
+  }
+  fclose(out);
+
+  snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+  if (sendAll(fd, header, strlen(header)) == 0)
+  {
+    sendAll(fd, body, body_len);
+  }
+  free(body);
+}
+
+// serve scrapes one at a time on the admin listener
+// counters are read with relaxed loads, so a scrape never blocks or slows a relay worker
+void* metricsMethod(void* arg)
+{
+  struct timeval timeout;
+  int fd;
+
+  // the thread is only cancelled while it waits for a scraper, never while it holds table_lock
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  timeout.tv_sec = METRICS_TIMEOUT_SEC;
+  timeout.tv_usec = 0;
+  while (TRUE)
+  {
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    fd = accept(metrics_fd, NULL, NULL);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (fd == -1)
+    {
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+      {
+        // out of fds or memory, the scraper waits in the backlog for a tick rather than the thread spinning
+        perror("metrics accept");
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        usleep(TIMER_TICK_MSEC * 1000);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+      }
+      else if (errno != EINTR)
+      {
+        perror("metrics accept");
+      }
+      continue;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+    {
+      perror("metrics setsockopt");
+    }
+    serveScrape(fd);
+    close(fd);
+  }
+  return 0;
+}
+
+// stop serving scrapes once the metrics listener was handed to a new process, which serves them from then on
+void stopMetrics()
+{
+  if (metrics_fd == -1)
+  {
+    return;
+  }
+  pthread_cancel(metrics_thread);
+  pthread_join(metrics_thread, NULL);
+  close(metrics_fd);
+  metrics_fd = -1;
+}
@@ -0,0 +1,226 @@
+#define MIRROR_PIPE_LEN 262144   // room for client data the mirror has not taken yet, before it is cut off
+#define MIRROR_DISCARD_LEN 65536 // most reply bytes of the mirror discarded per recv
+
+// replies of a unix mirror land here, unix sockets don't discard with MSG_TRUNC
+// nothing ever reads it, so the workers share it
+static char mirror_discard[MIRROR_DISCARD_LEN];
+
+// a mirror is a copy of the client-to-server direction of a pair, sent to the rule's mirror server
+// client data is copied with tee() from the pair's relay pipe into the mirror's own pipe, then spliced to the mirror,
+// so the payload never enters user space. the pair never waits on its mirror - a mirror that fails, or lets its
+// pipe fill up while the server keeps up, is cut off and the pair relays on without it
+
+// close the mirror of a pair, if it has one
+void closeMirror(struct MirrorEnd *mirror)
+{
+  if (mirror->fd == -1)
+  {
+    return;
+  }
+  close(mirror->fd);
+  mirror->fd = -1;
+  closeRelayPipe(mirror->pipe_fd, mirror->pipe_len);
+}
+
+// cut off a mirror that failed or fell behind its pair
+static void dropMirror(struct MirrorEnd *mirror, const char *reason)
+{
+  printf("Dropped mirror of client fd %i (%s)\n", mirror->pair->clnt.fd, reason);
+  addStat(&mirror->pair->route->stats[mirror->thread_index].mirror_drops, 1);
+  closeMirror(mirror);
+}
+
+// start mirroring a splice-relayed pair whose rule has a mirror, once it is registered with the worker's epoll loop
+// the mirror connects without blocking, client data relayed meanwhile waits in its pipe
+void openMirror(int thread_index, struct ConnPair *pair)
+{
+  struct MirrorEnd *mirror = &pair->mirror;
+  struct Backend *target = pair->route->mirror;
+  struct sockaddr_in server;
+  struct sockaddr *server_addr;
+  socklen_t server_len;
+  struct epoll_event event;
+
+  mirror->tag = TAG_MIRROR;
+  mirror->pair = pair;
+  mirror->thread_index = thread_index;
+  mirror->pipe_fd[0] = mirror->pipe_fd[1] = -1;
+  mirror->buffered = mirror->ahead = 0;
+  mirror->connecting = mirror->write_shut = 0;
+
+  if ((server_len = backendAddress(target, &server, &server_addr)) == 0 ||
+      (mirror->fd = socket(server_addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+  {
+    mirror->fd = -1;
+    printf("Can't mirror client fd %i to %s\n", pair->clnt.fd, target->svr_name);
+    addStat(&pair->route->stats[thread_index].mirror_drops, 1);
+    return;
+  }
+
+  // a larger pipe lets the mirror fall further behind before it is cut off, the default size is kept if refused
+  if ((mirror->pipe_len = openRelayPipe(mirror->pipe_fd, MIRROR_PIPE_LEN)) == -1)
+  {
+    dropMirror(mirror, "no pipe");
+    return;
+  }
+
+  if (connect(mirror->fd, server_addr, server_len) == -1)
+  {
+    if (errno != EINPROGRESS)
+    {
+      dropMirror(mirror, "can't connect");
+      return;
+    }
+    mirror->connecting = 1;
+  }
+
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = mirror;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, mirror->fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    dropMirror(mirror, "epoll");
+  }
+}
+
+// send the mirror as much of its pipe as it will take, then pass the client's close on once everything is sent
+void flushMirror(struct MirrorEnd *mirror)
+{
+  struct EndPointFd *clnt = &mirror->pair->clnt;
+  int n;
+
+  if (mirror->connecting)
+  {
+    return;
+  }
+
+  if (mirror->buffered > 0)
+  {
+    if ((n = splice(mirror->pipe_fd[0], NULL, mirror->fd, NULL, mirror->buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == -1)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        dropMirror(mirror, strerror(errno));
+      }
+      return;
+    }
+    mirror->buffered -= n;
+    addStat(&mirror->pair->route->stats[mirror->thread_index].mirror_bytes, n);
+  }
+
+  if (mirror->buffered == 0 && !mirror->write_shut && clnt->read_eof && clnt->buffered == 0)
+  {
+    shutdown(mirror->fd, SHUT_WR);
+    mirror->write_shut = 1;
+  }
+}
+
+// send the client's relay pipe to the server, copying each byte to the mirror pipe before it is sent
+// tee() copies from the front of the pipe, so nothing more is copied until the server has taken what was,
+// and while the mirror lasts at most the copied bytes are sent at a time
+// returns bytes sent, or -1 if nothing was sent (errno is set), like splice()
+int spliceMirrored(struct EndPointFd *ep)
+{
+  struct MirrorEnd *mirror = &ep->pair->mirror;
+  int n, len, teed, sent = 0;
+
+  while (sent < ep->buffered)
+  {
+    if (mirror->fd != -1 && mirror->ahead == 0)
+    {
+      if ((teed = tee(ep->pipe_fd[0], mirror->pipe_fd[1], ep->buffered - sent, SPLICE_F_NONBLOCK)) == -1)
+      {
+        if (errno != EAGAIN)
+        {
+          dropMirror(mirror, strerror(errno));
+        }
+      }
+      else
+      {
+        mirror->ahead = teed;
+        mirror->buffered += teed;
+      }
+    }
+
+    // the mirror pipe had no room, the server is sent everything and the mirror is let go
+    len = (mirror->fd != -1 && mirror->ahead > 0) ? mirror->ahead : ep->buffered - sent;
+    if ((n = splice(ep->pipe_fd[0], NULL, ep->alt->fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == -1)
+    {
+      return (sent > 0) ? sent : -1;
+    }
+    if (mirror->fd != -1 && n > mirror->ahead)
+    {
+      dropMirror(mirror, "fell behind");
+    }
+    else if (mirror->fd != -1)
+    {
+      mirror->ahead -= n;
+    }
+    sent += n;
+    if (n < len)
+    {
+      break;
+    }
+  }
+
+  if (mirror->fd != -1)
+  {
+    flushMirror(mirror);
+  }
+  return sent;
+}
+
+// handle an epoll event on a mirror - complete its connect, discard its replies and send it more client data
+void mirrorEvent(struct MirrorEnd *mirror, uint32_t events)
+{
+  int n, err = 0;
+  socklen_t err_len = sizeof(err);
+  char *discard;
+
+  // skip events for a mirror closed earlier in this batch
+  if (mirror->fd == -1)
+  {
+    return;
+  }
+  discard = mirror->pair->route->mirror->svr_unix ? mirror_discard : NULL;
+
+  if (mirror->connecting)
+  {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+      return;
+    }
+    if (getsockopt(mirror->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
+    {
+      dropMirror(mirror, "can't connect");
+      return;
+    }
+    mirror->connecting = 0;
+  }
+  else if (events & EPOLLERR)
+  {
+    dropMirror(mirror, "error");
+    return;
+  }
+
+  // replies are never relayed, MSG_TRUNC has the kernel discard them from a TCP mirror without copying
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+  {
+    while ((n = recv(mirror->fd, discard, MIRROR_DISCARD_LEN, MSG_TRUNC | MSG_DONTWAIT)) > 0);
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      // a mirror that closes once the client's close was passed on is done, one that closes early is cut off
+      if (mirror->write_shut)
+      {
+        closeMirror(mirror);
+      }
+      else
+      {
+        dropMirror(mirror, "closed by mirror");
+      }
+      return;
+    }
+  }
+
+  flushMirror(mirror);
+}
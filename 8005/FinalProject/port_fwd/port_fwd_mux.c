@@ -0,0 +1,563 @@
+#include <netinet/tcp.h>
+
+// backend multiplexing, epoll engine only - the clients of a rule with the mux option are carried as streams over a few
+// persistent connections to each server, instead of a connection each, for servers behind a demultiplexer like mux_shim
+//
+// every frame is an 8 byte header - stream id (32 bits), type (8 bits), unused (8 bits) and payload length (16 bits),
+// in network order - followed by the payload
+// each side may send MUX_STREAM_WINDOW bytes of a stream's data before the other grants more with MUX_FRAME_WINDOW,
+// as it passes the data on, so one slow stream never holds up the others on its connection
+#define MUX_FRAME_OPEN 1    // port_fwd opens a stream, the demultiplexer connects it to its server
+#define MUX_FRAME_DATA 2    // the payload is data of the stream
+#define MUX_FRAME_FIN 3     // the sender has no more data for the stream
+#define MUX_FRAME_CLOSE 4   // the stream is gone, both sides release it
+#define MUX_FRAME_WINDOW 5  // the 4 byte payload is the number of bytes of the stream the receiver passed on
+
+#define MUX_HEADER_LEN 8
+#define MUX_FRAME_MAX 16384         // largest DATA payload
+#define MUX_STREAM_WINDOW 65536     // bytes of a stream in flight each way, the size of the relay buffer it is received into
+#define MUX_MAX_STREAMS 256         // streams carried at once by one backend connection
+#define MUX_OUT_HIGH_WATER 262144   // stop framing client data once this many bytes wait to be sent on a connection
+#define MUX_IN_BUFLEN (4 * (MUX_HEADER_LEN + MUX_FRAME_MAX))  // bytes read from a connection at once
+
+// persistent backend connection of a worker, carrying the server ends of up to MUX_MAX_STREAMS of its pairs
+struct MuxConn {
+  int tag;                  // TAG_MUX_CONN
+  int fd;                   // -1 once the connection failed, it is then freed by flushMuxConns
+  int thread_index;         // worker that owns the connection and its streams
+  struct sockaddr_in addr;  // server
+  int connecting;           // 1 while the non-blocking connect is in progress, frames are held until it completes
+  int broken;               // a frame could not be queued, the connection is failed by flushMuxConns
+  char *out;                // frames waiting to be sent, starting at out_head
+  int out_head;
+  int out_len;
+  int out_cap;
+  int out_blocked;          // the socket stopped taking data, the rest is sent once it reports EPOLLOUT
+  char in[MUX_IN_BUFLEN];   // frames received, the last of them possibly incomplete
+  int in_len;
+  unsigned int next_stream_id;
+  int num_streams;
+  struct EndPointFd *streams[MUX_MAX_STREAMS];  // server ends, index is stream id % MUX_MAX_STREAMS
+  int dirty;                    // waits in the worker's dirty list
+  struct MuxConn *next;         // next connection of the worker
+  struct MuxConn *next_dirty;
+} MuxConn;
+
+struct MuxConn *mux_conns[THREAD_COUNT];  // backend connections of each worker
+struct MuxConn *mux_dirty[THREAD_COUNT];  // connections of each worker with frames to send, or waiting to be freed
+
+// queue conn to be flushed at the end of its worker's event loop iteration, so frames of many streams share a send
+static void markDirty(struct MuxConn *conn)
+{
+  if (!conn->dirty)
+  {
+    conn->dirty = 1;
+    conn->next_dirty = mux_dirty[conn->thread_index];
+    mux_dirty[conn->thread_index] = conn;
+  }
+}
+
+// append the header of a frame to conn's send buffer
+// returns a pointer to the frame's payload, for len bytes, or NULL if the buffer could not grow
+static char* reserveFrame(struct MuxConn *conn, unsigned int stream_id, int type, int len)
+{
+  char *frame, *out;
+  uint32_t id = htonl(stream_id);
+  uint16_t length = htons(len);
+  int cap;
+
+  if (conn->broken)
+  {
+    return NULL;
+  }
+
+  // sent frames are dropped from the front before the buffer grows
+  if (conn->out_head > 0 && conn->out_head + conn->out_len + MUX_HEADER_LEN + len > conn->out_cap)
+  {
+    memmove(conn->out, conn->out + conn->out_head, conn->out_len);
+    conn->out_head = 0;
+  }
+  if (conn->out_len + MUX_HEADER_LEN + len > conn->out_cap)
+  {
+    for (cap = (conn->out_cap > 0) ? conn->out_cap : MUX_IN_BUFLEN; cap < conn->out_len + MUX_HEADER_LEN + len; cap *= 2);
+    if ((out = realloc(conn->out, cap)) == NULL)
+    {
+      perror("mux realloc");
+      conn->broken = 1;
+      markDirty(conn);
+      return NULL;
+    }
+    addMemory(MEM_BUFFERS, cap - conn->out_cap);
+    conn->out = out;
+    conn->out_cap = cap;
+  }
+
+  frame = conn->out + conn->out_head + conn->out_len;
+  memcpy(frame, &id, 4);
+  frame[4] = type;
+  frame[5] = 0;
+  memcpy(frame + 6, &length, 2);
+  conn->out_len += MUX_HEADER_LEN + len;
+  markDirty(conn);
+  return frame + MUX_HEADER_LEN;
+}
+
+// queue a frame without data, or the WINDOW frame granting n more bytes
+static void queueFrame(struct MuxConn *conn, unsigned int stream_id, int type, uint32_t n)
+{
+  char *payload;
+
+  n = htonl(n);
+  if ((payload = reserveFrame(conn, stream_id, type, (type == MUX_FRAME_WINDOW) ? 4 : 0)) != NULL && type == MUX_FRAME_WINDOW)
+  {
+    memcpy(payload, &n, 4);
+  }
+}
+
+// release a connection and its frame queue once its fd is closed
+static void freeMuxConn(struct MuxConn *conn)
+{
+  addMemory(MEM_BUFFERS, -(long long) (sizeof(struct MuxConn) + conn->out_cap));
+  free(conn->out);
+  free(conn);
+}
+
+// open a backend connection of the worker to server
+// returns the connection, or NULL if the connect failed at once
+static struct MuxConn* openMuxConn(int thread_index, struct sockaddr_in *server)
+{
+  struct MuxConn *conn;
+  struct epoll_event event;
+  int nodelay = 1;
+
+  if ((conn = calloc(1, sizeof(struct MuxConn))) == NULL)
+  {
+    perror("calloc");
+    return NULL;
+  }
+  addMemory(MEM_BUFFERS, sizeof(struct MuxConn));
+  conn->tag = TAG_MUX_CONN;
+  conn->thread_index = thread_index;
+  conn->addr = *server;
+
+  if ((conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+  {
+    perror("mux socket");
+    freeMuxConn(conn);
+    return NULL;
+  }
+
+  // frames of many streams are already batched into each send, Nagle would only hold small ones back
+  if (setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1)
+  {
+    perror("setsockopt TCP_NODELAY");
+  }
+  if (connect(conn->fd, (struct sockaddr*) server, sizeof(*server)) == -1)
+  {
+    if (errno != EINPROGRESS)
+    {
+      perror("mux connect");
+      close(conn->fd);
+      freeMuxConn(conn);
+      return NULL;
+    }
+    conn->connecting = 1;
+  }
+
+  // both directions stay armed, edge-triggered, so the connection is never modified in epoll
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = conn;
+  if (epoll_ctl(epoll_fd[thread_index], EPOLL_CTL_ADD, conn->fd, &event) == -1)
+  {
+    perror("epoll_ctl");
+    close(conn->fd);
+    freeMuxConn(conn);
+    return NULL;
+  }
+
+  conn->next = mux_conns[thread_index];
+  mux_conns[thread_index] = conn;
+  printf("Opened mux connection fd %i to server %s:%i on worker %i\n", conn->fd, inet_ntoa(server->sin_addr), ntohs(server->sin_port), thread_index);
+  return conn;
+}
+
+// returns the worker's backend connection to server that a new stream goes on - the one with the fewest streams,
+// or a new one while fewer than max_conns connections are open and all of them carry streams
+// returns NULL if no connection could take the stream
+struct MuxConn* findMuxConn(int thread_index, struct sockaddr_in *server, int max_conns)
+{
+  struct MuxConn *conn, *best = NULL;
+  int num_conns = 0;
+
+  for (conn = mux_conns[thread_index]; conn != NULL; conn = conn->next)
+  {
+    if (conn->broken || conn->addr.sin_addr.s_addr != server->sin_addr.s_addr || conn->addr.sin_port != server->sin_port)
+    {
+      continue;
+    }
+    num_conns++;
+    if (best == NULL || conn->num_streams < best->num_streams)
+    {
+      best = conn;
+    }
+  }
+
+  if (num_conns < max_conns && (best == NULL || best->num_streams > 0))
+  {
+    return openMuxConn(thread_index, server);
+  }
+  return (best != NULL && best->num_streams < MUX_MAX_STREAMS) ? best : NULL;
+}
+
+// carry the server end svr of a new pair as a stream of conn
+void attachStream(struct MuxConn *conn, struct EndPointFd *svr)
+{
+  // a slot is only reused once the stream before it was closed, and ids keep increasing,
+  // so a late frame of a closed stream never reaches a new one
+  while (conn->streams[conn->next_stream_id % MUX_MAX_STREAMS] != NULL)
+  {
+    conn->next_stream_id++;
+  }
+  svr->mux = conn;
+  svr->stream_id = conn->next_stream_id++;
+  svr->send_window = MUX_STREAM_WINDOW;
+  conn->streams[svr->stream_id % MUX_MAX_STREAMS] = svr;
+  conn->num_streams++;
+  queueFrame(conn, svr->stream_id, MUX_FRAME_OPEN, 0);
+}
+
+// release the stream of a server end whose pair is closed, telling the demultiplexer unless the connection failed
+void closeStream(struct EndPointFd *svr)
+{
+  struct MuxConn *conn = svr->mux;
+
+  conn->streams[svr->stream_id % MUX_MAX_STREAMS] = NULL;
+  conn->num_streams--;
+  if (conn->fd != -1)
+  {
+    queueFrame(conn, svr->stream_id, MUX_FRAME_CLOSE, 0);
+  }
+  svr->mux = NULL;
+}
+
+// frame as much client data buffered in clnt as its stream's window and its connection's send buffer allow
+// returns number of bytes framed, 0 if the stream must wait for a window or the connection to drain, -1 if the connection failed
+int sendStreamData(struct EndPointFd *clnt)
+{
+  struct EndPointFd *svr = clnt->alt;
+  struct MuxConn *conn = svr->mux;
+  int n, len, first, total = 0;
+  char *payload;
+
+  while (clnt->buffered > 0 && svr->send_window > 0 && conn->out_len < MUX_OUT_HIGH_WATER)
+  {
+    len = (clnt->buffered < svr->send_window) ? clnt->buffered : svr->send_window;
+    if (len > MUX_FRAME_MAX)
+    {
+      len = MUX_FRAME_MAX;
+    }
+    if ((payload = reserveFrame(conn, svr->stream_id, MUX_FRAME_DATA, len)) == NULL)
+    {
+      return -1;
+    }
+
+    // buffered data may wrap around the end of the ring
+    first = (clnt->ring_head + len > clnt->buf_len) ? clnt->buf_len - clnt->ring_head : len;
+    memcpy(payload, clnt->ring + clnt->ring_head, first);
+    memcpy(payload + first, clnt->ring, len - first);
+
+    n = len;
+    clnt->buffered -= n;
+    clnt->ring_head = (clnt->buffered == 0) ? 0 : (clnt->ring_head + n) % clnt->buf_len;
+    svr->send_window -= n;
+    total += n;
+  }
+  return total;
+}
+
+// pass the close of the client's sending side on to svr's stream
+void shutdownStream(struct EndPointFd *svr)
+{
+  queueFrame(svr->mux, svr->stream_id, MUX_FRAME_FIN, 0);
+}
+
+// let the demultiplexer send n more bytes on svr's stream, once n bytes of it were relayed to the client
+void grantStream(struct EndPointFd *svr, int n)
+{
+  queueFrame(svr->mux, svr->stream_id, MUX_FRAME_WINDOW, n);
+}
+
+// close conn and every pair with a stream on it
+// the connection itself is freed by flushMuxConns, after any events for it in the same epoll_wait batch
+static void failMuxConn(struct MuxConn *conn)
+{
+  struct MuxConn **link;
+  int i;
+
+  printf("Closing mux connection fd %i to server %s:%i with %i streams\n", conn->fd, inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port), conn->num_streams);
+  for (link = &mux_conns[conn->thread_index]; *link != conn; link = &(*link)->next);
+  *link = conn->next;
+  close(conn->fd);
+  conn->fd = -1;
+
+  for (i = 0; i < MUX_MAX_STREAMS; i++)
+  {
+    if (conn->streams[i] != NULL)
+    {
+      closeConnection(conn->streams[i], conn->thread_index);
+    }
+  }
+}
+
+// place the data of a DATA frame in svr's relay buffer and relay it to the client
+// returns 0 if successful, -1 if the demultiplexer sent more than the stream's window
+static int receiveStreamData(struct EndPointFd *svr, char *data, int len, int thread_index)
+{
+  int tail, first;
+
+  if (len > RELAY_BUFLEN - svr->buffered)
+  {
+    return -1;
+  }
+  // a stream's buffer is always full length, the demultiplexer may send a whole window of RELAY_BUFLEN bytes
+  if (svr->ring == NULL && allocRelayBuffer(svr, RELAY_BUFLEN) == -1)
+  {
+    return -1;
+  }
+
+  // free space may wrap around the end of the ring
+  tail = (svr->ring_head + svr->buffered) % RELAY_BUFLEN;
+  first = (tail + len > RELAY_BUFLEN) ? RELAY_BUFLEN - tail : len;
+  memcpy(svr->ring + tail, data, first);
+  memcpy(svr->ring, data + first, len - first);
+  if (svr->buffered == 0)
+  {
+    svr->buffered_since = timer_wheel[thread_index].now;
+  }
+  svr->buffered += len;
+
+  forward(svr, thread_index);
+  return 0;
+}
+
+// handle one frame received on conn
+// returns 0 if successful, -1 if the frame breaks the protocol
+static int handleFrame(struct MuxConn *conn, unsigned int stream_id, int type, char *payload, int len, int thread_index)
+{
+  struct EndPointFd *svr = conn->streams[stream_id % MUX_MAX_STREAMS];
+  uint32_t n;
+
+  // frames of a stream port_fwd already closed are dropped
+  if (svr == NULL || svr->stream_id != stream_id)
+  {
+    return 0;
+  }
+
+  switch (type)
+  {
+    case MUX_FRAME_DATA:
+      return receiveStreamData(svr, payload, len, thread_index);
+
+    case MUX_FRAME_FIN:
+      svr->read_eof = 1;
+      forward(svr, thread_index);
+      return 0;
+
+    case MUX_FRAME_CLOSE:
+      closeConnection(svr, thread_index);
+      return 0;
+
+    case MUX_FRAME_WINDOW:
+      if (len != 4)
+      {
+        return -1;
+      }
+      memcpy(&n, payload, 4);
+      svr->send_window += ntohl(n);
+      if (svr->alt->buffered > 0)
+      {
+        forward(svr->alt, thread_index);
+      }
+      return 0;
+  }
+  return -1;
+}
+
+// read what conn received and handle every complete frame
+// returns 0 if the connection is still open, -1 if it closed or broke the protocol
+static int readMuxConn(struct MuxConn *conn, int thread_index)
+{
+  int n, offset, len, type;
+  uint32_t stream_id;
+  uint16_t length;
+
+  while (TRUE)
+  {
+    if ((n = read(conn->fd, conn->in + conn->in_len, MUX_IN_BUFLEN - conn->in_len)) == 0)
+    {
+      return -1;
+    }
+    else if (n == -1)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return 0;
+      }
+      perror("mux read");
+      return -1;
+    }
+    conn->in_len += n;
+
+    for (offset = 0; conn->in_len - offset >= MUX_HEADER_LEN; offset += MUX_HEADER_LEN + len)
+    {
+      memcpy(&stream_id, conn->in + offset, 4);
+      type = conn->in[offset + 4];
+      memcpy(&length, conn->in + offset + 6, 2);
+      if ((len = ntohs(length)) > MUX_FRAME_MAX)
+      {
+        return -1;
+      }
+      if (conn->in_len - offset < MUX_HEADER_LEN + len)
+      {
+        break;
+      }
+      if (handleFrame(conn, ntohl(stream_id), type, conn->in + offset + MUX_HEADER_LEN, len, thread_index) == -1)
+      {
+        fprintf(stderr, "Invalid frame on mux connection fd %i\n", conn->fd);
+        return -1;
+      }
+    }
+
+    // keep the incomplete frame for the next read
+    conn->in_len -= offset;
+    memmove(conn->in, conn->in + offset, conn->in_len);
+  }
+}
+
+// handle an epoll event on a backend connection
+void muxEvent(struct MuxConn *conn, uint32_t events, int thread_index)
+{
+  struct EndPointFd *svr = NULL;
+  int i, err = 0;
+  socklen_t err_len = sizeof(err);
+
+  if (conn->fd == -1)
+  {
+    return;
+  }
+
+  if (conn->connecting)
+  {
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+      return;
+    }
+
+    // the first stream stands for the connection in the health of its server
+    for (i = 0; i < MUX_MAX_STREAMS && svr == NULL; i++)
+    {
+      svr = conn->streams[i];
+    }
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0)
+    {
+      fprintf(stderr, "Can't connect mux connection to server %s:%i: %s\n", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port), strerror(err != 0 ? err : errno));
+      if (svr != NULL)
+      {
+        addStat(&worker_stats[thread_index].connect_errors, 1);
+        addStat(&svr->pair->route->stats[thread_index].connect_errors, 1);
+        backendFailed(svr->pair->route, svr->pair->backend);
+      }
+      failMuxConn(conn);
+      markDirty(conn);
+      return;
+    }
+    conn->connecting = 0;
+    if (svr != NULL)
+    {
+      backendConnected(svr->pair->route, svr->pair->backend);
+    }
+  }
+
+  if (events & EPOLLOUT)
+  {
+    conn->out_blocked = 0;
+    markDirty(conn);
+  }
+
+  if ((events & EPOLLERR) || ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && readMuxConn(conn, thread_index) == -1))
+  {
+    failMuxConn(conn);
+    markDirty(conn);
+  }
+}
+
+// send the queued frames of conn
+// returns 0 if successful, -1 if the connection failed
+static int sendMuxConn(struct MuxConn *conn)
+{
+  int n;
+
+  while (conn->out_len > 0)
+  {
+    if ((n = send(conn->fd, conn->out + conn->out_head, conn->out_len, MSG_NOSIGNAL)) == -1)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        conn->out_blocked = 1;
+        return 0;
+      }
+      perror("mux send");
+      return -1;
+    }
+    conn->out_len -= n;
+    conn->out_head = (conn->out_len == 0) ? 0 : conn->out_head + n;
+  }
+  return 0;
+}
+
+// send the frames queued on the worker's connections in this event loop iteration, and free failed connections
+// streams that waited for a connection to drain are relayed again, which may queue more frames
+void flushMuxConns(int thread_index)
+{
+  struct MuxConn *conn;
+  int i, was_full;
+
+  while ((conn = mux_dirty[thread_index]) != NULL)
+  {
+    mux_dirty[thread_index] = conn->next_dirty;
+    conn->dirty = 0;
+
+    if (conn->fd != -1 && conn->broken)
+    {
+      failMuxConn(conn);
+    }
+    if (conn->fd == -1)
+    {
+      freeMuxConn(conn);
+      continue;
+    }
+    if (conn->connecting || conn->out_blocked)
+    {
+      continue;
+    }
+
+    was_full = conn->out_len >= MUX_OUT_HIGH_WATER;
+    if (sendMuxConn(conn) == -1)
+    {
+      failMuxConn(conn);
+      freeMuxConn(conn);
+      continue;
+    }
+    if (!was_full || conn->out_len >= MUX_OUT_HIGH_WATER)
+    {
+      continue;
+    }
+    for (i = 0; i < MUX_MAX_STREAMS && conn->fd != -1; i++)
+    {
+      if (conn->streams[i] != NULL && conn->streams[i]->alt->buffered > 0)
+      {
+        forward(conn->streams[i]->alt, thread_index);
+      }
+    }
+  }
+}
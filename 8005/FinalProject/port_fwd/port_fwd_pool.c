@@ -0,0 +1,129 @@
+#define POOL_SLAB_LEN 128  // client-server pairs per slab
+
+// block of pairs allocated together, with its own list of free pairs
+struct ConnSlab {
+  struct ConnSlab *prev;  // links in the pool's list of slabs with free pairs
+  struct ConnSlab *next;
+  struct ConnPair *free_list;
+  int num_free;
+  struct ConnPair pairs[POOL_SLAB_LEN];
+} ConnSlab;
+
+// client-server pairs owned by one worker thread
+// only the owning worker allocates from and frees to its pool, so the pool needs no locking,
+// and each pool sits on its own cache line
+struct ConnPool {
+  struct ConnSlab *partial;  // slabs with at least one free pair
+  int num_slabs;
+  int num_live;              // pairs in use
+  struct ConnPair *closed;   // pairs closed in the current event loop iteration, linked by next_free
+} __attribute__((aligned(64))) ConnPool;
+
+static void linkSlab(struct ConnPool *pool, struct ConnSlab *slab)
+{
+  slab->prev = NULL;
+  slab->next = pool->partial;
+  if (pool->partial != NULL)
+  {
+    pool->partial->prev = slab;
+  }
+  pool->partial = slab;
+}
+
+static void unlinkSlab(struct ConnPool *pool, struct ConnSlab *slab)
+{
+  if (slab->prev != NULL)
+  {
+    slab->prev->next = slab->next;
+  }
+  else
+  {
+    pool->partial = slab->next;
+  }
+  if (slab->next != NULL)
+  {
+    slab->next->prev = slab->prev;
+  }
+}
+
+// take a pair from pool, adding a slab if every slab is in use
+// returns NULL if out of memory
+struct ConnPair* allocConnPair(struct ConnPool *pool)
+{
+  struct ConnSlab *slab = pool->partial;
+  struct ConnPair *pair;
+  int i;
+
+  if (slab == NULL)
+  {
+    if ((slab = malloc(sizeof(*slab))) == NULL)
+    {
+      perror("malloc");
+      return NULL;
+    }
+    addMemory(MEM_PAIRS, sizeof(*slab));
+    slab->free_list = NULL;
+    for (i = POOL_SLAB_LEN - 1; i >= 0; i--)
+    {
+      slab->pairs[i].slab = slab;
+      slab->pairs[i].next_free = slab->free_list;
+      slab->free_list = &slab->pairs[i];
+    }
+    slab->num_free = POOL_SLAB_LEN;
+    linkSlab(pool, slab);
+    pool->num_slabs++;
+  }
+
+  pair = slab->free_list;
+  slab->free_list = pair->next_free;
+  if (--slab->num_free == 0)
+  {
+    unlinkSlab(pool, slab);
+  }
+  pool->num_live++;
+  return pair;
+}
+
+// return a pair to pool
+// a slab with no pairs in use is released, unless it is the pool's only slab with free pairs,
+// so memory follows the number of live pairs without reallocating on every connection
+void freeConnPair(struct ConnPool *pool, struct ConnPair *pair)
+{
+  struct ConnSlab *slab = pair->slab;
+
+  pair->next_free = slab->free_list;
+  slab->free_list = pair;
+  pool->num_live--;
+
+  if (slab->num_free++ == 0)
+  {
+    linkSlab(pool, slab);
+  }
+  else if (slab->num_free == POOL_SLAB_LEN && (slab->prev != NULL || slab->next != NULL))
+  {
+    unlinkSlab(pool, slab);
+    addMemory(MEM_PAIRS, -(long long) sizeof(*slab));
+    free(slab);
+    pool->num_slabs--;
+  }
+}
+
+// hold a pair closed by the epoll engine until the worker has handled its whole batch of events
+// later events of the batch may still point into the pair, or into its slab, and must not find it reused or freed
+void retireConnPair(struct ConnPool *pool, struct ConnPair *pair)
+{
+  pair->next_free = pool->closed;
+  pool->closed = pair;
+}
+
+// return the pairs held by retireConnPair to pool, once no event of the batch is left
+void freeClosedPairs(struct ConnPool *pool)
+{
+  struct ConnPair *pair;
+
+  while ((pair = pool->closed) != NULL)
+  {
+    pool->closed = pair->next_free;
+    freeConnPair(pool, pair);
+  }
+}
@@ -0,0 +1,173 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#define HANDOFF_QUEUE_LEN 1024  // new clients waiting in one worker's queue before more are rejected
+
+// an accepted client handed from the accept thread to a worker thread, which connects it to a server,
+// or a connected client-server pair moved from an overloaded worker thread, which takes it over
+struct Handoff {
+  _Atomic(struct Handoff*) next;
+  int clnt_fd;
+  struct sockaddr_in client;
+  struct PortForward *route;
+  struct ConnPair *pair;   // copy of a migrated pair's state, NULL for a new client
+  struct timespec queued;  // when the pair was pushed, to measure wake-up latency
+} Handoff;
+
+// lock-free multi-producer/single-consumer queue of handoffs for one worker thread
+// producers push onto head, the owning worker pops from tail, stub keeps the list non-empty
+// event_fd is registered in the worker's epoll set and signalled after every push
+struct HandoffQueue {
+  int tag;  // TAG_HANDOFF_QUEUE
+  _Atomic(struct Handoff*) head;
+  char pad[64 - sizeof(struct Handoff*)];  // keep producers off the consumer's cache line
+  struct Handoff *tail;
+  struct Handoff stub;
+  int event_fd;
+  _Atomic int pending;       // handoffs pushed and not yet popped
+  long long num_handoffs;    // handoffs received by the worker
+  long long wake_usec;       // total usec between push and pop
+  long long max_wake_usec;
+} HandoffQueue;
+
+// initialize an empty queue and its eventfd
+// returns 0 if successful, -1 if the eventfd could not be created
+int initHandoffQueue(struct HandoffQueue *queue)
+{
+  queue->tag = TAG_HANDOFF_QUEUE;
+  atomic_store(&queue->stub.next, NULL);
+  atomic_store(&queue->head, &queue->stub);
+  queue->tail = &queue->stub;
+  atomic_store(&queue->pending, 0);
+  queue->num_handoffs = queue->wake_usec = queue->max_wake_usec = 0;
+
+  if ((queue->event_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+  {
+    perror("eventfd");
+    return -1;
+  }
+  return 0;
+}
+
+static void pushHandoffNode(struct HandoffQueue *queue, struct Handoff *node)
+{
+  struct Handoff *prev;
+
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+static void signalHandoff(struct HandoffQueue *queue)
+{
+  uint64_t signal = 1;
+
+  if (write(queue->event_fd, &signal, sizeof(signal)) == -1 && errno != EAGAIN)
+  {
+    perror("eventfd write");
+  }
+}
+
+// hand an accepted client to the queue's worker and wake it
+// safe to call from any thread, returns 0 if successful, -1 if the queue is full or the client could not be queued
+int pushHandoff(struct HandoffQueue *queue, int clnt_fd, struct sockaddr_in *client, struct PortForward *route)
+{
+  struct Handoff *node;
+
+  // a worker that is this far behind would only connect the client once it has given up
+  if (atomic_load_explicit(&queue->pending, memory_order_relaxed) >= HANDOFF_QUEUE_LEN)
+  {
+    return -1;
+  }
+
+  if ((node = malloc(sizeof(*node))) == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+  node->clnt_fd = clnt_fd;
+  node->client = *client;
+  node->route = route;
+  node->pair = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &node->queued);
+
+  atomic_fetch_add_explicit(&queue->pending, 1, memory_order_relaxed);
+  pushHandoffNode(queue, node);
+  signalHandoff(queue);
+  return 0;
+}
+
+// hand a pair migrated off another worker to the queue's worker and wake it
+// node->pair holds the pair's state, the caller allocates and fills node up front so the push cannot fail
+void pushMigration(struct HandoffQueue *queue, struct Handoff *node)
+{
+  clock_gettime(CLOCK_MONOTONIC, &node->queued);
+
+  atomic_fetch_add_explicit(&queue->pending, 1, memory_order_relaxed);
+  pushHandoffNode(queue, node);
+  signalHandoff(queue);
+}
+
+// pop the oldest handoff, only called by the queue's worker thread
+// returns NULL if the queue is empty, or a producer is part way through a push
+// (that producer signals event_fd again once its push completes)
+// the caller frees the returned node
+struct Handoff* popHandoff(struct HandoffQueue *queue)
+{
+  struct Handoff *tail = queue->tail;
+  struct Handoff *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  struct timespec now;
+  long long usec;
+
+  if (tail == &queue->stub)
+  {
+    if (next == NULL)
+    {
+      return NULL;
+    }
+    queue->tail = tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+
+  if (next == NULL)
+  {
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+      return NULL;
+    }
+
+    // tail is the last node, put the stub behind it so tail can be handed out
+    pushHandoffNode(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL)
+    {
+      return NULL;
+    }
+  }
+  queue->tail = next;
+  atomic_fetch_sub_explicit(&queue->pending, 1, memory_order_relaxed);
+
+  // wake-up latency from push to pop
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  usec = (now.tv_sec - tail->queued.tv_sec) * 1000000LL + (now.tv_nsec - tail->queued.tv_nsec) / 1000;
+  queue->num_handoffs++;
+  queue->wake_usec += usec;
+  if (usec > queue->max_wake_usec)
+  {
+    queue->max_wake_usec = usec;
+  }
+  return tail;
+}
+
+// reset the queue's eventfd before draining it, so a push during the drain wakes the worker again
+void clearHandoffSignal(struct HandoffQueue *queue)
+{
+  uint64_t count;
+
+  if (read(queue->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+  {
+    perror("eventfd read");
+  }
+}
@@ -0,0 +1,84 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#define RCU_POLL_USEC 1000  // how often rcuSynchronize checks for threads to pass a quiescent state
+
+// quiescent-state tracking for one epoll thread
+// the thread bumps quiescent at the top of its event loop, where it holds no listener or route pointers
+// wake_fd sits in the thread's epoll set, so a thread blocked in epoll_wait can be made to pass that point
+struct RcuThread {
+  int tag;  // TAG_RCU_WAKE
+  int wake_fd;
+  int active;
+  _Atomic unsigned long quiescent;
+} __attribute__((aligned(64))) RcuThread;
+
+struct RcuThread rcu_thread[THREAD_COUNT + 1]; // index is thread_index
+
+// create the wake eventfd of each epoll thread, and mark whether the thread runs
+// returns 0 if successful, -1 if an eventfd could not be created
+int initRcu(int accept_thread)
+{
+  int i;
+
+  for (i = 0; i <= THREAD_COUNT; i++)
+  {
+    rcu_thread[i].tag = TAG_RCU_WAKE;
+    rcu_thread[i].active = (i < THREAD_COUNT) || accept_thread;
+    atomic_init(&rcu_thread[i].quiescent, 0);
+    if ((rcu_thread[i].wake_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+    {
+      perror("eventfd");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// called by an epoll thread at the top of its event loop
+void rcuQuiescent(int thread_index)
+{
+  atomic_fetch_add_explicit(&rcu_thread[thread_index].quiescent, 1, memory_order_seq_cst);
+}
+
+// reset a thread's wake eventfd after it was woken
+void clearRcuWake(int thread_index)
+{
+  uint64_t count;
+
+  if (read(rcu_thread[thread_index].wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+  {
+    perror("eventfd read");
+  }
+}
+
+// wait until every epoll thread has passed a quiescent state
+// anything unpublished before the call can no longer be in use by an event loop once it returns
+void rcuSynchronize()
+{
+  unsigned long seen[THREAD_COUNT + 1];
+  uint64_t signal = 1;
+  int i;
+
+  for (i = 0; i <= THREAD_COUNT; i++)
+  {
+    if (!rcu_thread[i].active)
+    {
+      continue;
+    }
+    seen[i] = atomic_load_explicit(&rcu_thread[i].quiescent, memory_order_seq_cst);
+    if (write(rcu_thread[i].wake_fd, &signal, sizeof(signal)) == -1 && errno != EAGAIN)
+    {
+      perror("eventfd write");
+    }
+  }
+
+  for (i = 0; i <= THREAD_COUNT; i++)
+  {
+    while (rcu_thread[i].active && atomic_load_explicit(&rcu_thread[i].quiescent, memory_order_seq_cst) == seen[i])
+    {
+      usleep(RCU_POLL_USEC);
+    }
+  }
+}
@@ -1,111 +1,813 @@
 #include <stdio.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/un.h>
 
 #define PORT_FWD_TABLE "port_fwd_table.config"
-#define MAX_PORT_CHAR 5
-#define MAX_ADDR_CHAR 300
-#define MAX_CONFIG_NUM 100
+#define MAX_PORT_RANGE_CHAR 11  // {first}-{last}
+#define MAX_LINE_CHAR 1000
+#define MAX_PORT 65535
 
+// every object registered with epoll is passed as data.ptr and starts with one of these tags,
+// so an event is classified by a single load no matter how many ports are forwarded
+#define TAG_LISTENER 1
+#define TAG_HANDOFF_QUEUE 2
+#define TAG_END_POINT 3
+#define TAG_RCU_WAKE 4
+#define TAG_MUX_CONN 5
+#define TAG_MIRROR 6
+
+// relay modes - how bytes are moved between client and server
+#define RELAY_COPY 0    // recv() into a user-space buffer, send() back out
+#define RELAY_SPLICE 1  // splice() through a kernel pipe, payload never enters user space
+
+// balancing policies - how a client is assigned to one of a port's servers
+#define BALANCE_ROUND_ROBIN 0  // each server in turn
+#define BALANCE_LEAST_CONN 1   // server with the fewest active client pairs
+#define BALANCE_HASH 2         // consistent hash of the client IP, so a client keeps its server
+
+#define MAX_WEIGHT 100  // largest share of a worker's relay turns one pair may be given
+#define MAX_MUX_CONNS 16  // most backend connections per worker thread to each server a mux rule may use
+
+#define HEALTH_RISE 2   // default checks a server must pass in a row to be put back in rotation
+#define HEALTH_FALL 3   // default checks or connects a server must fail in a row to be taken out
+#define MAX_CHECK_TEXT 256  // longest check_send or check_expect text
+
+// destination server in a port's pool
+struct Backend {
+  char* svr_addr;             // host name or IP address, or the path of a unix server
+  int svr_port;               // 0 for a unix server
+  char *svr_name;             // {svr_addr}:{svr_port}, or unix:{path}, for messages and metrics
+  int svr_addr_numeric;       // svr_addr is an IP address or a path, so it never needs to be re-resolved
+  int svr_unix;               // svr_addr is the path of a unix stream socket on this host
+  struct sockaddr_un svr_un;  // address of a unix server, connected to as it is
+  _Atomic in_addr_t svr_ip;   // cached resolution of svr_addr (network order), 0 if unresolved
+  _Atomic int active_conns;   // client pairs currently relayed to this server
+  _Atomic int healthy;        // in rotation, 0 once failed checks or connects took it out
+  _Atomic int failures;       // checks and connects failed in a row
+  _Atomic long long retry_nsec;  // CLOCK_MONOTONIC time a server taken out by failed connects is tried again, without checks
+  int successes;              // checks passed in a row, only used by the health checker
+  long long next_check_nsec;  // CLOCK_MONOTONIC time of the next check, only used by the health checker
+} Backend;
+
+// token bucket refilled with rate tokens per second and holding up to a burst of tokens, kept as the time
+// it will be full again (the generic cell rate algorithm), so any thread takes tokens with one compare-and-swap
+struct TokenBucket {
+  _Atomic long long full_nsec;  // CLOCK_MONOTONIC time at which the bucket is full again
+  long long rate;               // tokens per second, 0 if unlimited
+  long long burst_nsec;         // time to refill the whole bucket
+} TokenBucket;
+
+// point on a port's consistent hash ring, owned by backends[backend]
+struct HashPoint {
+  uint32_t hash;
+  int backend;
+} HashPoint;
+
+// a forwarding rule - one line of the table, covering the ports rcv_port to last_rcv_port
 struct PortForward {
-  int fd;
+  struct RouteTable *table;  // table the rule belongs to
   int rcv_port;
-  int svr_port;
-  char* svr_addr;
+  int last_rcv_port;
+  int num_ports;  // ports in the range that this rule forwards, earlier rules win overlaps
+  int relay_mode;
+  int balance;
+  int idle_timeout;  // seconds a client-server pair may go without relaying before it is closed, 0 for never
+  int max_conns;     // client-server pairs the rule may relay at once, 0 for no limit
+  int accept_rate;   // clients the rule accepts per second, 0 for no limit
+  _Atomic int num_conns;              // clients admitted and not yet closed
+  struct TokenBucket accept_bucket;   // tokens for accept_rate
+  long long bandwidth;         // bytes per second the rule's pairs may relay together in each direction, 0 for no limit
+  long long client_bandwidth;  // bytes per second each pair may relay in each direction, 0 for no limit
+  int weight;                  // relay turns of the rule's pairs are weight times as long as those of weight 1
+  int mux;                     // backend connections per worker to each server carrying the rule's clients as streams, 0 for one per client
+  struct TokenBucket bandwidth_bucket[2];  // tokens for bandwidth, index is the reading end's is_client
+  int check_interval;   // seconds between health checks of each server, 0 for passive checks alone
+  char *check_send;     // bytes a check sends once connected, NULL to only connect
+  int check_send_len;
+  char *check_expect;   // bytes a check must receive to pass, NULL to pass once connected and sent
+  int check_expect_len;
+  int rise;             // checks a server must pass in a row to be put back in rotation
+  int fall;             // checks or connects a server must fail in a row to be taken out
+  int num_backends;
+  struct Backend *backends;
+  struct Backend *mirror;             // server sent a copy of what clients send, its replies discarded, NULL for none
+  _Atomic unsigned int next_backend;  // round-robin position
+  int num_hash_points;
+  struct HashPoint *hash_ring;        // sorted by hash, NULL unless balance is BALANCE_HASH
+  struct RelayStats *stats;           // per-worker counters for the rule's connections
 } PortForward;
 
-int num_port_fwd = 0;
-struct PortForward *port_config;
+// forwarded port and the rule that forwards it
+struct RoutePort {
+  int port;
+  struct PortForward *route;
+} RoutePort;
+
+// every rule read from one version of PORT_FWD_TABLE
+// a table is freed once nothing refers to it - the current table reference held by the reloader,
+// clients accepted on its ports and waiting to be connected, and client-server pairs relayed to its servers
+struct RouteTable {
+  int num_routes;
+  struct PortForward *routes;
+  int num_ports;
+  struct RoutePort *ports;  // every forwarded port, in table order
+  _Atomic int refs;
+} RouteTable;
+
+int buildHashRing(struct PortForward*);
+int initRouteStats(struct PortForward*);
+void initTokenBucket(struct TokenBucket*, long long, long long);
+long long bandwidthBurst(long long);
+void freeRouteTable(struct RouteTable*);
+
+// resolve backend->svr_addr and publish the result in backend->svr_ip for the connect path
+// the previous address is kept if the lookup fails
+// returns 1 if the address changed, 0 if unchanged, -1 if the lookup failed
+int resolveBackend(struct Backend *backend)
+{
+  struct addrinfo hints, *res;
+  in_addr_t addr;
+  int err;
+
+  if (backend->svr_unix)
+  {
+    return 0;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((err = getaddrinfo(backend->svr_addr, NULL, &hints, &res)) != 0 || res == NULL)
+  {
+    printf("Warning: Can't resolve server %s: %s\n", backend->svr_addr, gai_strerror(err));
+    return -1;
+  }
+  addr = ((struct sockaddr_in*) res->ai_addr)->sin_addr.s_addr;
+  freeaddrinfo(res);
+
+  if (atomic_exchange(&backend->svr_ip, addr) == addr)
+  {
+    return 0;
+  }
+  return 1;
+}
+
+// parse one {svr_addr}|{svr_port} or unix:{path} server of route into backend
+// returns 0 if successful, -1 if the server is invalid
+int parseServer(char *token, struct Backend *backend, struct PortForward *route)
+{
+  char *port = NULL;
+  struct in_addr numeric;
+  size_t name_len;
+
+  backend->svr_unix = (strncmp(token, "unix:", 5) == 0);
+  if (backend->svr_unix)
+  {
+    token += 5;
+    if (*token == '\0' || strlen(token) >= sizeof(backend->svr_un.sun_path))
+    {
+      printf("Warning: Port %i has an invalid unix server '%s'\n", route->rcv_port, token);
+      return -1;
+    }
+  }
+  else if ((port = strchr(token, '|')) == NULL || port == token || *(port + 1) == '\0')
+  {
+    printf("Warning: Port %i has an invalid server '%s'\n", route->rcv_port, token);
+    return -1;
+  }
+  else
+  {
+    *port++ = '\0';
+  }
+
+  name_len = strlen(token) + MAX_PORT_RANGE_CHAR;
+  if ((backend->svr_addr = strdup(token)) == NULL || (backend->svr_name = malloc(name_len)) == NULL)
+  {
+    printf("Backend strdup error\n");
+    return -1;
+  }
+  if (backend->svr_unix)
+  {
+    backend->svr_port = 0;
+    backend->svr_addr_numeric = 1;
+    memset(&backend->svr_un, 0, sizeof(backend->svr_un));
+    backend->svr_un.sun_family = AF_UNIX;
+    strcpy(backend->svr_un.sun_path, backend->svr_addr);
+    snprintf(backend->svr_name, name_len, "unix:%s", backend->svr_addr);
+  }
+  else
+  {
+    backend->svr_port = atoi(port);
+    backend->svr_addr_numeric = inet_pton(AF_INET, backend->svr_addr, &numeric) == 1;
+    snprintf(backend->svr_name, name_len, "%s:%i", backend->svr_addr, backend->svr_port);
+  }
+  atomic_init(&backend->svr_ip, 0);
+  atomic_init(&backend->active_conns, 0);
+  atomic_init(&backend->healthy, 1);
+  atomic_init(&backend->failures, 0);
+  atomic_init(&backend->retry_nsec, 0);
+  backend->successes = 0;
+  backend->next_check_nsec = 0;
+  return 0;
+}
+
+// address to connect to backend at - the cached resolution of a TCP server, filled in to inet, or the unix server's path
+// inet is left zeroed for a unix server
+// *addr is pointed at the address, which stays valid while backend's table does
+// returns the address length, or 0 if the server is unresolved
+socklen_t backendAddress(struct Backend *backend, struct sockaddr_in *inet, struct sockaddr **addr)
+{
+  memset(inet, 0, sizeof(*inet));
+  if (backend->svr_unix)
+  {
+    *addr = (struct sockaddr*) &backend->svr_un;
+    return sizeof(backend->svr_un);
+  }
+
+  inet->sin_family = AF_INET;
+  inet->sin_port = htons(backend->svr_port);
+  // use the cached address, the resolver thread keeps it up to date
+  if ((inet->sin_addr.s_addr = atomic_load_explicit(&backend->svr_ip, memory_order_relaxed)) == 0)
+  {
+    return 0;
+  }
+  *addr = (struct sockaddr*) inet;
+  return sizeof(*inet);
+}
 
-// returns 1 if a rcv_port match is found within first count indices of port_config
-// returns 0 if not
-int checkRcvPortExists(int rcv_port, int count)
+// parse a comma-separated list of {svr_addr}|{svr_port} or unix:{path} servers into route->backends
+// returns 0 if successful, -1 if the list is invalid
+int parseBackends(char *list, struct PortForward *route)
+{
+  char *token, *save_ptr;
+  int count = 1;
+
+  for (token = list; (token = strchr(token, ',')) != NULL; token++)
+  {
+    count++;
+  }
+
+  if ((route->backends = calloc(count, sizeof(struct Backend))) == NULL)
+  {
+    printf("Backend calloc error\n");
+    return -1;
+  }
+  route->num_backends = 0;
+
+  for (token = strtok_r(list, ",", &save_ptr); token != NULL; token = strtok_r(NULL, ",", &save_ptr))
+  {
+    if (parseServer(token, &route->backends[route->num_backends], route) == -1)
+    {
+      return -1;
+    }
+    route->num_backends++;
+  }
+
+  if (route->num_backends == 0)
+  {
+    printf("Warning: Port %i has no servers\n", route->rcv_port);
+    return -1;
+  }
+  return 0;
+}
+
+// parse a bytes per second rate, optionally followed by k, m or g for thousands, millions or billions
+// returns 0 if successful, -1 if the rate is invalid
+int parseByteRate(char *value, long long *rate)
+{
+  char *endptr;
+  long long scale = 1;
+
+  errno = 0;
+  *rate = strtoll(value, &endptr, 10);
+  if (*endptr == 'k' || *endptr == 'K')
+  {
+    scale = 1000LL;
+  }
+  else if (*endptr == 'm' || *endptr == 'M')
+  {
+    scale = 1000000LL;
+  }
+  else if (*endptr == 'g' || *endptr == 'G')
+  {
+    scale = 1000000000LL;
+  }
+  if (scale > 1)
+  {
+    endptr++;
+  }
+  if (errno != 0 || endptr == value || *endptr != '\0' || *rate < 0 || *rate > LLONG_MAX / scale)
+  {
+    return -1;
+  }
+  *rate *= scale;
+  return 0;
+}
+
+// parse the text of a check_send or check_expect option into a new buffer
+// the text has no whitespace, so \n, \r, \t, \s (space), \\ and \xHH stand for the bytes that need escaping
+// returns 0 if successful, -1 if the text is invalid
+int parseCheckText(char *value, char **text, int *len)
+{
+  char *out, hex[3];
+  int n = 0;
+
+  if (*value == '\0' || strlen(value) > MAX_CHECK_TEXT || (out = malloc(strlen(value))) == NULL)
+  {
+    return -1;
+  }
+  while (*value != '\0')
+  {
+    if (*value != '\\')
+    {
+      out[n++] = *value++;
+      continue;
+    }
+    switch (*++value)
+    {
+      case 'n': out[n++] = '\n'; break;
+      case 'r': out[n++] = '\r'; break;
+      case 't': out[n++] = '\t'; break;
+      case 's': out[n++] = ' '; break;
+      case '\\': out[n++] = '\\'; break;
+      case 'x':
+        if (!isxdigit((unsigned char) value[1]) || !isxdigit((unsigned char) value[2]))
+        {
+          free(out);
+          return -1;
+        }
+        hex[0] = value[1];
+        hex[1] = value[2];
+        hex[2] = '\0';
+        out[n++] = strtol(hex, NULL, 16);
+        value += 2;
+        break;
+      default:
+        free(out);
+        return -1;
+    }
+    value++;
+  }
+  free(*text);
+  *text = out;
+  *len = n;
+  return 0;
+}
+
+// parse the optional whitespace-separated key=value options following a port-forward entry
+// returns 0 if all options are valid, -1 if not
+int parseRouteOptions(char *options, struct PortForward *route)
+{
+  char *token, *value, *save_ptr, *endptr;
+  long seconds, limit;
+  long long rate;
+
+  for (token = strtok_r(options, " \t\r\n", &save_ptr); token != NULL; token = strtok_r(NULL, " \t\r\n", &save_ptr))
+  {
+    if ((value = strchr(token, '=')) == NULL)
+    {
+      printf("Warning: Port %i option '%s' is missing a value\n", route->rcv_port, token);
+      return -1;
+    }
+    *value++ = '\0';
+
+    if (strcmp(token, "relay") == 0)
+    {
+      if (strcmp(value, "copy") == 0)
+      {
+        route->relay_mode = RELAY_COPY;
+      }
+      else if (strcmp(value, "splice") == 0)
+      {
+        route->relay_mode = RELAY_SPLICE;
+      }
+      else
+      {
+        printf("Warning: Port %i has an unknown relay mode '%s'\n", route->rcv_port, value);
+        return -1;
+      }
+    }
+    else if (strcmp(token, "balance") == 0)
+    {
+      if (strcmp(value, "roundrobin") == 0)
+      {
+        route->balance = BALANCE_ROUND_ROBIN;
+      }
+      else if (strcmp(value, "leastconn") == 0)
+      {
+        route->balance = BALANCE_LEAST_CONN;
+      }
+      else if (strcmp(value, "hash") == 0)
+      {
+        route->balance = BALANCE_HASH;
+      }
+      else
+      {
+        printf("Warning: Port %i has an unknown balancing policy '%s'\n", route->rcv_port, value);
+        return -1;
+      }
+    }
+    else if (strcmp(token, "idle") == 0)
+    {
+      errno = 0;
+      seconds = strtol(value, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || seconds < 0 || seconds > INT_MAX / 1000)
+      {
+        printf("Warning: Port %i has an invalid idle timeout '%s'\n", route->rcv_port, value);
+        return -1;
+      }
+      route->idle_timeout = seconds;
+    }
+    else if (strcmp(token, "max_conns") == 0 || strcmp(token, "rate") == 0)
+    {
+      errno = 0;
+      limit = strtol(value, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || limit < 0 || limit > INT_MAX)
+      {
+        printf("Warning: Port %i has an invalid %s limit '%s'\n", route->rcv_port, token, value);
+        return -1;
+      }
+      if (strcmp(token, "max_conns") == 0)
+      {
+        route->max_conns = limit;
+      }
+      else
+      {
+        route->accept_rate = limit;
+      }
+    }
+    else if (strcmp(token, "bandwidth") == 0 || strcmp(token, "client_bandwidth") == 0)
+    {
+      if (parseByteRate(value, &rate) == -1)
+      {
+        printf("Warning: Port %i has an invalid %s '%s'\n", route->rcv_port, token, value);
+        return -1;
+      }
+      if (strcmp(token, "bandwidth") == 0)
+      {
+        route->bandwidth = rate;
+      }
+      else
+      {
+        route->client_bandwidth = rate;
+      }
+    }
+    else if (strcmp(token, "check") == 0)
+    {
+      errno = 0;
+      seconds = strtol(value, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || seconds < 0 || seconds > INT_MAX / 1000)
+      {
+        printf("Warning: Port %i has an invalid check interval '%s'\n", route->rcv_port, value);
+        return -1;
+      }
+      route->check_interval = seconds;
+    }
+    else if (strcmp(token, "check_send") == 0 || strcmp(token, "check_expect") == 0)
+    {
+      if ((strcmp(token, "check_send") == 0 && parseCheckText(value, &route->check_send, &route->check_send_len) == -1) ||
+          (strcmp(token, "check_expect") == 0 && parseCheckText(value, &route->check_expect, &route->check_expect_len) == -1))
+      {
+        printf("Warning: Port %i has an invalid %s text '%s'\n", route->rcv_port, token, value);
+        return -1;
+      }
+    }
+    else if (strcmp(token, "rise") == 0 || strcmp(token, "fall") == 0)
+    {
+      errno = 0;
+      limit = strtol(value, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || limit < 1 || limit > 100)
+      {
+        printf("Warning: Port %i has an invalid %s count '%s'\n", route->rcv_port, token, value);
+        return -1;
+      }
+      if (strcmp(token, "rise") == 0)
+      {
+        route->rise = limit;
+      }
+      else
+      {
+        route->fall = limit;
+      }
+    }
+    else if (strcmp(token, "weight") == 0)
+    {
+      errno = 0;
+      limit = strtol(value, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || limit < 1 || limit > MAX_WEIGHT)
+      {
+        printf("Warning: Port %i has an invalid weight '%s'\n", route->rcv_port, value);
+        return -1;
+      }
+      route->weight = limit;
+    }
+    else if (strcmp(token, "mux") == 0)
+    {
+      errno = 0;
+      limit = strtol(value, &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || limit < 0 || limit > MAX_MUX_CONNS)
+      {
+        printf("Warning: Port %i has an invalid mux connection count '%s'\n", route->rcv_port, value);
+        return -1;
+      }
+      route->mux = limit;
+    }
+    else if (strcmp(token, "mirror") == 0)
+    {
+      if (route->mirror != NULL)
+      {
+        printf("Warning: Port %i has more than one mirror\n", route->rcv_port);
+        return -1;
+      }
+      if ((route->mirror = calloc(1, sizeof(struct Backend))) == NULL)
+      {
+        printf("Backend calloc error\n");
+        return -1;
+      }
+      if (parseServer(value, route->mirror, route) == -1)
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      printf("Warning: Port %i has an unknown option '%s'\n", route->rcv_port, token);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// check options that can't be combined with each other, with route's servers or with the engine
+// only the epoll engine multiplexes streams, a mirror is teed from the pipe client data is spliced through, which streams of a mux rule never use,
+// and mux connections are kept per TCP server address
+// returns 0 if route can be used, -1 if not
+int checkRoute(struct PortForward *route)
 {
   int i;
-  for (i = 0; i < count; i++)
+
+  if (route->mux > 0 && engine != ENGINE_EPOLL)
+  {
+    printf("Warning: Port %i can't mux with the io_uring engine\n", route->rcv_port);
+    return -1;
+  }
+  if (route->mirror != NULL && route->mux > 0)
+  {
+    printf("Warning: Port %i can't mirror a mux rule\n", route->rcv_port);
+    return -1;
+  }
+  for (i = 0; i < route->num_backends && route->mux > 0; i++)
   {
-    if (port_config[i].rcv_port == rcv_port)
+    if (route->backends[i].svr_unix)
     {
-      return 1;
+      printf("Warning: Port %i can't mux to unix server %s\n", route->rcv_port, route->backends[i].svr_addr);
+      return -1;
     }
   }
   return 0;
 }
 
-// read PORT_FWD_TABLE and store in PortForward port_config
-// returns number of port configurations or -1 if error
-int readPortFwdTable()
+// parse {port} or {first}-{last} into first and last
+// returns 0 if successful, -1 if the range is invalid
+int parsePortRange(char *ports, int *first, int *last)
+{
+  char *end;
+
+  *first = *last = strtol(ports, &end, 10);
+  if (*end == '-')
+  {
+    *last = strtol(end + 1, &end, 10);
+  }
+  if (*end != '\0' || *first < 1 || *last > MAX_PORT || *first > *last)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// grow an array of count elements of size bytes so it can hold one more, doubling its capacity
+// returns 0 if successful, -1 if out of memory
+int growArray(void **array, int count, int *capacity, size_t size)
+{
+  void *tmp;
+
+  if (count < *capacity)
+  {
+    return 0;
+  }
+  *capacity = (*capacity == 0) ? 16 : *capacity * 2;
+  if ((tmp = realloc(*array, size * *capacity)) == NULL)
+  {
+    return -1;
+  }
+  *array = tmp;
+  return 0;
+}
+
+// read PORT_FWD_TABLE into a new route table holding one reference
+// returns the table, or NULL if the file could not be read or has an invalid rule
+struct RouteTable* readPortFwdTable()
 {
-  char rcv_port[MAX_CONFIG_NUM][MAX_PORT_CHAR];
-  char svr_port[MAX_CONFIG_NUM][MAX_PORT_CHAR];
-  char svr_addr[MAX_CONFIG_NUM][MAX_ADDR_CHAR];
+  char read[MAX_LINE_CHAR], rcv_ports[MAX_PORT_RANGE_CHAR + 1], svr_list[MAX_LINE_CHAR], options[MAX_LINE_CHAR];
+  int i, j, first, last, line = 1, num_new, failed = 0, route_capacity = 0, port_capacity = 0;
+  char *port_taken;  // ports claimed by an earlier line, indexed by port
+  struct RouteTable *table;
+  struct PortForward *route;
 
   FILE *file;
   if ((file = fopen(PORT_FWD_TABLE, "r")) == NULL)
   {
     printf("Can't open port forward table: %s\n", PORT_FWD_TABLE);
-    return -1;
+    return NULL;
   }
 
+  if ((table = calloc(1, sizeof(struct RouteTable))) == NULL || (port_taken = calloc(MAX_PORT + 1, sizeof(char))) == NULL)
+  {
+    printf("Port table calloc error\n");
+    free(table);
+    fclose(file);
+    return NULL;
+  }
+  atomic_init(&table->refs, 1);
+
   // pull first line of file to ignore
-  char read[1000];
-  fgets(read, 1000, file);
+  fgets(read, MAX_LINE_CHAR, file);
 
-  while (fscanf(file, "%[^=]%*c%[^|]%*c%s\n", rcv_port[num_port_fwd], svr_addr[num_port_fwd], svr_port[num_port_fwd]) != EOF && num_port_fwd != 100)
+  // each line is {rcv_port}[-{last_rcv_port}]={server}[,{server}...] followed by optional key=value options,
+  // where each server is {svr_addr}|{svr_port} or unix:{path}
+  while (!failed && fgets(read, MAX_LINE_CHAR, file) != NULL)
   {
-    if (strlen(rcv_port[num_port_fwd]) == 0 || strlen(svr_addr[num_port_fwd]) == 0 || strlen(svr_port[num_port_fwd]) == 0)
+    line++;
+
+    // skip blank lines
+    if (strspn(read, " \t\r\n") == strlen(read))
     {
-      printf("Warning: Line %i has an invalid port-forward configuration\n", num_port_fwd + 2);
+      continue;
+    }
+
+    options[0] = '\0';
+    if (sscanf(read, "%11[^=]=%999s %999[^\n]", rcv_ports, svr_list, options) < 2 || parsePortRange(rcv_ports, &first, &last) == -1)
+    {
+      printf("Warning: Line %i has an invalid port-forward configuration\n", line);
+      failed = 1;
+      break;
+    }
+
+    // only forward ports that no earlier line has claimed
+    num_new = 0;
+    for (i = first; i <= last; i++)
+    {
+      num_new += !port_taken[i];
+    }
+    if (num_new == 0)
+    {
+      printf("Warning: Line %i only has ports that are already forwarded\n", line);
+      continue;
+    }
+
+    if (growArray((void**) &table->routes, table->num_routes, &route_capacity, sizeof(struct PortForward)) == -1)
+    {
+      printf("PortForward realloc error\n");
+      failed = 1;
       break;
     }
-    
-    num_port_fwd++;
+    route = &table->routes[table->num_routes++];
+    route->rcv_port = first;
+    route->last_rcv_port = last;
+    route->num_ports = num_new;
+    route->relay_mode = RELAY_COPY;
+    route->balance = BALANCE_ROUND_ROBIN;
+    route->idle_timeout = 0;
+    route->max_conns = 0;
+    route->accept_rate = 0;
+    route->bandwidth = 0;
+    route->client_bandwidth = 0;
+    route->weight = 1;
+    route->mux = 0;
+    route->check_interval = 0;
+    route->check_send = route->check_expect = NULL;
+    route->check_send_len = route->check_expect_len = 0;
+    route->rise = HEALTH_RISE;
+    route->fall = HEALTH_FALL;
+    atomic_init(&route->num_conns, 0);
+    route->num_backends = 0;
+    route->backends = NULL;
+    route->mirror = NULL;
+    atomic_init(&route->next_backend, 0);
+    route->num_hash_points = 0;
+    route->hash_ring = NULL;
+    route->stats = NULL;
+    if (parseBackends(svr_list, route) == -1 || parseRouteOptions(options, route) == -1 || checkRoute(route) == -1 ||
+        (route->balance == BALANCE_HASH && buildHashRing(route) == -1) || initRouteStats(route) == -1)
+    {
+      failed = 1;
+      break;
+    }
+    initTokenBucket(&route->accept_bucket, route->accept_rate, route->accept_rate);
+    initTokenBucket(&route->bandwidth_bucket[0], route->bandwidth, bandwidthBurst(route->bandwidth));
+    initTokenBucket(&route->bandwidth_bucket[1], route->bandwidth, bandwidthBurst(route->bandwidth));
+
+    for (i = first; i <= last && !failed; i++)
+    {
+      if (port_taken[i])
+      {
+        continue;
+      }
+      port_taken[i] = 1;
+
+      if (growArray((void**) &table->ports, table->num_ports, &port_capacity, sizeof(struct RoutePort)) == -1)
+      {
+        printf("RoutePort realloc error\n");
+        failed = 1;
+        break;
+      }
+      table->ports[table->num_ports].port = i;
+      table->ports[table->num_ports].route = NULL;
+      table->num_ports++;
+    }
   }
+  fclose(file);
+  free(port_taken);
 
-  if (num_port_fwd == 0)
+  if (failed)
   {
-    printf("No port forward configurations found\n");
-    return -1;
+    freeRouteTable(table);
+    return NULL;
   }
-  else if (num_port_fwd == 100)
+  else if (table->num_routes == 0)
   {
-    printf("Stopped adding port-forward configurations at 100 forwarded ports\n");
+    printf("No port forward configurations found\n");
+    freeRouteTable(table);
+    return NULL;
   }
 
-  // store config information at port_config
-  if ((port_config = malloc(sizeof(struct PortForward) * num_port_fwd)) == NULL)
+  // routes has stopped moving, point each rule and port at it
+  // a rule's ports were added together, so they are the next num_ports ports
+  for (i = 0, first = 0; i < table->num_routes; i++)
   {
-    printf("PortForward malloc error\n");
-    return -1;
+    table->routes[i].table = table;
+    for (j = 0; j < table->routes[i].num_ports; j++)
+    {
+      table->ports[first++].route = &table->routes[i];
+    }
   }
 
-  int i, insert_index = 0;
-  for (i = 0; i < num_port_fwd; i++)
+  // resolve every server address up front so connecting never waits on the resolver
+  for (i = 0; i < table->num_routes; i++)
   {
-    // only add unique rcv_port configurations to port_config
-    int tmp_rcv_port = atoi(rcv_port[i]);
-    if (checkRcvPortExists(tmp_rcv_port, insert_index) == 0)
+    for (j = 0; j < table->routes[i].num_backends; j++)
     {
-      port_config[insert_index].rcv_port = tmp_rcv_port;
-      port_config[insert_index].svr_port = atoi(svr_port[i]);
-      port_config[insert_index].svr_addr = svr_addr[i];
-      insert_index++;
+      resolveBackend(&table->routes[i].backends[j]);
+    }
+    if (table->routes[i].mirror != NULL)
+    {
+      resolveBackend(table->routes[i].mirror);
     }
   }
 
-  // realloc port_config if it allocated too much memory the first time
-  if (insert_index < num_port_fwd)
+  printf("Read %i ports with %i rules\n", table->num_ports, table->num_routes);
+  return table;
+}
+
+void freeRouteTable(struct RouteTable *table)
+{
+  int i, j;
+  for (i = 0; i < table->num_routes; i++)
   {
-    num_port_fwd = insert_index;
-    if ((port_config = realloc(port_config, sizeof(struct PortForward) * num_port_fwd)) == NULL)
+    for (j = 0; j < table->routes[i].num_backends; j++)
     {
-      printf("PortForward realloc error\n");
-      return -1;
+      free(table->routes[i].backends[j].svr_addr);
+      free(table->routes[i].backends[j].svr_name);
     }
+    free(table->routes[i].backends);
+    if (table->routes[i].mirror != NULL)
+    {
+      free(table->routes[i].mirror->svr_addr);
+      free(table->routes[i].mirror->svr_name);
+      free(table->routes[i].mirror);
+    }
+    free(table->routes[i].hash_ring);
+    free(table->routes[i].check_send);
+    free(table->routes[i].check_expect);
+    free(table->routes[i].stats);
   }
+  free(table->routes);
+  free(table->ports);
+  free(table);
+}
 
-  return num_port_fwd;
+void acquireRouteTable(struct RouteTable *table)
+{
+  atomic_fetch_add_explicit(&table->refs, 1, memory_order_relaxed);
 }
 
-void freePortFwdTable()
+// drop a reference to table, freeing it if it was the last
+void releaseRouteTable(struct RouteTable *table)
 {
-  free(port_config);
+  if (atomic_fetch_sub_explicit(&table->refs, 1, memory_order_acq_rel) == 1)
+  {
+    freeRouteTable(table);
+  }
 }
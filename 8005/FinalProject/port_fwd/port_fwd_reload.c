@@ -0,0 +1,182 @@
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#define RELOAD_EVENT_BUFLEN 4096  // inotify events read at once
+
+int reload_paused = 0;  // set while the listeners are handed to a new process, the table is then not reloaded
+
+// make a route table current - listeners of kept ports switch to the new rules, listeners are
+// opened for added ports and closed for removed ports
+// existing client-server pairs keep the table they were connected with until they close
+// called with table_lock held
+static void publishRouteTable(struct RouteTable *table)
+{
+  struct RouteTable *old = route_table;
+  struct Listener *listener, **removed = NULL;
+  int i, port, num_added = 0, num_removed = 0;
+  char *kept;  // ports forwarded by both tables, indexed by port
+
+  if ((kept = calloc(MAX_PORT + 1, sizeof(char))) == NULL || (removed = malloc(sizeof(struct Listener*) * (old->num_ports + 1))) == NULL)
+  {
+    printf("Reload calloc error, keeping the current port forward table\n");
+    free(kept);
+    releaseRouteTable(table);
+    return;
+  }
+  inheritHealth(table, old);
+
+  // publish the new rules - a listener's route pointer is swapped in a single store, so the
+  // accept path never locks and sees either the old rule or the new one
+  for (i = 0; i < table->num_ports; i++)
+  {
+    port = table->ports[i].port;
+    kept[port] = 1;
+    if ((listener = listener_by_port[port]) != NULL)
+    {
+      setListenerRoute(listener, table->ports[i].route);
+      continue;
+    }
+
+    if ((listener = openListener(port, table->ports[i].route)) == NULL)
+    {
+      printf("Warning: Can't listen on port %i, it is not forwarded\n", port);
+      continue;
+    }
+    if (updateListenerEpoll(listener, EPOLL_CTL_ADD) == -1)
+    {
+      closeListener(listener);
+      continue;
+    }
+    listener_by_port[port] = listener;
+    num_added++;
+  }
+
+  // stop accepting on ports the new table does not forward
+  for (i = 0; i < old->num_ports; i++)
+  {
+    port = old->ports[i].port;
+    if (kept[port] || (listener = listener_by_port[port]) == NULL)
+    {
+      continue;
+    }
+    updateListenerEpoll(listener, EPOLL_CTL_DEL);
+    listener_by_port[port] = NULL;
+    removed[num_removed++] = listener;
+  }
+  route_table = table;
+  free(kept);
+  atomic_fetch_add_explicit(&listener_generation, 1, memory_order_release);
+
+  // an event loop may still hold a removed listener or an old rule it loaded before the swap
+  // once every loop has passed a quiescent state, only references counted in the old table remain
+  rcuSynchronize();
+  for (i = 0; i < num_removed; i++)
+  {
+    closeListener(removed[i]);
+  }
+  free(removed);
+  releaseRouteTable(old);
+
+  printf("Reloaded port forward table: %i ports with %i rules (%i ports added, %i removed)\n", table->num_ports, table->num_routes, num_added, num_removed);
+}
+
+// read PORT_FWD_TABLE again and make it current, keeping the current table if the file is invalid
+void reloadPortFwdTable()
+{
+  struct RouteTable *table;
+
+  if ((table = readPortFwdTable()) == NULL)
+  {
+    printf("Warning: Keeping the current port forward table\n");
+    return;
+  }
+
+  pthread_mutex_lock(&table_lock);
+  if (reload_paused)
+  {
+    printf("Warning: Upgrading to a new process, keeping the current port forward table\n");
+    releaseRouteTable(table);
+  }
+  else
+  {
+    publishRouteTable(table);
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+
+// reload the port forward table on SIGHUP, or when PORT_FWD_TABLE is written or replaced
+// SIGHUP is blocked in every thread and received here through a signalfd
+void* reloadMethod(void* arg)
+{
+  struct pollfd fds[2];
+  struct signalfd_siginfo info;
+  struct inotify_event *event;
+  sigset_t mask;
+  char buffer[RELOAD_EVENT_BUFLEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char *ptr;
+  int n, changed;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+  if ((fds[0].fd = signalfd(-1, &mask, 0)) == -1)
+  {
+    perror("signalfd");
+    return 0;
+  }
+  fds[0].events = POLLIN;
+
+  // watch the directory, editors often replace the file instead of writing it
+  if ((fds[1].fd = inotify_init1(0)) == -1 || inotify_add_watch(fds[1].fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+  {
+    perror("inotify");
+    fds[1].fd = -1;
+  }
+  fds[1].events = POLLIN;
+
+  while (TRUE)
+  {
+    if (poll(fds, 2, -1) == -1)
+    {
+      if (errno != EINTR)
+      {
+        perror("poll");
+      }
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      if (read(fds[0].fd, &info, sizeof(info)) == sizeof(info))
+      {
+        printf("Received SIGHUP, reloading %s\n", PORT_FWD_TABLE);
+        reloadPortFwdTable();
+      }
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      if ((n = read(fds[1].fd, buffer, sizeof(buffer))) <= 0)
+      {
+        continue;
+      }
+
+      changed = 0;
+      for (ptr = buffer; ptr < buffer + n; ptr += sizeof(struct inotify_event) + event->len)
+      {
+        event = (struct inotify_event*) ptr;
+        if (event->len > 0 && strcmp(event->name, PORT_FWD_TABLE) == 0)
+        {
+          changed = 1;
+        }
+      }
+
+      if (changed)
+      {
+        printf("%s changed, reloading\n", PORT_FWD_TABLE);
+        reloadPortFwdTable();
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#define DNS_TTL 60  // Default seconds between re-resolving server addresses
+
+int dns_ttl = DNS_TTL;
+
+// re-resolve the address of every server and mirror in each port-forward pool each dns_ttl seconds
+// runs on its own thread so a slow lookup never holds up the connect path, and resolves without table_lock
+// so it never holds up reloads, reports or checks either - only the current route table is refreshed, kept
+// alive by a reference, and a reload resolves its new table itself
+void* resolverMethod(void* arg)
+{
+  int i, j;
+  struct RouteTable *table;
+  struct in_addr addr;
+  struct PortForward *route;
+  struct Backend *backend;
+
+  while (TRUE)
+  {
+    sleep(dns_ttl);
+
+    pthread_mutex_lock(&table_lock);
+    table = route_table;
+    acquireRouteTable(table);
+    pthread_mutex_unlock(&table_lock);
+
+    for (i = 0; i < table->num_routes; i++)
+    {
+      route = &table->routes[i];
+      // the mirror, if any, is resolved after the servers
+      for (j = 0; j <= route->num_backends; j++)
+      {
+        backend = (j < route->num_backends) ? &route->backends[j] : route->mirror;
+        if (backend == NULL || backend->svr_addr_numeric)
+        {
+          continue;
+        }
+
+        if (resolveBackend(backend) == 1)
+        {
+          addr.s_addr = atomic_load(&backend->svr_ip);
+          printf("Server %s for port %i now resolves to %s\n", backend->svr_addr, route->rcv_port, inet_ntoa(addr));
+        }
+      }
+    }
+    releaseRouteTable(table);
+  }
+  return 0;
+}
@@ -0,0 +1,233 @@
+#define RELAY_QUANTUM 16384  // bytes an end of a weight 1 pair may read in one relay turn
+#define SHAPE_MIN_READ 4096  // bytes a capped end waits to be allowed before it reads again
+
+// relay scheduling state of an end, epoll engine only
+#define TURN_IDLE 0      // relayed as its events arrive
+#define TURN_READY 1     // used up its turn and may have more to read, waits in the ready queue
+#define TURN_THROTTLED 2 // reached a bandwidth cap, waits until its caps allow SHAPE_MIN_READ bytes
+#define TURN_PAUSED 3    // needs a relay buffer while memory is short, waits MEM_PAUSE_MSEC in the throttled list
+
+// ends of one worker's pairs that had more to read than their turn or bandwidth caps allowed
+// edge-triggered epoll does not report them again, so the worker gives them their next turns itself
+struct RelaySched {
+  struct EndPointFd *ready_head;      // served in order, one round of turns per event loop iteration
+  struct EndPointFd *ready_tail;
+  struct EndPointFd *throttled_head;  // throttled and paused ends in no order, each may read again at its resume_nsec
+  struct EndPointFd *throttled_tail;
+  int num_ready;
+} RelaySched;
+
+struct RelaySched relay_sched[THREAD_COUNT]; // index is thread_index
+
+// returns the burst of a bandwidth cap of rate bytes per second - a tenth of a second's worth, and at least one turn
+long long bandwidthBurst(long long rate)
+{
+  return (rate / 10 > RELAY_QUANTUM) ? rate / 10 : RELAY_QUANTUM;
+}
+
+// returns the CLOCK_MONOTONIC time of the worker's current event loop iteration in nsec
+static long long schedNow(int thread_index)
+{
+  return timer_wheel[thread_index].now.tv_sec * 1000000000LL + timer_wheel[thread_index].now.tv_nsec;
+}
+
+static void linkEnd(struct EndPointFd **head, struct EndPointFd **tail, struct EndPointFd *ep)
+{
+  ep->sched_prev = *tail;
+  ep->sched_next = NULL;
+  if (*tail != NULL)
+  {
+    (*tail)->sched_next = ep;
+  }
+  else
+  {
+    *head = ep;
+  }
+  *tail = ep;
+}
+
+static void unlinkEnd(struct EndPointFd **head, struct EndPointFd **tail, struct EndPointFd *ep)
+{
+  if (ep->sched_prev != NULL)
+  {
+    ep->sched_prev->sched_next = ep->sched_next;
+  }
+  else
+  {
+    *head = ep->sched_next;
+  }
+  if (ep->sched_next != NULL)
+  {
+    ep->sched_next->sched_prev = ep->sched_prev;
+  }
+  else
+  {
+    *tail = ep->sched_prev;
+  }
+}
+
+// take ep out of the queue it waits in, counting the time a throttled end waited against its rule
+static void leaveQueue(int thread_index, struct EndPointFd *ep)
+{
+  struct RelaySched *sched = &relay_sched[thread_index];
+
+  if (ep->sched_state == TURN_READY)
+  {
+    unlinkEnd(&sched->ready_head, &sched->ready_tail, ep);
+    sched->num_ready--;
+  }
+  else if (ep->sched_state == TURN_THROTTLED)
+  {
+    unlinkEnd(&sched->throttled_head, &sched->throttled_tail, ep);
+    addStat(&ep->pair->route->stats[thread_index].throttle_usec, (schedNow(thread_index) - ep->throttled_nsec) / 1000);
+  }
+  else if (ep->sched_state == TURN_PAUSED)
+  {
+    unlinkEnd(&sched->throttled_head, &sched->throttled_tail, ep);
+  }
+  ep->sched_state = TURN_IDLE;
+}
+
+// returns the bytes recv may read in this turn - RELAY_QUANTUM for each unit of its rule's weight, or fewer if its
+// bandwidth caps allow fewer, and 0 while it waits in a queue so that an event for it does not jump the queue,
+// or while memory is too short to give it a relay buffer
+long long readBudget(struct EndPointFd *recv, int thread_index)
+{
+  struct PortForward *route = recv->pair->route;
+  long long budget, allowed, now_nsec = schedNow(thread_index);
+
+  if (recv->sched_state != TURN_IDLE || readPaused(recv))
+  {
+    return 0;
+  }
+  budget = (long long) route->weight * RELAY_QUANTUM;
+  if ((allowed = availableTokens(&route->bandwidth_bucket[recv->is_client], now_nsec)) < budget)
+  {
+    budget = allowed;
+  }
+  if ((allowed = availableTokens(&recv->client_bucket, now_nsec)) < budget)
+  {
+    budget = allowed;
+  }
+  return budget;
+}
+
+// charge recv's bandwidth caps with the bytes it read in its turn
+// if it used up its budget and may have more to read, queue it for its next turn, or until its caps allow it to read,
+// or for MEM_PAUSE_MSEC if it may not read for want of memory
+void endTurn(struct EndPointFd *recv, int thread_index, long long bytes_read, int more)
+{
+  struct RelaySched *sched = &relay_sched[thread_index];
+  struct PortForward *route = recv->pair->route;
+  struct TokenBucket *route_bucket = &route->bandwidth_bucket[recv->is_client];
+  long long wait, client_wait, now_nsec = schedNow(thread_index);
+
+  chargeTokens(route_bucket, now_nsec, bytes_read);
+  chargeTokens(&recv->client_bucket, now_nsec, bytes_read);
+  if (!more || recv->sched_state != TURN_IDLE)
+  {
+    return;
+  }
+
+  if (readPaused(recv))
+  {
+    recv->sched_state = TURN_PAUSED;
+    recv->resume_nsec = now_nsec + MEM_PAUSE_MSEC * 1000000LL;
+    linkEnd(&sched->throttled_head, &sched->throttled_tail, recv);
+    addStat(&worker_stats[thread_index].mem_pauses, 1);
+    return;
+  }
+
+  wait = tokenWait(route_bucket, now_nsec, SHAPE_MIN_READ);
+  if ((client_wait = tokenWait(&recv->client_bucket, now_nsec, SHAPE_MIN_READ)) > wait)
+  {
+    wait = client_wait;
+  }
+  if (wait == 0)
+  {
+    recv->sched_state = TURN_READY;
+    linkEnd(&sched->ready_head, &sched->ready_tail, recv);
+    sched->num_ready++;
+    return;
+  }
+
+  recv->sched_state = TURN_THROTTLED;
+  recv->resume_nsec = now_nsec + wait;
+  recv->throttled_nsec = now_nsec;
+  linkEnd(&sched->throttled_head, &sched->throttled_tail, recv);
+  addStat(&route->stats[thread_index].throttled, 1);
+}
+
+// forget ep's place in the queues, before its pair is closed or migrated
+void unscheduleEnd(int thread_index, struct EndPointFd *ep)
+{
+  if (ep->sched_state != TURN_IDLE)
+  {
+    leaveQueue(thread_index, ep);
+  }
+}
+
+// move the throttled ends whose caps allow them to read again to the back of the ready queue
+// returns the number of ends in the ready queue, the round of turns the worker gives before it polls again
+int startRound(int thread_index)
+{
+  struct RelaySched *sched = &relay_sched[thread_index];
+  struct EndPointFd *ep, *next;
+  long long now_nsec = schedNow(thread_index);
+
+  for (ep = sched->throttled_head; ep != NULL; ep = next)
+  {
+    next = ep->sched_next;
+    if (ep->resume_nsec <= now_nsec)
+    {
+      leaveQueue(thread_index, ep);
+      ep->sched_state = TURN_READY;
+      linkEnd(&sched->ready_head, &sched->ready_tail, ep);
+      sched->num_ready++;
+    }
+  }
+  return sched->num_ready;
+}
+
+// returns the end at the front of the ready queue, taken out for its turn, or NULL if there is none
+struct EndPointFd* nextTurn(int thread_index)
+{
+  struct EndPointFd *ep = relay_sched[thread_index].ready_head;
+
+  if (ep != NULL)
+  {
+    leaveQueue(thread_index, ep);
+  }
+  return ep;
+}
+
+// returns the epoll_wait timeout in msec - 0 while ends wait for a turn, otherwise timeout,
+// or the time until the first throttled end may read again if that is sooner
+int schedWait(int thread_index, int timeout)
+{
+  struct RelaySched *sched = &relay_sched[thread_index];
+  struct EndPointFd *ep;
+  long long resume_nsec = LLONG_MAX;
+  int wait;
+
+  if (sched->num_ready > 0)
+  {
+    return 0;
+  }
+  if (sched->throttled_head == NULL)
+  {
+    return timeout;
+  }
+
+  for (ep = sched->throttled_head; ep != NULL; ep = ep->sched_next)
+  {
+    if (ep->resume_nsec < resume_nsec)
+    {
+      resume_nsec = ep->resume_nsec;
+    }
+  }
+  // round up, so the worker does not wake just before the end may read
+  resume_nsec -= schedNow(thread_index);
+  wait = (resume_nsec > 0) ? (resume_nsec + 999999) / 1000000 : 0;
+  return (timeout == -1 || wait < timeout) ? wait : timeout;
+}
@@ -0,0 +1,256 @@
+#include <stdatomic.h>
+#include <time.h>
+
+#define STATS_INTERVAL 10                    // Default seconds between statistics reports
+#define STATS_FILENAME "port_fwd_stats.txt"
+#define LATENCY_BUCKETS 12                   // Latency histogram buckets, the last one has no upper bound
+#define STATS_THREADS (THREAD_COUNT + 1)     // Worker threads and the accept thread
+
+// upper bound of each latency histogram bucket in usec
+const unsigned long long latency_bucket_usec[LATENCY_BUCKETS - 1] = {10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 100000, 1000000};
+
+struct LatencyHistogram {
+  _Atomic unsigned long long count[LATENCY_BUCKETS];  // observations in each bucket, not cumulative
+  _Atomic unsigned long long sum_usec;
+} LatencyHistogram;
+
+// relay counters, kept per thread so that each counter has a single writer
+// each set sits on its own cache line, so threads never share a line they write to
+struct RelayStats {
+  _Atomic unsigned long long accepted;        // clients accepted
+  _Atomic unsigned long long rejected;        // clients reset by admission control or for lack of fds
+  _Atomic unsigned long long connections;     // client-server pairs connected
+  _Atomic unsigned long long closed;          // client-server pairs closed
+  _Atomic unsigned long long idle_timeouts;   // client-server pairs closed by their rule's idle timeout
+  _Atomic unsigned long long connect_errors;  // server connects that failed
+  _Atomic unsigned long long requests;        // relays that sent data on to the other end
+  _Atomic unsigned long long bytes_in;        // bytes relayed from clients to servers
+  _Atomic unsigned long long bytes_out;       // bytes relayed from servers to clients
+  _Atomic unsigned long long throttled;       // times an end was held back by its rule's bandwidth caps
+  _Atomic unsigned long long throttle_usec;   // time ends were held back by their rule's bandwidth caps
+  _Atomic unsigned long long mirror_bytes;    // bytes of client data sent on to a mirror
+  _Atomic unsigned long long mirror_drops;    // mirrors cut off for failing or falling behind their pair
+  _Atomic unsigned long long busy_nsec;       // time spent handling events, only kept in thread totals
+  _Atomic unsigned long long wakeups;         // returns from epoll_wait, only kept in thread totals
+  _Atomic unsigned long long migrations;      // pairs moved to a less loaded worker, only kept in thread totals
+  _Atomic unsigned long long mem_pauses;      // times an end stopped reading for want of memory, only kept in thread totals
+  struct LatencyHistogram connect_latency;    // time from starting a server connect to its completion
+  struct LatencyHistogram relay_latency;      // time data waits in a relay buffer before it is all sent
+} __attribute__((aligned(64))) RelayStats;
+
+// sum of a set of RelayStats taken by the reporter
+struct StatsSnapshot {
+  unsigned long long active;  // connections less closed
+  unsigned long long accepted;
+  unsigned long long rejected;
+  unsigned long long connections;
+  unsigned long long closed;
+  unsigned long long idle_timeouts;
+  unsigned long long connect_errors;
+  unsigned long long requests;
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  unsigned long long throttled;
+  unsigned long long throttle_usec;
+  unsigned long long mirror_bytes;
+  unsigned long long mirror_drops;
+  unsigned long long busy_nsec;
+  unsigned long long wakeups;
+  unsigned long long connect_latency[LATENCY_BUCKETS];
+  unsigned long long connect_latency_usec;
+  unsigned long long relay_latency[LATENCY_BUCKETS];
+  unsigned long long relay_latency_usec;
+} StatsSnapshot;
+
+int stats_interval = STATS_INTERVAL;
+struct RelayStats worker_stats[STATS_THREADS]; // index is thread_index
+
+// add n to a counter only the calling thread writes
+// a relaxed load and store rather than an atomic add, the reporter still sees whole 64-bit values
+void addStat(_Atomic unsigned long long *counter, unsigned long long n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// add an observation of usec to a histogram only the calling thread writes
+void observeLatency(struct LatencyHistogram *histogram, unsigned long long usec)
+{
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS - 1 && usec > latency_bucket_usec[i]; i++);
+  addStat(&histogram->count[i], 1);
+  addStat(&histogram->sum_usec, usec);
+}
+
+// returns usec elapsed from start to end
+unsigned long long elapsedUsec(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000LL + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+// add the time since start to a thread's event loop busy time, once per return from epoll_wait
+void addBusyTime(int thread_index, struct timespec *start)
+{
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  addStat(&worker_stats[thread_index].busy_nsec, (end.tv_sec - start->tv_sec) * 1000000000LL + (end.tv_nsec - start->tv_nsec));
+  addStat(&worker_stats[thread_index].wakeups, 1);
+}
+
+// allocate a zeroed set of per-thread counters for route
+// returns 0 if successful, -1 if error
+int initRouteStats(struct PortForward *route)
+{
+  if ((route->stats = aligned_alloc(__alignof__(struct RelayStats), sizeof(struct RelayStats) * STATS_THREADS)) == NULL)
+  {
+    printf("RelayStats aligned_alloc error\n");
+    return -1;
+  }
+  memset(route->stats, 0, sizeof(struct RelayStats) * STATS_THREADS);
+  return 0;
+}
+
+static void sumHistogram(struct LatencyHistogram *histogram, unsigned long long *count, unsigned long long *sum_usec)
+{
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+  {
+    count[i] += atomic_load_explicit(&histogram->count[i], memory_order_relaxed);
+  }
+  *sum_usec += atomic_load_explicit(&histogram->sum_usec, memory_order_relaxed);
+}
+
+// write the ports forwarded by route as "port" or "first-last"
+static void routePorts(struct PortForward *route, char *ports, size_t len)
+{
+  if (route->rcv_port == route->last_rcv_port)
+  {
+    snprintf(ports, len, "%i", route->rcv_port);
+  }
+  else
+  {
+    snprintf(ports, len, "%i-%i", route->rcv_port, route->last_rcv_port);
+  }
+}
+
+// sum the per-thread counters in stats into snapshot
+static void sumStats(struct RelayStats *stats, struct StatsSnapshot *snapshot)
+{
+  int i;
+
+  memset(snapshot, 0, sizeof(*snapshot));
+  for (i = 0; i < STATS_THREADS; i++)
+  {
+    snapshot->accepted += atomic_load_explicit(&stats[i].accepted, memory_order_relaxed);
+    snapshot->rejected += atomic_load_explicit(&stats[i].rejected, memory_order_relaxed);
+    snapshot->connections += atomic_load_explicit(&stats[i].connections, memory_order_relaxed);
+    snapshot->closed += atomic_load_explicit(&stats[i].closed, memory_order_relaxed);
+    snapshot->idle_timeouts += atomic_load_explicit(&stats[i].idle_timeouts, memory_order_relaxed);
+    snapshot->connect_errors += atomic_load_explicit(&stats[i].connect_errors, memory_order_relaxed);
+    snapshot->requests += atomic_load_explicit(&stats[i].requests, memory_order_relaxed);
+    snapshot->bytes_in += atomic_load_explicit(&stats[i].bytes_in, memory_order_relaxed);
+    snapshot->bytes_out += atomic_load_explicit(&stats[i].bytes_out, memory_order_relaxed);
+    snapshot->throttled += atomic_load_explicit(&stats[i].throttled, memory_order_relaxed);
+    snapshot->throttle_usec += atomic_load_explicit(&stats[i].throttle_usec, memory_order_relaxed);
+    snapshot->mirror_bytes += atomic_load_explicit(&stats[i].mirror_bytes, memory_order_relaxed);
+    snapshot->mirror_drops += atomic_load_explicit(&stats[i].mirror_drops, memory_order_relaxed);
+    snapshot->busy_nsec += atomic_load_explicit(&stats[i].busy_nsec, memory_order_relaxed);
+    snapshot->wakeups += atomic_load_explicit(&stats[i].wakeups, memory_order_relaxed);
+    sumHistogram(&stats[i].connect_latency, snapshot->connect_latency, &snapshot->connect_latency_usec);
+    sumHistogram(&stats[i].relay_latency, snapshot->relay_latency, &snapshot->relay_latency_usec);
+  }
+  snapshot->active = snapshot->connections - snapshot->closed;
+}
+
+// every stats_interval seconds, print totals and rates for all workers, and write them to STATS_FILENAME
+// along with the totals of each rule in the current route table, the heaviest clients and the memory held
+void* statsMethod(void* arg)
+{
+  FILE *file;
+  struct StatsSnapshot total, last, route_total;
+  struct PortForward *route;
+  struct Backend *backend;
+  struct HeavyClient top[HEAVY_TOP];
+  struct in_addr client;
+  unsigned long long mem_pauses;
+  char time_buffer[25], ports[MAX_PORT_RANGE_CHAR + 1];
+  struct tm *tm_info;
+  time_t timer;
+  int i, j, num_top;
+
+  if ((file = fopen(STATS_FILENAME, "w")) == NULL)
+  {
+    printf("Can't open statistics file: %s\n", STATS_FILENAME);
+    return 0;
+  }
+  fprintf(file, "Time              | Ports       | Active Pairs | Connections | Requests     | Bytes\n");
+  fprintf(file, "______________________________________________________________________________________\n");
+
+  memset(&last, 0, sizeof(last));
+  while (TRUE)
+  {
+    sleep(stats_interval);
+
+    time(&timer);
+    tm_info = localtime(&timer);
+    strftime(time_buffer, 25, "%D %T", tm_info);
+
+    sumStats(worker_stats, &total);
+    printf("%s | %llu active pairs | %llu connections (%.1f/s) | %llu rejected (%.1f/s) | %llu requests (%.1f/s) | %llu bytes (%.1f KB/s)\n", time_buffer,
+      total.active,
+      total.connections, (double) (total.connections - last.connections) / stats_interval,
+      total.rejected, (double) (total.rejected - last.rejected) / stats_interval,
+      total.requests, (double) (total.requests - last.requests) / stats_interval,
+      total.bytes_in + total.bytes_out, (double) (total.bytes_in + total.bytes_out - last.bytes_in - last.bytes_out) / 1024 / stats_interval);
+    fprintf(file, "%*s | %*s | %*llu | %*llu | %*llu | %llu\n", 17, time_buffer, 11, "all", 12, total.active,
+      11, total.connections, 12, total.requests, total.bytes_in + total.bytes_out);
+    last = total;
+
+    pthread_mutex_lock(&table_lock);
+    for (i = 0; i < route_table->num_routes; i++)
+    {
+      route = &route_table->routes[i];
+      sumStats(route->stats, &route_total);
+      routePorts(route, ports, sizeof(ports));
+      fprintf(file, "%*s | %*s | %*llu | %*llu | %*llu | %llu\n", 17, time_buffer, 11, ports, 12, route_total.active,
+        11, route_total.connections, 12, route_total.requests, route_total.bytes_in + route_total.bytes_out);
+
+      // health of the rule's servers, one line each
+      for (j = 0; j < route->num_backends; j++)
+      {
+        backend = &route->backends[j];
+        fprintf(file, "%*s | %*s | server %s %s, %i active pairs, %i failed in a row\n", 17, time_buffer, 11, ports,
+          backend->svr_name, atomic_load_explicit(&backend->healthy, memory_order_relaxed) ? "up" : "down",
+          atomic_load_explicit(&backend->active_conns, memory_order_relaxed), atomic_load_explicit(&backend->failures, memory_order_relaxed));
+      }
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    // heaviest clients by decayed bytes and connections, one line each
+    for (i = 0; i < HEAVY_MEASURES; i++)
+    {
+      num_top = topClients(i, top);
+      for (j = 0; j < num_top; j++)
+      {
+        client.s_addr = top[j].ip;
+        fprintf(file, "%*s | %*s | client %s ~%llu %s\n", 17, time_buffer, 11, (i == HEAVY_BYTES) ? "top bytes" : "top conns",
+          inet_ntoa(client), top[j].count, (i == HEAVY_BYTES) ? "bytes" : "connections");
+      }
+    }
+
+    // memory held for pairs by kind and per active pair, the fixed pools, and the estimated kernel memory of the pairs' sockets
+    for (i = 0, mem_pauses = 0; i < THREAD_COUNT; i++)
+    {
+      mem_pauses += atomic_load_explicit(&worker_stats[i].mem_pauses, memory_order_relaxed);
+    }
+    fprintf(file, "%*s | %*s | %lld bytes of %lld (pairs %lld, buffers %lld, pipes %lld), %llu per pair, %lld fixed, ~%llu in sockets, %llu pauses\n",
+      17, time_buffer, 11, "memory", usedMemory(), mem_cap,
+      atomic_load_explicit(&mem_used[MEM_PAIRS], memory_order_relaxed), atomic_load_explicit(&mem_used[MEM_BUFFERS], memory_order_relaxed),
+      atomic_load_explicit(&mem_used[MEM_PIPES], memory_order_relaxed), (total.active > 0) ? usedMemory() / total.active : 0,
+      atomic_load_explicit(&mem_used[MEM_FIXED], memory_order_relaxed), socketMemory(total.active), mem_pauses);
+    fflush(file);
+  }
+  return 0;
+}
@@ -0,0 +1,127 @@
+#define TIMER_SLOTS 256       // slots in each worker's timer wheel, a power of two
+#define TIMER_TICK_MSEC 1000  // time covered by one slot, idle timeouts fire up to a tick late
+
+// hashed timer wheel of one worker thread, holding the pairs whose rule has an idle timeout
+// a relay only records the tick it happened in - a pair is checked when its slot comes up, and
+// moved to the slot of its new deadline if it was relayed since, so relaying never touches the wheel
+// only the owning worker uses its wheel, so it needs no locking
+struct TimerWheel {
+  struct ConnPair *slots[TIMER_SLOTS];  // pairs due in each slot, linked by timer_next
+  struct timespec now;                  // CLOCK_MONOTONIC time, read once per event loop iteration
+  unsigned long now_tick;               // now in ticks
+  unsigned long last_tick;              // last tick whose slot was expired
+  int num_timers;                       // pairs in the wheel
+} TimerWheel;
+
+struct TimerWheel timer_wheel[THREAD_COUNT]; // index is thread_index
+
+// read the clock for this event loop iteration
+void updateTimerClock(struct TimerWheel *wheel)
+{
+  clock_gettime(CLOCK_MONOTONIC, &wheel->now);
+  wheel->now_tick = (wheel->now.tv_sec * 1000 + wheel->now.tv_nsec / 1000000) / TIMER_TICK_MSEC;
+}
+
+void initTimerWheel(struct TimerWheel *wheel)
+{
+  memset(wheel, 0, sizeof(*wheel));
+  updateTimerClock(wheel);
+  wheel->last_tick = wheel->now_tick;
+}
+
+// returns the tick after which a pair last relayed in last_active has been idle for its rule's timeout
+// the tick of the last relay may have mostly passed already, so the timeout is rounded up a tick
+static unsigned long idleDeadline(struct PortForward *route, unsigned long last_active)
+{
+  return last_active + ((unsigned long) route->idle_timeout * 1000 + TIMER_TICK_MSEC - 1) / TIMER_TICK_MSEC + 1;
+}
+
+static void linkTimer(struct TimerWheel *wheel, struct ConnPair *pair, unsigned long tick)
+{
+  int slot = tick & (TIMER_SLOTS - 1);
+
+  pair->timer_slot = slot;
+  pair->timer_prev = NULL;
+  pair->timer_next = wheel->slots[slot];
+  if (pair->timer_next != NULL)
+  {
+    pair->timer_next->timer_prev = pair;
+  }
+  wheel->slots[slot] = pair;
+}
+
+// start the idle timeout of a new pair, if its rule has one
+void addTimer(struct TimerWheel *wheel, struct ConnPair *pair)
+{
+  pair->last_active = wheel->now_tick;
+  if (pair->route->idle_timeout == 0)
+  {
+    return;
+  }
+  linkTimer(wheel, pair, idleDeadline(pair->route, wheel->now_tick));
+  wheel->num_timers++;
+}
+
+// stop the idle timeout of a pair that is being closed
+void removeTimer(struct TimerWheel *wheel, struct ConnPair *pair)
+{
+  if (pair->timer_slot == -1)
+  {
+    return;
+  }
+
+  if (pair->timer_prev != NULL)
+  {
+    pair->timer_prev->timer_next = pair->timer_next;
+  }
+  else
+  {
+    wheel->slots[pair->timer_slot] = pair->timer_next;
+  }
+  if (pair->timer_next != NULL)
+  {
+    pair->timer_next->timer_prev = pair->timer_prev;
+  }
+  pair->timer_slot = -1;
+  wheel->num_timers--;
+}
+
+// returns the epoll_wait timeout in msec - a tick while any pair has an idle timeout, otherwise none
+int timerWait(struct TimerWheel *wheel)
+{
+  return (wheel->num_timers > 0) ? TIMER_TICK_MSEC : -1;
+}
+
+// advance the wheel to now, taking out every pair that has not been relayed for its rule's idle timeout
+// returns the expired pairs linked by timer_next, for the worker to close
+struct ConnPair* expireTimers(struct TimerWheel *wheel)
+{
+  struct ConnPair *pair, *next, *expired = NULL;
+  unsigned long tick, deadline;
+  int i;
+
+  // a loop that was busy for longer than the wheel's span only needs to visit each slot once
+  for (i = 0, tick = wheel->last_tick + 1; tick <= wheel->now_tick && i < TIMER_SLOTS; tick++, i++)
+  {
+    pair = wheel->slots[tick & (TIMER_SLOTS - 1)];
+    wheel->slots[tick & (TIMER_SLOTS - 1)] = NULL;
+
+    for (; pair != NULL; pair = next)
+    {
+      next = pair->timer_next;
+      deadline = idleDeadline(pair->route, pair->last_active);
+      if (deadline > wheel->now_tick)
+      {
+        linkTimer(wheel, pair, deadline);
+        continue;
+      }
+
+      pair->timer_slot = -1;
+      pair->timer_next = expired;
+      expired = pair;
+      wheel->num_timers--;
+    }
+  }
+  wheel->last_tick = wheel->now_tick;
+  return expired;
+}
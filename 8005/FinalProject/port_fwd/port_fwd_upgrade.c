@@ -0,0 +1,394 @@
+#include <sys/un.h>
+
+#define UPGRADE_LISTENER 1  // listening sockets of a forwarded port
+#define UPGRADE_METRICS 2   // the metrics listener
+#define UPGRADE_END 3       // every listener was sent
+#define UPGRADE_READY 'R'   // sent by the new process once it accepts on the listeners
+#define UPGRADE_DONE 'D'    // sent by the old process once it stopped accepting
+#define DRAIN_REPORT_SEC 10 // seconds between reports of the connections left to drain
+
+// zero-downtime upgrade - a new process started with the same -u path takes over the listening sockets
+// of the running one through that unix socket, so connects are never refused while both run
+// the old process stops accepting once the new one accepts, and exits when its last connection closes
+char *upgrade_path = NULL;  // unix socket the running process waits on for its successor, NULL to disable
+int upgrade_fd = -1;
+
+// one message of the handoff, sent with the listener's fds attached as SCM_RIGHTS
+struct UpgradeHeader {
+  int kind;
+  int port;
+  int num_fds;
+} UpgradeHeader;
+
+// listening sockets received from the old process, taken by createListener as the new process opens its ports
+struct InheritedPort {
+  int num_fds;
+  int taken;
+  int fds[THREAD_COUNT];
+} InheritedPort;
+
+struct InheritedPort *inherited_port[MAX_PORT + 1]; // index is port, NULL if no socket was received
+int inherited_metrics_fd = -1;
+int inherited_metrics_port = 0;
+
+// returns an inherited listening socket for port, already bound and listening, or -1 if there is none left
+int takeInheritedFd(int port)
+{
+  struct InheritedPort *inherited = inherited_port[port];
+
+  if (inherited == NULL || inherited->taken == inherited->num_fds)
+  {
+    return -1;
+  }
+  return inherited->fds[inherited->taken++];
+}
+
+// returns the inherited metrics listener if it is on port, or -1
+int takeInheritedMetricsFd(int port)
+{
+  int fd = -1;
+
+  if (inherited_metrics_fd != -1 && inherited_metrics_port == port)
+  {
+    fd = inherited_metrics_fd;
+    inherited_metrics_fd = -1;
+  }
+  return fd;
+}
+
+// close the inherited sockets of ports the new table does not forward
+void closeInheritedFds()
+{
+  int port;
+
+  for (port = 0; port <= MAX_PORT; port++)
+  {
+    if (inherited_port[port] == NULL)
+    {
+      continue;
+    }
+    while (inherited_port[port]->taken < inherited_port[port]->num_fds)
+    {
+      close(inherited_port[port]->fds[inherited_port[port]->taken++]);
+    }
+    free(inherited_port[port]);
+    inherited_port[port] = NULL;
+  }
+  if (inherited_metrics_fd != -1)
+  {
+    close(inherited_metrics_fd);
+    inherited_metrics_fd = -1;
+  }
+}
+
+// send one handoff message with fds attached
+// returns 0 if successful, -1 if error
+static int sendUpgradeMessage(int fd, int kind, int port, int *fds, int num_fds)
+{
+  struct UpgradeHeader header;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int) * THREAD_COUNT)];
+
+  header.kind = kind;
+  header.port = port;
+  header.num_fds = num_fds;
+  iov.iov_base = &header;
+  iov.iov_len = sizeof(header);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (num_fds > 0)
+  {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+  }
+
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1)
+  {
+    perror("upgrade sendmsg");
+    return -1;
+  }
+  return 0;
+}
+
+// receive one handoff message, its fds are stored in fds
+// returns the number of fds received, or -1 if error
+static int recvUpgradeMessage(int fd, struct UpgradeHeader *header, int *fds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int) * THREAD_COUNT)];
+  int num_fds = 0;
+
+  iov.iov_base = header;
+  iov.iov_len = sizeof(*header);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(*header))
+  {
+    fprintf(stderr, "Upgrade handoff ended early\n");
+    return -1;
+  }
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * num_fds);
+    }
+  }
+  if ((msg.msg_flags & MSG_CTRUNC) || num_fds != header->num_fds)
+  {
+    fprintf(stderr, "Upgrade handoff lost listening sockets\n");
+    return -1;
+  }
+  return num_fds;
+}
+
+// new process - take over the listening sockets of the process waiting on path, if one is
+// exits if the handoff fails part way, since the old process then keeps accepting
+// returns the connection to the old process, to complete the upgrade on, or -1 if no process is waiting
+int requestListeners(const char *path)
+{
+  struct sockaddr_un addr;
+  struct UpgradeHeader header;
+  struct InheritedPort *inherited;
+  int fd, fds[THREAD_COUNT], num_fds, num_ports = 0;
+
+  if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+  {
+    perror("upgrade socket");
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  printf("Upgrading the port forwarder waiting on %s\n", path);
+
+  while (TRUE)
+  {
+    if ((num_fds = recvUpgradeMessage(fd, &header, fds)) == -1)
+    {
+      exit(1);
+    }
+    if (header.kind == UPGRADE_END)
+    {
+      break;
+    }
+
+    if (header.kind == UPGRADE_METRICS && num_fds == 1)
+    {
+      inherited_metrics_fd = fds[0];
+      inherited_metrics_port = header.port;
+      continue;
+    }
+    // sharded listeners are SO_REUSEPORT sockets, one per worker thread, so both processes must shard alike
+    if (header.kind != UPGRADE_LISTENER || header.port < 1 || header.port > MAX_PORT || inherited_port[header.port] != NULL ||
+        num_fds != (shard_listeners ? THREAD_COUNT : 1))
+    {
+      fprintf(stderr, "Upgrade handoff for port %i does not match, -r must be the same for both processes\n", header.port);
+      exit(1);
+    }
+    if ((inherited = malloc(sizeof(struct InheritedPort))) == NULL)
+    {
+      perror("malloc");
+      exit(1);
+    }
+    inherited->num_fds = num_fds;
+    inherited->taken = 0;
+    memcpy(inherited->fds, fds, sizeof(int) * num_fds);
+    inherited_port[header.port] = inherited;
+    num_ports++;
+  }
+  printf("Received the listening sockets of %i ports\n", num_ports);
+  return fd;
+}
+
+// new process - tell the old process that the listeners are accepting, and wait until it stopped
+// returns once the old process released path, so the new process can wait on it for its own successor
+void completeUpgrade(int fd)
+{
+  char reply = UPGRADE_READY;
+
+  if (send(fd, &reply, 1, MSG_NOSIGNAL) != 1 || recv(fd, &reply, 1, 0) != 1 || reply != UPGRADE_DONE)
+  {
+    fprintf(stderr, "Upgrade not confirmed, the old process may still be accepting\n");
+  }
+  close(fd);
+}
+
+// old process - stop accepting on every port, the new process accepts on the same sockets
+// called with table_lock held
+static void closeListeners()
+{
+  struct Listener *listener, **removed;
+  int i, port, num_removed = 0;
+
+  if ((removed = malloc(sizeof(struct Listener*) * (route_table->num_ports + 1))) == NULL)
+  {
+    perror("malloc");
+    return;
+  }
+  for (i = 0; i < route_table->num_ports; i++)
+  {
+    port = route_table->ports[i].port;
+    if ((listener = listener_by_port[port]) == NULL)
+    {
+      continue;
+    }
+    updateListenerEpoll(listener, EPOLL_CTL_DEL);
+    listener_by_port[port] = NULL;
+    removed[num_removed++] = listener;
+  }
+  atomic_fetch_add_explicit(&listener_generation, 1, memory_order_release);
+
+  // as on a reload, an event loop may still hold a listener it loaded before the swap
+  rcuSynchronize();
+  for (i = 0; i < num_removed; i++)
+  {
+    closeListener(removed[i]);
+  }
+  free(removed);
+}
+
+// old process - send every listening socket to the new process on fd, and stop accepting once it accepts
+// returns 0 if the listeners were handed over, -1 if the new process failed, in which case this process keeps accepting
+static int handOverListeners(int fd)
+{
+  struct Listener *listener;
+  int i, j, port, fds[THREAD_COUNT], num_fds, failed = 0;
+  char reply;
+
+  // the listeners sent must stay the ones this process accepts on, so the table is not reloaded from here on
+  pthread_mutex_lock(&table_lock);
+  reload_paused = 1;
+  for (i = 0; i < route_table->num_ports && !failed; i++)
+  {
+    port = route_table->ports[i].port;
+    if ((listener = listener_by_port[port]) == NULL)
+    {
+      continue;
+    }
+    num_fds = (listener->shard != NULL) ? THREAD_COUNT : 1;
+    for (j = 0; j < num_fds; j++)
+    {
+      fds[j] = (listener->shard != NULL) ? listener->shard[j].fd : listener->fd;
+    }
+    failed = (sendUpgradeMessage(fd, UPGRADE_LISTENER, port, fds, num_fds) == -1);
+  }
+  if (!failed && metrics_fd != -1)
+  {
+    failed = (sendUpgradeMessage(fd, UPGRADE_METRICS, metrics_port, &metrics_fd, 1) == -1);
+  }
+  pthread_mutex_unlock(&table_lock);
+
+  // the new process sets up its threads before it replies, the listeners keep accepting here until then
+  if (failed || sendUpgradeMessage(fd, UPGRADE_END, 0, NULL, 0) == -1 || recv(fd, &reply, 1, 0) != 1 || reply != UPGRADE_READY)
+  {
+    printf("Upgrade aborted, still accepting\n");
+    pthread_mutex_lock(&table_lock);
+    reload_paused = 0;
+    pthread_mutex_unlock(&table_lock);
+    return -1;
+  }
+
+  pthread_mutex_lock(&table_lock);
+  closeListeners();
+  pthread_mutex_unlock(&table_lock);
+  stopMetrics();
+
+  // release path before confirming, so the new process can wait on it
+  close(upgrade_fd);
+  upgrade_fd = -1;
+  reply = UPGRADE_DONE;
+  send(fd, &reply, 1, MSG_NOSIGNAL);
+  return 0;
+}
+
+// create the unix socket the process waits on for its successor, replacing a stale one
+// returns 0 if successful, -1 if error
+int initUpgrade(const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Upgrade socket path is too long: %s\n", path);
+    return -1;
+  }
+  if ((upgrade_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+  {
+    perror("upgrade socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(upgrade_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(upgrade_fd, 1) == -1)
+  {
+    perror("Can't listen on upgrade socket");
+    close(upgrade_fd);
+    upgrade_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// wait for a new process to take over the listeners, then drain - relay the remaining connections
+// until they have all closed, and exit
+void* upgradeMethod(void* arg)
+{
+  int fd, active, seconds = 0;
+
+  while (TRUE)
+  {
+    if ((fd = accept(upgrade_fd, NULL, NULL)) == -1)
+    {
+      if (errno != EINTR)
+      {
+        perror("upgrade accept");
+      }
+      continue;
+    }
+    printf("New process connected for upgrade\n");
+    if (handOverListeners(fd) == 0)
+    {
+      close(fd);
+      break;
+    }
+    close(fd);
+  }
+
+  // clients admitted but not yet connected are counted too
+  while ((active = atomic_load_explicit(&total_conns, memory_order_relaxed)) > 0)
+  {
+    if (seconds++ % DRAIN_REPORT_SEC == 0)
+    {
+      printf("Upgrade: draining %i connections\n", active);
+    }
+    sleep(1);
+  }
+  printf("Upgrade: all connections drained, exiting\n");
+  exit(0);
+  return 0;
+}
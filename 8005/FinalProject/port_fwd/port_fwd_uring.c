@@ -0,0 +1,955 @@
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#define URING_ENTRIES 4096     // submission queue entries per worker ring
+#define URING_BUF_COUNT 1024   // provided receive buffers per worker, a power of two
+#define URING_BUF_LEN 16384    // bytes per provided receive buffer
+#define URING_BUF_GROUP 0
+#define URING_SEND_CHAIN 16    // max linked sends submitted at once for one direction
+
+// operation of a request, kept in the low bits of its user_data next to the pointer it acts on
+#define URING_OP_IGNORE 0      // cancels, their completions carry nothing
+#define URING_OP_ACCEPT 1      // multishot accept, pointer is a UringAccept
+#define URING_OP_RECV 2        // multishot recv into provided buffers, pointer is the receiving EndPointFd
+#define URING_OP_SEND 3        // linked send of a provided buffer, pointer is the EndPointFd it was received on
+#define URING_OP_CONNECT 4     // server connect, pointer is the server EndPointFd
+#define URING_OP_WAKE 5        // multishot poll of the thread's RCU wake eventfd
+#define URING_OP_MASK 7
+
+// multishot accept armed by one worker on one listener
+// listener is compared to listener_by_port to notice reloads, and is not used once the accept is cancelled
+struct UringAccept {
+  struct Listener *listener;
+  int fd;
+  int cancelled;  // cancel submitted, completions still arriving are dropped
+  int paused;     // stopped while out of fds, nothing in flight
+  struct UringAccept *next;
+} UringAccept;
+
+// io_uring instance of one worker thread, with its provided receive buffers
+// the worker is the only thread submitting to its ring
+struct UringWorker {
+  int ring_fd;
+  unsigned sq_entries;
+  unsigned sq_tail;              // local tail, published to *sq_ktail on submit
+  _Atomic unsigned *sq_khead;
+  _Atomic unsigned *sq_ktail;
+  unsigned *sq_kmask;
+  struct io_uring_sqe *sqes;
+  _Atomic unsigned *cq_khead;
+  _Atomic unsigned *cq_ktail;
+  unsigned *cq_kmask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_cqe *set_aside; // completions taken off the ring while it was full, handled before the ring's
+  int num_set_aside;
+  int set_aside_head;             // first of them not yet handled
+  int set_aside_capacity;
+
+  struct io_uring_buf_ring *buf_ring;
+  unsigned short buf_tail;
+  char *buffers;                 // URING_BUF_COUNT buffers of URING_BUF_LEN bytes, index is buffer id
+  int buf_next[URING_BUF_COUNT]; // next buffer queued for the same send, -1 at the end
+  int buf_len[URING_BUF_COUNT];  // bytes received into each buffer
+  int bufs_returned;             // buffers went back to the ring since starved receives were re-armed
+
+  struct UringAccept *accepts;
+  unsigned long listener_generation;
+  int accepts_paused;            // accepts stopped while out of fds
+  int paused_clients;            // num_clients when they stopped
+  unsigned long paused_tick;     // timer wheel tick they stopped in
+  struct EndPointFd *starved;    // receives stopped because every buffer was in use
+} UringWorker;
+
+static void uringArmRecv(struct UringWorker*, struct EndPointFd*);
+static void uringClosePair(struct UringWorker*, struct ConnPair*, int);
+
+// map a ring region, returns NULL if error
+static void* uringMap(int ring_fd, size_t len, off_t offset)
+{
+  void *ptr;
+
+  if ((ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset)) == MAP_FAILED)
+  {
+    perror("io_uring mmap");
+    return NULL;
+  }
+  return ptr;
+}
+
+// create the calling worker's ring and register its provided buffer ring
+// returns the worker ring, or NULL if io_uring is not available
+static struct UringWorker* initUringWorker()
+{
+  struct UringWorker *w;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  char *sq_ptr, *cq_ptr;
+  unsigned i, *sq_array;
+
+  if ((w = calloc(1, sizeof(struct UringWorker))) == NULL)
+  {
+    perror("calloc");
+    return NULL;
+  }
+
+  // the worker is the only submitter, so the kernel can run completions when the worker enters the ring
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+  params.cq_entries = URING_ENTRIES * 4;
+  if ((w->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1)
+  {
+    perror("io_uring_setup");
+    free(w);
+    return NULL;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+  {
+    printf("io_uring is too old for the uring engine\n");
+    close(w->ring_fd);
+    free(w);
+    return NULL;
+  }
+
+  // the submission and completion rings share one mapping
+  i = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > i)
+  {
+    i = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  }
+  if ((sq_ptr = uringMap(w->ring_fd, i, IORING_OFF_SQ_RING)) == NULL ||
+      (w->sqes = uringMap(w->ring_fd, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES)) == NULL)
+  {
+    close(w->ring_fd);
+    free(w);
+    return NULL;
+  }
+  cq_ptr = sq_ptr;
+
+  w->sq_entries = params.sq_entries;
+  w->sq_khead = (_Atomic unsigned*) (sq_ptr + params.sq_off.head);
+  w->sq_ktail = (_Atomic unsigned*) (sq_ptr + params.sq_off.tail);
+  w->sq_kmask = (unsigned*) (sq_ptr + params.sq_off.ring_mask);
+  w->sq_tail = atomic_load_explicit(w->sq_ktail, memory_order_relaxed);
+  w->cq_khead = (_Atomic unsigned*) (cq_ptr + params.cq_off.head);
+  w->cq_ktail = (_Atomic unsigned*) (cq_ptr + params.cq_off.tail);
+  w->cq_kmask = (unsigned*) (cq_ptr + params.cq_off.ring_mask);
+  w->cqes = (struct io_uring_cqe*) (cq_ptr + params.cq_off.cqes);
+
+  // each submission queue slot always holds the entry of the same index
+  sq_array = (unsigned*) (sq_ptr + params.sq_off.array);
+  for (i = 0; i < params.sq_entries; i++)
+  {
+    sq_array[i] = i;
+  }
+
+  // provided buffers - the kernel picks a free one for each receive, and it is returned once sent
+  w->buffers = malloc((size_t) URING_BUF_COUNT * URING_BUF_LEN);
+  w->buf_ring = aligned_alloc(sysconf(_SC_PAGESIZE), sizeof(struct io_uring_buf) * URING_BUF_COUNT);
+  if (w->buffers == NULL || w->buf_ring == NULL)
+  {
+    perror("malloc");
+    close(w->ring_fd);
+    free(w->buffers);
+    free(w->buf_ring);
+    free(w);
+    return NULL;
+  }
+  memset(w->buf_ring, 0, sizeof(struct io_uring_buf) * URING_BUF_COUNT);
+  addMemory(MEM_FIXED, (long long) URING_BUF_COUNT * URING_BUF_LEN);
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) w->buf_ring;
+  reg.ring_entries = URING_BUF_COUNT;
+  reg.bgid = URING_BUF_GROUP;
+  if (syscall(__NR_io_uring_register, w->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+  {
+    perror("io_uring_register");
+    close(w->ring_fd);
+    free(w->buffers);
+    free(w->buf_ring);
+    free(w);
+    return NULL;
+  }
+
+  for (i = 0; i < URING_BUF_COUNT; i++)
+  {
+    w->buf_ring->bufs[i].addr = (unsigned long) (w->buffers + (size_t) i * URING_BUF_LEN);
+    w->buf_ring->bufs[i].len = URING_BUF_LEN;
+    w->buf_ring->bufs[i].bid = i;
+  }
+  w->buf_tail = URING_BUF_COUNT;
+  atomic_store_explicit((_Atomic unsigned short*) &w->buf_ring->tail, w->buf_tail, memory_order_release);
+
+  w->listener_generation = ~0UL;
+  return w;
+}
+
+// submit queued entries, and wait for at least min_complete completions or timeout_msec (-1 for no limit)
+// returns 0 if successful, -1 if error
+static int uringEnter(struct UringWorker *w, unsigned min_complete, int timeout_msec)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0, to_submit;
+  void *argp = NULL;
+  size_t arg_len = 0;
+
+  atomic_store_explicit(w->sq_ktail, w->sq_tail, memory_order_release);
+  to_submit = w->sq_tail - atomic_load_explicit(w->sq_khead, memory_order_acquire);
+
+  if (min_complete && timeout_msec >= 0)
+  {
+    ts.tv_sec = timeout_msec / 1000;
+    ts.tv_nsec = (timeout_msec % 1000) * 1000000LL;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long) &ts;
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    arg_len = sizeof(arg);
+  }
+
+  if (syscall(__NR_io_uring_enter, w->ring_fd, to_submit, min_complete, flags, argp, arg_len) == -1 &&
+      errno != ETIME && errno != EINTR && errno != EBUSY)
+  {
+    perror("io_uring_enter");
+    return -1;
+  }
+  return 0;
+}
+
+// move the completions on the ring to the worker's set aside completions, to make room on the ring
+// the worker may be in the middle of handling a completion, so they are handled by the event loop later
+static void uringSetAside(struct UringWorker *w)
+{
+  unsigned head = atomic_load_explicit(w->cq_khead, memory_order_relaxed);
+
+  while (head != atomic_load_explicit(w->cq_ktail, memory_order_acquire))
+  {
+    if (growArray((void**) &w->set_aside, w->num_set_aside, &w->set_aside_capacity, sizeof(struct io_uring_cqe)) == -1)
+    {
+      perror("io_uring completion realloc");
+      exit(1);
+    }
+    w->set_aside[w->num_set_aside++] = w->cqes[head & *w->cq_kmask];
+    atomic_store_explicit(w->cq_khead, ++head, memory_order_release);
+  }
+}
+
+// take the next completion, set aside ones first as they arrived before those on the ring
+// returns 1 if there was one, 0 if not
+static int uringNextCqe(struct UringWorker *w, struct io_uring_cqe *cqe)
+{
+  unsigned head;
+
+  if (w->set_aside_head < w->num_set_aside)
+  {
+    *cqe = w->set_aside[w->set_aside_head++];
+    return 1;
+  }
+  w->set_aside_head = w->num_set_aside = 0;
+
+  head = atomic_load_explicit(w->cq_khead, memory_order_relaxed);
+  if (head == atomic_load_explicit(w->cq_ktail, memory_order_acquire))
+  {
+    return 0;
+  }
+  *cqe = w->cqes[head & *w->cq_kmask];
+  atomic_store_explicit(w->cq_khead, ++head, memory_order_release);
+  return 1;
+}
+
+// submit what is queued until the submission queue has room for n more entries
+static void uringMakeRoom(struct UringWorker *w, unsigned n)
+{
+  unsigned sq_head;
+
+  // the kernel takes no entries while completions it could not fit on the ring wait for room (EBUSY),
+  // so when a submit makes no progress the ring is emptied, or the worker waits up to a tick for completions
+  while (w->sq_tail - (sq_head = atomic_load_explicit(w->sq_khead, memory_order_acquire)) + n > w->sq_entries)
+  {
+    if (uringEnter(w, 0, -1) == -1)
+    {
+      exit(1);
+    }
+    if (atomic_load_explicit(w->sq_khead, memory_order_acquire) == sq_head)
+    {
+      uringSetAside(w);
+      if (uringEnter(w, 1, TIMER_TICK_MSEC) == -1)
+      {
+        exit(1);
+      }
+      uringSetAside(w);
+    }
+  }
+}
+
+// returns a cleared submission queue entry, submitting what is queued if the queue is full
+static struct io_uring_sqe* uringSqe(struct UringWorker *w, int op, int fd, void *ptr, int kind)
+{
+  struct io_uring_sqe *sqe;
+
+  uringMakeRoom(w, 1);
+  sqe = &w->sqes[w->sq_tail & *w->sq_kmask];
+  w->sq_tail++;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->user_data = (unsigned long) ptr | kind;
+  return sqe;
+}
+
+// give a received buffer back to the kernel once its data was sent
+static void uringReturnBuffer(struct UringWorker *w, int bid)
+{
+  struct io_uring_buf *buf = &w->buf_ring->bufs[w->buf_tail & (URING_BUF_COUNT - 1)];
+
+  buf->addr = (unsigned long) (w->buffers + (size_t) bid * URING_BUF_LEN);
+  buf->len = URING_BUF_LEN;
+  buf->bid = bid;
+  w->buf_tail++;
+  atomic_store_explicit((_Atomic unsigned short*) &w->buf_ring->tail, w->buf_tail, memory_order_release);
+  w->bufs_returned = 1;
+}
+
+// arm a multishot accept of a listener on the worker's ring
+static void uringArmAccept(struct UringWorker *w, struct UringAccept *accept)
+{
+  struct io_uring_sqe *sqe = uringSqe(w, IORING_OP_ACCEPT, accept->fd, accept, URING_OP_ACCEPT);
+
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+}
+
+// unlink and free an accept whose last completion arrived, or that was paused
+static void uringFreeAccept(struct UringWorker *w, struct UringAccept *accept)
+{
+  struct UringAccept **prev;
+
+  for (prev = &w->accepts; *prev != accept; prev = &(*prev)->next);
+  *prev = accept->next;
+  free(accept);
+}
+
+// bring the worker's accepts in line with listener_by_port after main or the reloader changed it
+// runs before the worker's quiescent state, so a removed listener's accept is cancelled before it is closed
+static void uringSyncAccepts(struct UringWorker *w, int thread_index)
+{
+  struct UringAccept *accept, *next;
+  struct Listener *listener;
+  struct io_uring_sqe *sqe;
+  unsigned long generation;
+  char *armed;
+  int port;
+
+  if ((generation = atomic_load_explicit(&listener_generation, memory_order_acquire)) == w->listener_generation)
+  {
+    return;
+  }
+  if ((armed = calloc(MAX_PORT + 1, sizeof(char))) == NULL)
+  {
+    perror("calloc");
+    return;
+  }
+  w->listener_generation = generation;
+
+  for (accept = w->accepts; accept != NULL; accept = next)
+  {
+    next = accept->next;
+    if (accept->cancelled)
+    {
+      continue;
+    }
+    port = accept->listener->port;
+    if (listener_by_port[port] == accept->listener)
+    {
+      armed[port] = 1;
+      continue;
+    }
+    // a paused accept has nothing to cancel
+    if (accept->paused)
+    {
+      w->accepts_paused--;
+      uringFreeAccept(w, accept);
+      continue;
+    }
+    sqe = uringSqe(w, IORING_OP_ASYNC_CANCEL, -1, NULL, URING_OP_IGNORE);
+    sqe->addr = (unsigned long) accept | URING_OP_ACCEPT;
+    accept->cancelled = 1;
+  }
+
+  for (port = 0; port <= MAX_PORT; port++)
+  {
+    if ((listener = listener_by_port[port]) == NULL || armed[port])
+    {
+      continue;
+    }
+    if ((accept = malloc(sizeof(struct UringAccept))) == NULL)
+    {
+      perror("malloc");
+      break;
+    }
+    accept->listener = listener;
+    accept->fd = listenerFor(listener, thread_index)->fd;
+    accept->cancelled = 0;
+    accept->paused = 0;
+    accept->next = w->accepts;
+    w->accepts = accept;
+    uringArmAccept(w, accept);
+  }
+  free(armed);
+}
+
+// a client was accepted - connect it to a server of the listener's rule
+static void uringAccepted(struct UringWorker *w, struct UringAccept *accept, int clnt_fd, int thread_index)
+{
+  struct sockaddr_in client;
+  socklen_t client_len = sizeof(client);
+  struct PortForward *route;
+  struct ConnPair *pair;
+  struct io_uring_sqe *sqe;
+
+  // multishot accept does not report the peer, the hash balancing policy needs it
+  if (getpeername(clnt_fd, (struct sockaddr*) &client, &client_len) == -1)
+  {
+    perror("getpeername");
+    close(clnt_fd);
+    return;
+  }
+  printf("  Remote Address:  %s\n", inet_ntoa(client.sin_addr));
+
+  route = listenerRoute(accept->listener);
+  addStat(&worker_stats[thread_index].accepted, 1);
+  addStat(&route->stats[thread_index].accepted, 1);
+  if (admitClient(route) == -1)
+  {
+    rejectClient(thread_index, route, clnt_fd);
+    return;
+  }
+  acquireRouteTable(route->table);
+  if ((pair = setupConn(thread_index, route, clnt_fd, &client)) == NULL)
+  {
+    return;
+  }
+  startPair(thread_index, pair);
+  pair->uring_ops = 0;
+  pair->closing = 0;
+  pair->clnt.send_head = pair->svr.send_head = -1;
+  pair->clnt.send_offset = pair->svr.send_offset = 0;
+  pair->clnt.sends_in_flight = pair->svr.sends_in_flight = 0;
+  pair->clnt.recv_armed = pair->svr.recv_armed = 0;
+  pair->clnt.recv_cancelled = pair->svr.recv_cancelled = 0;
+
+  // client data is received while the server connects, and sent once it is connected
+  sqe = uringSqe(w, IORING_OP_CONNECT, pair->svr.fd, &pair->svr, URING_OP_CONNECT);
+  // the address must outlive the submission, a unix server's is kept in its backend
+  if (pair->backend->svr_unix)
+  {
+    sqe->addr = (unsigned long) &pair->backend->svr_un;
+    sqe->off = sizeof(pair->backend->svr_un);
+  }
+  else
+  {
+    sqe->addr = (unsigned long) &pair->svr.addr;
+    sqe->off = sizeof(pair->svr.addr);
+  }
+  pair->uring_ops++;
+  uringArmRecv(w, &pair->clnt);
+}
+
+static void uringAcceptDone(struct UringWorker *w, struct UringAccept *accept, int res, unsigned flags, int thread_index)
+{
+  if (res >= 0)
+  {
+    if (accept->cancelled)
+    {
+      close(res);
+    }
+    else
+    {
+      uringAccepted(w, accept, res, thread_index);
+    }
+  }
+  else if (res != -ECANCELED)
+  {
+    fprintf(stderr, "accept: %s\n", strerror(-res));
+
+    // out of fds - reset the pending clients with the spare fd, and stop accepting until fds may be free again,
+    // as an accept armed while out of fds fails at once whether or not a client is waiting
+    if ((res == -EMFILE || res == -ENFILE) && !(flags & IORING_CQE_F_MORE) && !accept->cancelled)
+    {
+      while (shedClient(thread_index, accept->fd) == 0);
+      if (w->accepts_paused++ == 0)
+      {
+        w->paused_clients = atomic_load_explicit(&num_clients[thread_index], memory_order_relaxed);
+        w->paused_tick = timer_wheel[thread_index].now_tick;
+      }
+      accept->paused = 1;
+      return;
+    }
+  }
+
+  // the accept stopped - free it if it was cancelled, otherwise keep accepting
+  if (!(flags & IORING_CQE_F_MORE))
+  {
+    if (accept->cancelled)
+    {
+      uringFreeAccept(w, accept);
+    }
+    else
+    {
+      uringArmAccept(w, accept);
+    }
+  }
+}
+
+// re-arm the accepts stopped while out of fds, once a pair of the worker closed or a tick passed
+static void uringResumeAccepts(struct UringWorker *w, int thread_index)
+{
+  struct UringAccept *accept;
+
+  if (w->accepts_paused == 0 || (atomic_load_explicit(&num_clients[thread_index], memory_order_relaxed) >= w->paused_clients &&
+      timer_wheel[thread_index].now_tick == w->paused_tick))
+  {
+    return;
+  }
+  for (accept = w->accepts; accept != NULL; accept = accept->next)
+  {
+    if (accept->paused)
+    {
+      accept->paused = 0;
+      uringArmAccept(w, accept);
+    }
+  }
+  w->accepts_paused = 0;
+}
+
+// start a multishot receive on ep into the worker's provided buffers
+static void uringArmRecv(struct UringWorker *w, struct EndPointFd *ep)
+{
+  struct io_uring_sqe *sqe = uringSqe(w, IORING_OP_RECV, ep->fd, ep, URING_OP_RECV);
+
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  ep->recv_armed = 1;
+  ep->recv_cancelled = 0;
+  ep->pair->uring_ops++;
+}
+
+// submit the buffers received on ep and queued for the other end as a chain of linked sends
+// links keep the sends in order, and a short send cancels the rest of the chain so it is resent from there
+static void uringSendChain(struct UringWorker *w, struct EndPointFd *ep)
+{
+  struct io_uring_sqe *sqe = NULL;
+  int bid, offset, num_sends = 0;
+
+  // a link chain split by a submit would be cut short, so the queue must have room for all of it first
+  for (bid = ep->send_head; bid != -1 && ep->sends_in_flight + num_sends < URING_SEND_CHAIN; bid = w->buf_next[bid])
+  {
+    num_sends++;
+  }
+  uringMakeRoom(w, num_sends);
+
+  for (bid = ep->send_head, offset = ep->send_offset; bid != -1 && ep->sends_in_flight < URING_SEND_CHAIN; bid = w->buf_next[bid], offset = 0)
+  {
+    sqe = uringSqe(w, IORING_OP_SEND, ep->alt->fd, ep, URING_OP_SEND);
+    sqe->addr = (unsigned long) (w->buffers + (size_t) bid * URING_BUF_LEN + offset);
+    sqe->len = w->buf_len[bid] - offset;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_LINK;
+    ep->sends_in_flight++;
+    ep->pair->uring_ops++;
+  }
+  if (sqe != NULL)
+  {
+    sqe->flags = 0;
+  }
+}
+
+// pass the end of ep's stream on once everything it sent was relayed, closing the pair when both directions are done
+static void uringCheckEof(struct UringWorker *w, struct EndPointFd *ep, int thread_index)
+{
+  if (!ep->read_eof || ep->send_head != -1 || ep->alt->connecting)
+  {
+    return;
+  }
+  if (ep->alt->read_eof && ep->alt->send_head == -1)
+  {
+    uringClosePair(w, ep->pair, thread_index);
+    return;
+  }
+  if (!ep->alt->write_shut)
+  {
+    shutdown(ep->alt->fd, SHUT_WR);
+    ep->alt->write_shut = 1;
+  }
+}
+
+static void uringRecvDone(struct UringWorker *w, struct EndPointFd *ep, int res, unsigned flags, int thread_index)
+{
+  struct TimerWheel *wheel = &timer_wheel[thread_index];
+  struct io_uring_sqe *sqe;
+  int bid;
+
+  if (!(flags & IORING_CQE_F_MORE))
+  {
+    ep->recv_armed = 0;
+    ep->pair->uring_ops--;
+  }
+
+  if (res > 0)
+  {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (ep->pair->closing)
+    {
+      uringReturnBuffer(w, bid);
+      return;
+    }
+
+    // queue the buffer for the other end
+    w->buf_len[bid] = res;
+    w->buf_next[bid] = -1;
+    if (ep->send_head == -1)
+    {
+      ep->send_head = bid;
+      ep->buffered_since = wheel->now;
+    }
+    else
+    {
+      w->buf_next[ep->send_tail] = bid;
+    }
+    ep->send_tail = bid;
+    ep->buffered += res;
+    ep->pair->last_active = wheel->now_tick;
+    if (ep->sends_in_flight == 0 && !ep->alt->connecting)
+    {
+      uringSendChain(w, ep);
+    }
+
+    // the other end is slow - stop receiving until what is queued for it was sent
+    if (ep->buffered >= RELAY_HIGH_WATER && ep->recv_armed && !ep->recv_cancelled)
+    {
+      sqe = uringSqe(w, IORING_OP_ASYNC_CANCEL, -1, NULL, URING_OP_IGNORE);
+      sqe->addr = (unsigned long) ep | URING_OP_RECV;
+      ep->recv_cancelled = 1;
+    }
+  }
+  else if (res == 0)
+  {
+    ep->read_eof = 1;
+    uringCheckEof(w, ep, thread_index);
+    return;
+  }
+  else if (res == -ENOBUFS)
+  {
+    // every buffer is queued for sending, receive again once some are returned
+    if (!ep->recv_armed && !ep->pair->closing)
+    {
+      ep->next_starved = w->starved;
+      w->starved = ep;
+      ep->pair->uring_ops++;
+    }
+    return;
+  }
+  else if (res != -ECANCELED)
+  {
+    if (!ep->pair->closing)
+    {
+      fprintf(stderr, "recv: %s\n", strerror(-res));
+    }
+    uringClosePair(w, ep->pair, thread_index);
+    return;
+  }
+
+  // a receive that stopped for any other reason resumes unless the other end is behind
+  if (!ep->recv_armed && !ep->pair->closing && !ep->read_eof && ep->buffered < RELAY_HIGH_WATER)
+  {
+    uringArmRecv(w, ep);
+  }
+}
+
+static void uringSendDone(struct UringWorker *w, struct EndPointFd *ep, int res, int thread_index)
+{
+  struct RelayStats *route_stats = &ep->pair->route->stats[thread_index];
+  struct TimerWheel *wheel = &timer_wheel[thread_index];
+  int bid;
+
+  ep->sends_in_flight--;
+  ep->pair->uring_ops--;
+  if (ep->pair->closing)
+  {
+    return;
+  }
+
+  if (res < 0)
+  {
+    // a short send earlier in the chain cancelled this one, it is resent with the rest
+    if (res != -ECANCELED)
+    {
+      fprintf(stderr, "send: %s\n", strerror(-res));
+      uringClosePair(w, ep->pair, thread_index);
+    }
+  }
+  else
+  {
+    bid = ep->send_head;
+    ep->send_offset += res;
+    ep->buffered -= res;
+    if (ep->send_offset == w->buf_len[bid])
+    {
+      ep->send_head = w->buf_next[bid];
+      ep->send_offset = 0;
+      uringReturnBuffer(w, bid);
+    }
+
+    ep->pair->last_active = wheel->now_tick;
+    ep->alt->num_requests += 1;
+    ep->alt->bytes_sent += res;
+    addStat(&worker_stats[thread_index].requests, 1);
+    addStat(ep->is_client ? &worker_stats[thread_index].bytes_in : &worker_stats[thread_index].bytes_out, res);
+    addStat(&route_stats->requests, 1);
+    addStat(ep->is_client ? &route_stats->bytes_in : &route_stats->bytes_out, res);
+    countClient(thread_index, HEAVY_BYTES, ep->pair->clnt.addr.sin_addr.s_addr, res);
+
+    if (debug_log)
+    {
+      struct PrintData data;
+      data.recv_fd = ep->fd;
+      data.send_fd = ep->alt->fd;
+      data.num_requests = ep->alt->num_requests;
+      data.bytes_sent = ep->alt->bytes_sent;
+      write(out_pipe[1], &data, sizeof(data));
+    }
+  }
+
+  if (ep->sends_in_flight > 0)
+  {
+    return;
+  }
+  if (ep->send_head != -1)
+  {
+    uringSendChain(w, ep);
+    return;
+  }
+
+  // everything received on ep was sent - resume receiving, or pass the end of the stream on
+  observeLatency(&route_stats->relay_latency, elapsedUsec(&ep->buffered_since, &wheel->now));
+  if (!ep->recv_armed && !ep->read_eof)
+  {
+    uringArmRecv(w, ep);
+  }
+  uringCheckEof(w, ep, thread_index);
+}
+
+static void uringConnectDone(struct UringWorker *w, struct EndPointFd *svr, int res, int thread_index)
+{
+  svr->pair->uring_ops--;
+  if (svr->pair->closing)
+  {
+    return;
+  }
+  if (res < 0)
+  {
+    fprintf(stderr, "Can't connect to server %s: %s\n", svr->pair->backend->svr_name, strerror(-res));
+    addStat(&worker_stats[thread_index].connect_errors, 1);
+    addStat(&svr->pair->route->stats[thread_index].connect_errors, 1);
+    backendFailed(svr->pair->route, svr->pair->backend);
+    uringClosePair(w, svr->pair, thread_index);
+    return;
+  }
+
+  svr->connecting = 0;
+  backendConnected(svr->pair->route, svr->pair->backend);
+  observeLatency(&svr->pair->route->stats[thread_index].connect_latency, elapsedUsec(&svr->pair->connect_start, &timer_wheel[thread_index].now));
+  uringArmRecv(w, svr);
+
+  // send client data received while connecting
+  if (svr->alt->send_head != -1)
+  {
+    uringSendChain(w, svr->alt);
+  }
+  uringCheckEof(w, svr->alt, thread_index);
+}
+
+// free a closing pair once no request refers to it
+static void uringReleasePair(struct UringWorker *w, struct ConnPair *pair, int thread_index)
+{
+  struct EndPointFd *ep[2] = {&pair->clnt, &pair->svr};
+  int i, bid;
+
+  if (!pair->closing || pair->uring_ops > 0)
+  {
+    return;
+  }
+
+  for (i = 0; i < 2; i++)
+  {
+    for (bid = ep[i]->send_head; bid != -1; bid = w->buf_next[bid])
+    {
+      uringReturnBuffer(w, bid);
+    }
+    printf("Completed connection for %s fd %i\n", (ep[i]->is_client) ? "client":"server", ep[i]->fd);
+    close(ep[i]->fd);
+    ep[i]->alt = NULL;
+  }
+  finishPair(thread_index, pair);
+  freeConnPair(&conn_pool[thread_index], pair);
+}
+
+// stop relaying a pair - its requests are cancelled, and it is freed once their completions arrived
+static void uringClosePair(struct UringWorker *w, struct ConnPair *pair, int thread_index)
+{
+  struct io_uring_sqe *sqe;
+
+  if (pair->closing)
+  {
+    return;
+  }
+  pair->closing = 1;
+  removeTimer(&timer_wheel[thread_index], pair);
+
+  // with nothing in flight the pair is freed by the caller right away, and there is nothing to cancel
+  // otherwise its fds stay open until the cancels were submitted and every request completed
+  if (pair->uring_ops == 0)
+  {
+    return;
+  }
+
+  sqe = uringSqe(w, IORING_OP_ASYNC_CANCEL, pair->clnt.fd, NULL, URING_OP_IGNORE);
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe = uringSqe(w, IORING_OP_ASYNC_CANCEL, pair->svr.fd, NULL, URING_OP_IGNORE);
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+// re-arm receives that ran out of buffers, once buffers were returned
+static void uringRearmStarved(struct UringWorker *w, int thread_index)
+{
+  struct EndPointFd *ep, *next;
+
+  if (!w->bufs_returned)
+  {
+    return;
+  }
+  w->bufs_returned = 0;
+
+  ep = w->starved;
+  w->starved = NULL;
+  for (; ep != NULL; ep = next)
+  {
+    next = ep->next_starved;
+    ep->pair->uring_ops--;
+    if (ep->pair->closing)
+    {
+      uringReleasePair(w, ep->pair, thread_index);
+    }
+    else if (!ep->recv_armed && !ep->read_eof && ep->buffered < RELAY_HIGH_WATER)
+    {
+      uringArmRecv(w, ep);
+    }
+  }
+}
+
+// arm a multishot poll of the thread's RCU wake eventfd
+static void uringArmWake(struct UringWorker *w, int thread_index)
+{
+  struct io_uring_sqe *sqe = uringSqe(w, IORING_OP_POLL_ADD, rcu_thread[thread_index].wake_fd, NULL, URING_OP_WAKE);
+
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+}
+
+// worker thread of the io_uring engine - accepts, connects and relays its own clients on its own ring
+// shares listeners, route tables, pair pools, the timer wheel and statistics with the epoll engine
+void* uringMethod(void* info_ptr)
+{
+  struct ThreadInfo *thread_info = (struct ThreadInfo*) info_ptr;
+  int thread_index = thread_info->thread_index;
+  // free info_ptr after it was used
+  free(info_ptr);
+
+  struct UringWorker *w;
+  struct TimerWheel *wheel = &timer_wheel[thread_index];
+  struct io_uring_cqe cqe;
+  struct ConnPair *pair, *next_pair;
+  struct EndPointFd *ep;
+  unsigned flags;
+  unsigned long user_data;
+  int res;
+
+  if ((w = initUringWorker()) == NULL)
+  {
+    exit(1);
+  }
+  atomic_store_explicit(&num_clients[thread_index], 0, memory_order_relaxed);
+  initReserveFd(thread_index);
+  initTimerWheel(wheel);
+  uringArmWake(w, thread_index);
+
+  while (TRUE)
+  {
+    uringSyncAccepts(w, thread_index);
+    rcuQuiescent(thread_index);
+    // completions set aside since the last drain are handled without waiting for more
+    if (uringEnter(w, (w->set_aside_head < w->num_set_aside) ? 0 : 1, (w->accepts_paused > 0) ? TIMER_TICK_MSEC : timerWait(wheel)) == -1)
+    {
+      exit(1);
+    }
+
+    // one clock read per iteration, for busy time, latencies and idle timeouts
+    updateTimerClock(wheel);
+
+    while (uringNextCqe(w, &cqe))
+    {
+      user_data = cqe.user_data;
+      res = cqe.res;
+      flags = cqe.flags;
+
+      ep = (struct EndPointFd*) (user_data & ~(unsigned long) URING_OP_MASK);
+      switch (user_data & URING_OP_MASK)
+      {
+        case URING_OP_ACCEPT:
+          uringAcceptDone(w, (struct UringAccept*) ep, res, flags, thread_index);
+          break;
+
+        case URING_OP_RECV:
+          uringRecvDone(w, ep, res, flags, thread_index);
+          uringReleasePair(w, ep->pair, thread_index);
+          break;
+
+        case URING_OP_SEND:
+          uringSendDone(w, ep, res, thread_index);
+          uringReleasePair(w, ep->pair, thread_index);
+          break;
+
+        case URING_OP_CONNECT:
+          uringConnectDone(w, ep, res, thread_index);
+          uringReleasePair(w, ep->pair, thread_index);
+          break;
+
+        case URING_OP_WAKE:
+          clearRcuWake(thread_index);
+          if (!(flags & IORING_CQE_F_MORE))
+          {
+            uringArmWake(w, thread_index);
+          }
+          break;
+      }
+    }
+    uringRearmStarved(w, thread_index);
+    uringResumeAccepts(w, thread_index);
+
+    // close pairs that went without relaying for longer than their rule's idle timeout
+    for (pair = expireTimers(wheel); pair != NULL; pair = next_pair)
+    {
+      next_pair = pair->timer_next;
+      printf("Idle timeout for client fd %i\n", pair->clnt.fd);
+      addStat(&pair->route->stats[thread_index].idle_timeouts, 1);
+      uringClosePair(w, pair, thread_index);
+      uringReleasePair(w, pair, thread_index);
+    }
+    addBusyTime(thread_index, &wheel->now);
+  }
+  return 0;
+}
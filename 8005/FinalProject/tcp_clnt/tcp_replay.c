@@ -0,0 +1,549 @@
+/*---------------------------------------------------------------------------------------
+--	SOURCE FILE:		tcp_replay.c - Replays a port_fwd capture against a server.
+--
+--	PROGRAM:		tcp_replay
+--
+--	FUNCTIONS:		Berkeley Socket API
+--
+--	NOTES:
+--	The program reads a capture file written by port_fwd -w and opens a connection to the
+-- given host and port for each captured connection, at the time it was opened.  Each
+-- connection sends what its client sent, at the times it was sent, and waits for as many
+-- bytes as its server sent in reply, timing how long each reply takes.  The capture is
+-- played at its own speed, a multiple of it, or as fast as possible.
+---------------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+
+#define BUFLEN 65536            // Receive buffer length
+#define REPLY_TIMEOUT_SEC 5     // Longest wait for a reply before the connection is given up
+#define MAX_RUNNING 1024        // Most connections replayed at once, later ones wait for one to finish
+#define FILENAME "replay_connections.txt"
+
+// capture format - must match port_fwd_capture.c
+#define CAPTURE_HEADER_LEN 16
+#define CAPTURE_MAGIC "PFWDCAP1"
+#define CAPTURE_OPEN 1
+#define CAPTURE_CLIENT 2
+#define CAPTURE_SERVER 3
+#define CAPTURE_FIN 4
+#define CAPTURE_CLOSE 5
+
+// one record of a captured connection
+struct Record {
+  int type;
+  int len;
+  long long usec;   // time since the capture started
+  char *data;       // bytes sent by the client, points into the capture
+} Record;
+
+// a captured connection and the results of replaying it
+struct Replay {
+  unsigned int id;
+  int num_records;
+  int capacity;
+  struct Record *records;
+  // results
+  int failed;             // the connection could not be made, or a reply did not arrive in full
+  long long bytes_sent;
+  long long bytes_received;
+  int num_latencies;
+  long long *latency_usec; // time from sending each request to receiving all of its reply
+} Replay;
+
+int connectReplay();
+void* replayConnection(void*);
+void reportReplay(struct Replay*);
+long long timeval_diff(struct timeval*, struct timeval*, struct timeval*);
+void closeFd(int);
+
+char *host;
+int port;
+double speed;   // multiple of the captured speed, 0 for as fast as possible
+struct timespec replay_start;
+FILE *file;
+pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+int running = 0;  // replay threads that have not finished, each is detached and counts itself out
+pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t running_done = PTHREAD_COND_INITIALIZER; // signalled when a replay thread finishes
+
+static unsigned long long getCapture64(unsigned char *p)
+{
+  uint32_t high, low;
+
+  memcpy(&high, p, 4);
+  memcpy(&low, p + 4, 4);
+  return ((unsigned long long) ntohl(high) << 32) | ntohl(low);
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+  long long x = *(const long long*) a, y = *(const long long*) b;
+  return (x > y) - (x < y);
+}
+
+static int compareStart(const void *a, const void *b)
+{
+  const struct Replay *x = a, *y = b;
+  return (x->records[0].usec > y->records[0].usec) - (x->records[0].usec < y->records[0].usec);
+}
+
+// sleep until usec after the replay started, scaled by speed
+static void waitUntil(long long usec)
+{
+  struct timespec when;
+  long long nsec;
+
+  if (speed == 0)
+  {
+    return;
+  }
+  nsec = replay_start.tv_nsec + (long long) (usec * 1000 / speed);
+  when.tv_sec = replay_start.tv_sec + nsec / 1000000000LL;
+  when.tv_nsec = nsec % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR);
+}
+
+// read the capture at path and group its records by connection, in the order the connections were opened
+// returns the number of connections, or -1 if the capture could not be read
+int readCapture(char *path, char **capture, struct Replay **replays, long long *duration_usec)
+{
+  FILE *in;
+  long size, pos;
+  unsigned char *p;
+  unsigned int id;
+  uint16_t len;
+  int i, payload = 0, num_ids = 0, num_replays = 0;
+  struct Replay *by_id = NULL, *tmp;
+  struct Record *record;
+
+  if ((in = fopen(path, "r")) == NULL || fseek(in, 0, SEEK_END) == -1 || (size = ftell(in)) < CAPTURE_HEADER_LEN)
+  {
+    fprintf(stderr, "Can't read capture file: %s\n", path);
+    return -1;
+  }
+  rewind(in);
+  if ((*capture = malloc(size)) == NULL || fread(*capture, 1, size, in) != size)
+  {
+    fprintf(stderr, "Can't read capture file: %s\n", path);
+    return -1;
+  }
+  fclose(in);
+  if (memcmp(*capture, CAPTURE_MAGIC, 8) != 0)
+  {
+    fprintf(stderr, "Not a capture file: %s\n", path);
+    return -1;
+  }
+
+  // a record cut short at the end of the file, as when port_fwd was killed while writing it, is left out
+  *duration_usec = 0;
+  for (pos = 16; pos + CAPTURE_HEADER_LEN <= size; pos += CAPTURE_HEADER_LEN + payload)
+  {
+    p = (unsigned char*) *capture + pos;
+    memcpy(&id, p, 4);
+    id = ntohl(id);
+    memcpy(&len, p + 6, 2);
+    len = ntohs(len);
+    payload = (p[4] == CAPTURE_CLIENT) ? len : 0;
+    if (pos + CAPTURE_HEADER_LEN + payload > size || id == 0)
+    {
+      break;
+    }
+
+    // connection ids count up from 1, so connections are kept in an array indexed by id
+    // a connection whose open is missing, as when port_fwd stopped capturing it, is left out
+    if (id >= num_ids)
+    {
+      if ((tmp = realloc(by_id, sizeof(struct Replay) * (id + 1) * 2)) == NULL)
+      {
+        perror("realloc");
+        return -1;
+      }
+      by_id = tmp;
+      memset(by_id + num_ids, 0, sizeof(struct Replay) * ((id + 1) * 2 - num_ids));
+      num_ids = (id + 1) * 2;
+    }
+    tmp = &by_id[id];
+    if (tmp->num_records == 0 && p[4] != CAPTURE_OPEN)
+    {
+      continue;
+    }
+    if (tmp->num_records == tmp->capacity)
+    {
+      tmp->capacity = (tmp->capacity == 0) ? 16 : tmp->capacity * 2;
+      if ((record = realloc(tmp->records, sizeof(struct Record) * tmp->capacity)) == NULL)
+      {
+        perror("realloc");
+        return -1;
+      }
+      tmp->records = record;
+    }
+    record = &tmp->records[tmp->num_records++];
+    record->type = p[4];
+    record->len = len;
+    record->usec = getCapture64(p + 8);
+    record->data = (char*) p + CAPTURE_HEADER_LEN;
+    tmp->id = id;
+    if (record->usec > *duration_usec)
+    {
+      *duration_usec = record->usec;
+    }
+  }
+
+  if ((*replays = malloc(sizeof(struct Replay) * (num_ids + 1))) == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+  for (i = 0; i < num_ids; i++)
+  {
+    if (by_id[i].num_records > 0)
+    {
+      (*replays)[num_replays++] = by_id[i];
+    }
+  }
+  free(by_id);
+  qsort(*replays, num_replays, sizeof(struct Replay), compareStart);
+  return num_replays;
+}
+
+int main (int argc, char **argv)
+{
+  int i, num_replays, failed = 0, num_latencies = 0;
+  char *capture, *endptr;
+  long long duration_usec, bytes_sent = 0, bytes_received = 0, sum_usec = 0, *latencies;
+  struct Replay *replays;
+  struct sigaction act;
+  struct timeval start, end;
+  pthread_t thread_id;
+  pthread_attr_t attr;
+
+  switch(argc)
+  {
+    case 4:
+    case 5:
+      host = argv[2];
+      errno = 0;
+      port = strtol(argv[3], &endptr, 10);
+      if (errno != 0 || *endptr != '\0' || port < 1 || port > 65535)
+      {
+        fprintf(stderr, "Invalid port: %s\n", argv[3]);
+        exit(1);
+      }
+      speed = 1;
+      if (argc == 5 && strcmp(argv[4], "max") == 0)
+      {
+        speed = 0;
+      }
+      else if (argc == 5 && ((speed = strtod(argv[4], &endptr)) <= 0 || *endptr != '\0'))
+      {
+        fprintf(stderr, "Invalid speed: %s\n", argv[4]);
+        exit(1);
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: %s <capture file> <host> <port> [speed, a multiple of the captured speed or max (default 1)]\n", argv[0]);
+      exit(1);
+  }
+
+  if ((num_replays = readCapture(argv[1], &capture, &replays, &duration_usec)) == -1)
+  {
+    exit(1);
+  }
+  printf("Read %i connections over %.3f s from %s\n", num_replays, duration_usec / 1e6, argv[1]);
+
+  // setup the signal handler to close the output file when CTRL-c is received
+  act.sa_handler = closeFd;
+  act.sa_flags = 0;
+  if ((sigemptyset(&act.sa_mask) == -1 || sigaction(SIGINT, &act, NULL) == -1))
+  {
+    perror("Failed to set SIGINT handler");
+    exit(1);
+  }
+
+  if ((file = fopen(FILENAME, "w")) == NULL)
+  {
+    printf("Can't open output file: %s\n", FILENAME);
+    exit(1);
+  }
+  fprintf(file, "Connection | Replies | Bytes Sent | Bytes Received | Avg Reply Time | Result\n");
+  fprintf(file, "______________________________________________________________________________\n");
+
+  // replay threads are detached so each is reaped as soon as it finishes, not at the end of the capture
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  // create a thread for each connection when it was opened in the capture, once fewer than MAX_RUNNING are open
+  gettimeofday(&start, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &replay_start);
+  for (i = 0; i < num_replays; i++)
+  {
+    waitUntil(replays[i].records[0].usec);
+    pthread_mutex_lock(&running_lock);
+    while (running == MAX_RUNNING)
+    {
+      pthread_cond_wait(&running_done, &running_lock);
+    }
+    running++;
+    pthread_mutex_unlock(&running_lock);
+
+    // a connection that can't get a thread fails on its own, the others still replay
+    if ((errno = pthread_create(&thread_id, &attr, replayConnection, (void*) &replays[i])) != 0)
+    {
+      perror("pthread_create");
+      replays[i].failed = 1;
+      reportReplay(&replays[i]);
+      pthread_mutex_lock(&running_lock);
+      running--;
+      pthread_mutex_unlock(&running_lock);
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  // wait for the connections still replaying
+  pthread_mutex_lock(&running_lock);
+  while (running > 0)
+  {
+    pthread_cond_wait(&running_done, &running_lock);
+  }
+  pthread_mutex_unlock(&running_lock);
+
+  for (i = 0; i < num_replays; i++)
+  {
+    failed += replays[i].failed;
+    bytes_sent += replays[i].bytes_sent;
+    bytes_received += replays[i].bytes_received;
+    num_latencies += replays[i].num_latencies;
+  }
+  gettimeofday(&end, NULL);
+  fclose(file);
+
+  // reply times of every connection together, for percentiles
+  if ((latencies = malloc(sizeof(long long) * (num_latencies + 1))) == NULL)
+  {
+    perror("malloc");
+    exit(1);
+  }
+  for (i = 0, num_latencies = 0; i < num_replays; i++)
+  {
+    memcpy(latencies + num_latencies, replays[i].latency_usec, sizeof(long long) * replays[i].num_latencies);
+    num_latencies += replays[i].num_latencies;
+  }
+  qsort(latencies, num_latencies, sizeof(long long), compareLatency);
+  for (i = 0; i < num_latencies; i++)
+  {
+    sum_usec += latencies[i];
+  }
+
+  printf("Replayed %i connections (%i failed) in %.3f s, %lld bytes sent, %lld bytes received\n", num_replays, failed,
+    timeval_diff(NULL, &end, &start) / 1e6, bytes_sent, bytes_received);
+  if (num_latencies > 0)
+  {
+    printf("%i replies, reply time usec: avg %lld, p50 %lld, p90 %lld, p99 %lld, max %lld\n", num_latencies, sum_usec / num_latencies,
+      latencies[num_latencies / 2], latencies[num_latencies * 9 / 10], latencies[num_latencies * 99 / 100], latencies[num_latencies - 1]);
+  }
+  return failed > 0;
+}
+
+// connect to the replay target
+// returns the socket, or -1 if the connection could not be made
+int connectReplay()
+{
+  struct sockaddr_in server;
+  struct addrinfo hints, *res;
+  struct timeval timeout;
+  int sd, on = 1;
+
+  // Create the socket
+  if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+  {
+    perror("Cannot create socket");
+    return -1;
+  }
+  bzero((char *)&server, sizeof(struct sockaddr_in));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+  {
+    fprintf(stderr, "Can't resolve %s\n", host);
+    close(sd);
+    return -1;
+  }
+  server.sin_addr = ((struct sockaddr_in*) res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+
+  // chunks are sent as they were captured rather than coalesced, and a reply that stalls gives the connection up
+  timeout.tv_sec = REPLY_TIMEOUT_SEC;
+  timeout.tv_usec = 0;
+  setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (connect(sd, (struct sockaddr *)&server, sizeof(server)) == -1)
+  {
+    perror("connect");
+    close(sd);
+    return -1;
+  }
+  return sd;
+}
+
+// add a reply time to replay
+// returns 0 if successful, -1 if out of memory
+static int addLatency(struct Replay *replay, int *capacity, long long usec)
+{
+  long long *tmp;
+
+  if (replay->num_latencies == *capacity)
+  {
+    *capacity = (*capacity == 0) ? 16 : *capacity * 2;
+    if ((tmp = realloc(replay->latency_usec, sizeof(long long) * *capacity)) == NULL)
+    {
+      perror("realloc");
+      return -1;
+    }
+    replay->latency_usec = tmp;
+  }
+  replay->latency_usec[replay->num_latencies++] = usec;
+  return 0;
+}
+
+// replay one captured connection - send what the client sent when it sent it, and time each reply
+// a reply is every byte the server sent after a request, and the request is everything the client sent before it
+void* replayConnection(void* replay_ptr)
+{
+  struct Replay *replay = (struct Replay*) replay_ptr;
+  struct Record *record;
+  struct timeval request_sent, reply_received;
+  char rbuf[BUFLEN];
+  int sd, i, n, expected, waiting = 0, capacity = 0;
+
+  if ((sd = connectReplay()) == -1)
+  {
+    replay->failed = 1;
+  }
+
+  for (i = 1; i < replay->num_records && !replay->failed; i++)
+  {
+    record = &replay->records[i];
+    if (record->type == CAPTURE_CLIENT)
+    {
+      waitUntil(record->usec);
+      for (n = 0; n < record->len && !replay->failed; n += expected)
+      {
+        if ((expected = send(sd, record->data + n, record->len - n, MSG_NOSIGNAL)) == -1)
+        {
+          perror("send");
+          replay->failed = 1;
+        }
+      }
+      replay->bytes_sent += record->len;
+      gettimeofday(&request_sent, NULL);
+      waiting = 1;
+    }
+    else if (record->type == CAPTURE_SERVER)
+    {
+      for (expected = record->len; expected > 0 && !replay->failed; expected -= n)
+      {
+        if ((n = recv(sd, rbuf, (expected < BUFLEN) ? expected : BUFLEN, 0)) <= 0)
+        {
+          fprintf(stderr, "Connection %u: %s\n", replay->id, (n == 0) ? "closed by server" : "reply timed out");
+          replay->failed = 1;
+          break;
+        }
+        replay->bytes_received += n;
+      }
+
+      // the reply is complete once the server has sent everything it did before the client's next move
+      if (!replay->failed && waiting && (i + 1 == replay->num_records || replay->records[i + 1].type != CAPTURE_SERVER))
+      {
+        gettimeofday(&reply_received, NULL);
+        replay->failed = addLatency(replay, &capacity, timeval_diff(NULL, &reply_received, &request_sent)) == -1;
+        waiting = 0;
+      }
+    }
+    else if (record->type == CAPTURE_FIN)
+    {
+      shutdown(sd, SHUT_WR);
+    }
+    else if (record->type == CAPTURE_CLOSE)
+    {
+      break;
+    }
+  }
+  if (sd != -1)
+  {
+    close(sd);
+  }
+  reportReplay(replay);
+
+  pthread_mutex_lock(&running_lock);
+  running--;
+  pthread_cond_signal(&running_done);
+  pthread_mutex_unlock(&running_lock);
+  return 0;
+}
+
+// write the results of a replayed connection to the output file
+void reportReplay(struct Replay *replay)
+{
+  int i;
+  long long avg_usec = 0;
+
+  for (i = 0; i < replay->num_latencies; i++)
+  {
+    avg_usec += replay->latency_usec[i];
+  }
+  if (replay->num_latencies > 0)
+  {
+    avg_usec /= replay->num_latencies;
+  }
+  pthread_mutex_lock(&file_lock);
+  fprintf(file, "%*u | %*i | %*lld | %*lld | %*lld | %s\n", 10, replay->id, 7, replay->num_latencies, 10, replay->bytes_sent,
+    14, replay->bytes_received, 14, avg_usec, replay->failed ? "failed" : "ok");
+  pthread_mutex_unlock(&file_lock);
+}
+
+// calculate difference in time between end_time and start_time (return usec)
+long long timeval_diff(struct timeval *difference, struct timeval *end_time, struct timeval *start_time)
+{
+  struct timeval temp_diff;
+
+  if (difference == NULL)
+  {
+    difference = &temp_diff;
+  }
+
+  difference->tv_sec = end_time->tv_sec - start_time->tv_sec;
+  difference->tv_usec = end_time->tv_usec - start_time->tv_usec;
+
+  while (difference->tv_usec < 0)
+  {
+    difference->tv_usec += 1000000;
+    difference->tv_sec -= 1;
+  }
+
+  return 1000000LL * difference->tv_sec + difference->tv_usec;
+}
+
+void closeFd(int signo)
+{
+  fclose(file);
+  exit(EXIT_SUCCESS);
+}